@@ -1,5 +1,7 @@
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -20,10 +22,17 @@ static char* scopeId = NULL;
 static IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
 static const int keepalivePeriodSeconds = 20;
 static bool iothubAuthenticated = false;
+static AzureIoTHub_ConnectionState connectionState = AzureIoTHub_NetworkDown;
+static AZUREIOTHUB_CONNECTION_STATE_CALLBACK connectionStateCallback = NULL;
+// Consecutive failed connection attempts, and the wait before the next one.
+static int reconnectAttempts = 0;
+static int reconnectDelaySeconds = 0;
+static unsigned int reconnectJitterSeed = 0;
 // LED
 static int systemStatusDPSLedGpioFd = -1;
 static int systemStatusIoTHubStatusLedGpioFd = -1;
 static int systemStatusNetworkLedGpioFd = -1;
+static int systemStatusIoTRetryLedGpioFd = -1;
 
 static EventLoop* eventLoop = NULL;
 static EventLoopTimer* azureTimer = NULL;
@@ -36,6 +45,20 @@ static const int AzureIoTMinReconnectPeriodSeconds = 60;      // back off when r
 static const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60; // back off limit
 static int azureIoTPollPeriodSeconds = -1;
 
+// While connected the client is pumped adaptively: right after something was handed to it,
+// quickly while confirmations are outstanding or requests came in recently, and otherwise
+// a few times per keepalive period.
+static const long AzureIoTImmediatePollMilliseconds = 1;
+static const long AzureIoTBusyPollMilliseconds = 100;     // confirmations outstanding
+static const long AzureIoTActivePollMilliseconds = 250;   // after inbound requests
+static const int AzureIoTActiveLingerSeconds = 10;
+static const int AzureIoTIdlePollsPerKeepalive = 10;
+static bool doWorkRequested = false;
+static int pendingSendCount = 0;
+static int pendingReportedStates = 0;
+static struct timespec lastInboundAt;
+static AzureIoTHub_DoWorkStats doWorkStats;
+
 static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* userContextCallback); static void TwinReportState(const char* jsonState);
 static void ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE message, void* userContextCallback);
 static void DeviceTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
@@ -49,32 +72,214 @@ static void AzureIoTHub_SendEventCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT resu
 
 static AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK iothubMessageCallback = NULL;
 static AZUREIOTHUB_DEVICE_TWIN_CALLBACK iothubTwinCallback = NULL;
-static AZUREIOTHUB_DEVICE_METHOD_CALLBACK iothubMethodCallback = NULL;
 
-void AzureIoTHub_SetRequestHandle(AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK msgCallback, AZUREIOTHUB_DEVICE_TWIN_CALLBACK twinCallback, AZUREIOTHUB_DEVICE_METHOD_CALLBACK methodCallback)
+// Direct methods by name, open addressed with twice the slots so lookups stay short.
+typedef struct {
+    const char* name;
+    AZUREIOTHUB_METHOD_HANDLER handler;
+    unsigned int flags;
+} MethodEntry;
+#define METHOD_TABLE_SLOTS (2 * AZUREIOTHUB_MAX_METHODS)
+static MethodEntry methodTable[METHOD_TABLE_SLOTS];
+static int methodCount = 0;
+
+struct AzureIoTHub_MethodResponse {
+    char body[AZUREIOTHUB_METHOD_RESPONSE_MAX_BYTES];
+    size_t length;
+    bool overflow;
+};
+
+// Messages handed to the client and awaiting their confirmation. A slot is the
+// SendEventAsync context of its message and owns a pool buffer holding the body.
+typedef struct {
+    bool inUse;
+    unsigned char* body;
+    size_t length;
+    AZUREIOTHUB_SEND_CALLBACK callback;
+    void* context;
+    unsigned long id;
+    struct timespec enqueuedAt;
+} PendingSend;
+static PendingSend pendingSends[AZUREIOTHUB_MAX_SEND_WINDOW];
+static int sendWindow = 0;
+static int messagePoolSlots = 0;
+static size_t messagePoolSlotBytes = 0;
+static unsigned char* messagePool = NULL;
+static const int AzureIoTDefaultMessagePoolSlots = 8;
+static const size_t AzureIoTDefaultMessagePoolSlotBytes = 4096;
+static unsigned long nextMessageId = 1;
+static AzureIoTHub_SendStats sendStats;
+
+const unsigned int AzureIoTHub_LatencyBucketLimitsMs[AZUREIOTHUB_LATENCY_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+void AzureIoTHub_SetRequestHandle(AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK msgCallback, AZUREIOTHUB_DEVICE_TWIN_CALLBACK twinCallback)
 {
     iothubMessageCallback = msgCallback;
     iothubTwinCallback = twinCallback;
-    iothubMethodCallback = methodCallback;
 }
 
+/// <summary>
+/// Returns the slot holding name, or the empty slot it would go in.
+/// </summary>
+static MethodEntry* FindMethodSlot(const char* name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    // The table is never full, so probing ends at an empty slot.
+    size_t slot = hash % METHOD_TABLE_SLOTS;
+    while (methodTable[slot].name != NULL && strcmp(methodTable[slot].name, name) != 0) {
+        slot = (slot + 1) % METHOD_TABLE_SLOTS;
+    }
+    return &methodTable[slot];
+}
 
-bool AzureIoTHub_CheckNetworkStatus(int systemStatusNetworkLedFd)
+bool AzureIoTHub_RegisterMethod(const char* name, AZUREIOTHUB_METHOD_HANDLER handler, unsigned int flags)
 {
-    systemStatusNetworkLedGpioFd = systemStatusNetworkLedFd;
+    if (name == NULL || handler == NULL) {
+        return false;
+    }
+    MethodEntry* entry = FindMethodSlot(name);
+    if (entry->name == NULL) {
+        if (methodCount >= AZUREIOTHUB_MAX_METHODS) {
+            Log_Debug("ERROR: no room to register method %s.\n", name);
+            return false;
+        }
+        methodCount++;
+        entry->name = name;
+    }
+    entry->handler = handler;
+    entry->flags = flags;
+    return true;
+}
 
-    bool isNetworkingReady = false;
-    while (isNetworkingReady == false) {
-        if ((Networking_IsNetworkingReady(&isNetworkingReady) == -1) || !isNetworkingReady) {
-            Log_Debug("WARNING: Network is not ready. Device cannot connect until network is ready.\n");
+static void AppendResponseBytes(AzureIoTHub_MethodResponse* response, const char* bytes, size_t length)
+{
+    if (response->overflow || length >= sizeof(response->body) - response->length) {
+        response->overflow = true;
+        return;
+    }
+    memcpy(response->body + response->length, bytes, length);
+    response->length += length;
+}
+
+void AzureIoTHub_MethodResponse_Append(AzureIoTHub_MethodResponse* response, const char* format, ...)
+{
+    if (response->overflow) {
+        return;
+    }
+    size_t available = sizeof(response->body) - response->length;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(response->body + response->length, available, format, args);
+    va_end(args);
+    if (written < 0 || (size_t)written >= available) {
+        response->overflow = true;
+        return;
+    }
+    response->length += (size_t)written;
+}
+
+void AzureIoTHub_MethodResponse_SetMessage(AzureIoTHub_MethodResponse* response, const char* message)
+{
+    response->length = 0;
+    response->overflow = false;
+    AppendResponseBytes(response, "\"", 1);
+    for (const char* c = message; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            char escaped[2] = {'\\', *c};
+            AppendResponseBytes(response, escaped, sizeof(escaped));
         }
-        if (isNetworkingReady) {
-            GPIO_SetValue(systemStatusNetworkLedGpioFd, GPIO_Value_High);
-            break;
+        else if ((unsigned char)*c < 0x20) {
+            AzureIoTHub_MethodResponse_Append(response, "\\u%04x", (unsigned int)(unsigned char)*c);
         }
-        sleep(1000);
+        else {
+            AppendResponseBytes(response, c, 1);
+        }
+    }
+    AppendResponseBytes(response, "\"", 1);
+}
+
+
+static void SetStatusLed(int fd, bool on)
+{
+    if (fd >= 0) {
+        GPIO_SetValue(fd, on ? GPIO_Value_High : GPIO_Value_Low);
     }
+}
 
+/// <summary>
+///     The status LEDs only ever reflect connectionState.
+/// </summary>
+static void RenderConnectionState(void)
+{
+    SetStatusLed(systemStatusNetworkLedGpioFd, connectionState != AzureIoTHub_NetworkDown);
+    SetStatusLed(systemStatusDPSLedGpioFd,
+        connectionState == AzureIoTHub_Provisioning || connectionState == AzureIoTHub_Connected);
+    SetStatusLed(systemStatusIoTHubStatusLedGpioFd, connectionState == AzureIoTHub_Connected);
+    SetStatusLed(systemStatusIoTRetryLedGpioFd, connectionState != AzureIoTHub_Backoff);
+}
+
+static void SetConnectionState(AzureIoTHub_ConnectionState state)
+{
+    if (state == connectionState) {
+        return;
+    }
+    Log_Debug("INFO: IoT Hub connection %s -> %s.\n", AzureIoTHub_ConnectionStateToString(connectionState),
+        AzureIoTHub_ConnectionStateToString(state));
+    connectionState = state;
+    RenderConnectionState();
+    if (connectionStateCallback != NULL) {
+        connectionStateCallback(state);
+    }
+}
+
+const char* AzureIoTHub_ConnectionStateToString(AzureIoTHub_ConnectionState state)
+{
+    switch (state) {
+    case AzureIoTHub_NetworkDown:
+        return "NetworkDown";
+    case AzureIoTHub_Provisioning:
+        return "Provisioning";
+    case AzureIoTHub_Connected:
+        return "Connected";
+    case AzureIoTHub_Backoff:
+        return "Backoff";
+    default:
+        return "Unknown";
+    }
+}
+
+AzureIoTHub_ConnectionState AzureIoTHub_GetConnectionState(void)
+{
+    return connectionState;
+}
+
+void AzureIoTHub_GetConnectionStatus(AzureIoTHub_ConnectionStatus* status)
+{
+    status->state = connectionState;
+    status->reconnectAttempts = reconnectAttempts;
+    status->reconnectDelaySeconds = reconnectDelaySeconds;
+}
+
+void AzureIoTHub_SetConnectionStateCallback(AZUREIOTHUB_CONNECTION_STATE_CALLBACK callback)
+{
+    connectionStateCallback = callback;
+}
+
+bool AzureIoTHub_CheckNetworkStatus(int systemStatusNetworkLedFd)
+{
+    systemStatusNetworkLedGpioFd = systemStatusNetworkLedFd;
+
+    bool isNetworkingReady = false;
+    if ((Networking_IsNetworkingReady(&isNetworkingReady) == -1) || !isNetworkingReady) {
+        Log_Debug("WARNING: Network is not ready. Device cannot connect until network is ready.\n");
+        isNetworkingReady = false;
+    }
+    RenderConnectionState();
     return isNetworkingReady;
 }
 
@@ -101,41 +306,142 @@ static const char* GetAzureSphereProvisioningResultString(
         return "UNKNOWN_RETURN_VALUE";
     }
 }
+static void ArmAzureTimer(long milliseconds)
+{
+    struct timespec delay = { .tv_sec = milliseconds / 1000, .tv_nsec = (milliseconds % 1000) * 1000000 };
+    if (azureTimer != NULL && SetEventLoopTimerOneShot(azureTimer, &delay) != 0) {
+        Log_Debug("ERROR: Failure arming azure timer: %s (%d).\n", strerror(errno), errno);
+    }
+}
+
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
-///     When the SAS Token for a device expires the connection needs to be recreated
-///     which is why this is not simply a one time call.
+///     Picks when the azure timer fires next from the connection state and outstanding work.
 /// </summary>
-void AzureIoTHub_SetupAzureClient(char* scopeIdReq, EventLoop* appEventLoop, int dpsStatusLedFd, int IoTHubStatusLedFd)
+static void ScheduleAzureTimer(void)
 {
-    scopeId = scopeIdReq;
-    systemStatusDPSLedGpioFd = dpsStatusLedFd;
-    systemStatusIoTHubStatusLedGpioFd = IoTHubStatusLedFd;
+    long delay = azureIoTPollPeriodSeconds * 1000L;
+    if (connectionState == AzureIoTHub_Backoff) {
+        delay = reconnectDelaySeconds * 1000L;
+    }
+    else if (connectionState == AzureIoTHub_Connected) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (doWorkRequested) {
+            delay = AzureIoTImmediatePollMilliseconds;
+        }
+        else if (pendingSendCount > 0 || pendingReportedStates > 0) {
+            delay = AzureIoTBusyPollMilliseconds;
+        }
+        else if (now.tv_sec - lastInboundAt.tv_sec < AzureIoTActiveLingerSeconds) {
+            delay = AzureIoTActivePollMilliseconds;
+        }
+        else {
+            delay = keepalivePeriodSeconds * 1000L / AzureIoTIdlePollsPerKeepalive;
+        }
+    }
+    ArmAzureTimer(delay);
+}
+
+/// <summary>
+///     Pumps the client soon after work was handed to it. DoWork is not called from here
+///     because its callbacks could then run inside the caller.
+/// </summary>
+static void RequestDoWork(void)
+{
+    if (!doWorkRequested) {
+        doWorkRequested = true;
+        ArmAzureTimer(AzureIoTImmediatePollMilliseconds);
+    }
+}
+
+static void NoteInboundActivity(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &lastInboundAt);
+}
+
+static void DoWork(void)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long elapsed = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+    doWorkStats.calls++;
+    doWorkStats.totalMicroseconds += elapsed;
+    if (elapsed > doWorkStats.maxMicroseconds) {
+        doWorkStats.maxMicroseconds = elapsed;
+    }
+}
+
+void AzureIoTHub_GetDoWorkStats(AzureIoTHub_DoWorkStats* stats)
+{
+    *stats = doWorkStats;
+}
+
+/// <summary>
+///     Waits before the next connection attempt. The wait doubles from
+///     AzureIoTMinReconnectPeriodSeconds up to AzureIoTMaxReconnectPeriodSeconds, and a random
+///     half of it is dropped so devices recovering from the same outage do not retry in step.
+/// </summary>
+static void EnterBackoff(void)
+{
+    if (reconnectJitterSeed == 0) {
+        // Devices boot identically; the clocks at the first failure are what differs.
+        struct timespec realtime, monotonic;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        clock_gettime(CLOCK_MONOTONIC, &monotonic);
+        reconnectJitterSeed = (unsigned int)(realtime.tv_nsec ^ monotonic.tv_nsec ^ realtime.tv_sec) | 1u;
+    }
+
+    int ceiling = AzureIoTMinReconnectPeriodSeconds;
+    for (int i = 0; i < reconnectAttempts && ceiling < AzureIoTMaxReconnectPeriodSeconds; i++) {
+        ceiling *= 2;
+    }
+    if (ceiling > AzureIoTMaxReconnectPeriodSeconds) {
+        ceiling = AzureIoTMaxReconnectPeriodSeconds;
+    }
+    reconnectAttempts++;
+    reconnectDelaySeconds = ceiling / 2 + rand_r(&reconnectJitterSeed) % (ceiling / 2 + 1);
+
+    Log_Debug("INFO: retrying IoT Hub connection in %d seconds (attempt %d).\n", reconnectDelaySeconds,
+        reconnectAttempts);
+    SetConnectionState(AzureIoTHub_Backoff);
+}
+
+/// <summary>
+///     Creates the iothubClientHandle through DPS. When the SAS Token for a device expires
+///     the connection needs to be recreated which is why this is not simply a one time call.
+///     The SDK call blocks for up to its timeout, so this only runs from the azure timer.
+/// </summary>
+static void ProvisionClient(void)
+{
+    SetConnectionState(AzureIoTHub_Provisioning);
+    iothubAuthenticated = false;
     if (iothubClientHandle != NULL) {
         IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
+        iothubClientHandle = NULL;
+        pendingReportedStates = 0;
     }
     AZURE_SPHERE_PROV_RETURN_VALUE provResult =
         IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
             &iothubClientHandle);
-    GPIO_SetValue(systemStatusDPSLedGpioFd, GPIO_Value_High);
 
     Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
         GetAzureSphereProvisioningResultString(provResult));
 
     if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
         Log_Debug("ERROR: Failed to create IoTHub Handle\n");
+        iothubClientHandle = NULL;
+        EnterBackoff();
         return;
     }
-    GPIO_SetValue(systemStatusIoTHubStatusLedGpioFd, GPIO_Value_High);
-
-
-    // Successfully connected, so make sure the polling frequency is back to the default
-    iothubAuthenticated = true;
 
     if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_KEEP_ALIVE,
         &keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
         Log_Debug("ERROR: Failure setting Azure IoT Hub client option \"%s\".\n",
             OPTION_KEEP_ALIVE);
+        EnterBackoff();
         return;
     }
     IoTHubDeviceClient_LL_SetDeviceTwinCallback(iothubClientHandle, DeviceTwinCallback, NULL);
@@ -143,30 +449,53 @@ void AzureIoTHub_SetupAzureClient(char* scopeIdReq, EventLoop* appEventLoop, int
     IoTHubDeviceClient_LL_SetConnectionStatusCallback(iothubClientHandle, ConnectionStatusCallback, NULL);
     IoTHubDeviceClient_LL_SetMessageCallback(iothubClientHandle, ReceiveMessageCallback, NULL);
 
+    iothubAuthenticated = true;
+    SetConnectionState(AzureIoTHub_Connected);
+}
+
+/// <summary>
+///     Starts the connection state machine. Nothing here waits for the network; the azure
+///     timer moves through NetworkDown, Provisioning, Connected and Backoff as needed.
+/// </summary>
+void AzureIoTHub_SetupAzureClient(char* scopeIdReq, EventLoop* appEventLoop, int dpsStatusLedFd, int IoTHubStatusLedFd,
+    int IoTRetryLedFd)
+{
+    scopeId = scopeIdReq;
+    systemStatusDPSLedGpioFd = dpsStatusLedFd;
+    systemStatusIoTHubStatusLedGpioFd = IoTHubStatusLedFd;
+    systemStatusIoTRetryLedGpioFd = IoTRetryLedFd;
+    RenderConnectionState();
+    if (messagePool == NULL) {
+        AzureIoTHub_InitMessagePool(AzureIoTDefaultMessagePoolSlots, AzureIoTDefaultMessagePoolSlotBytes);
+    }
+
     if (eventLoop == NULL) {
         eventLoop = appEventLoop;
         azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-        struct timespec azureTelemetryPeriod = { .tv_sec = azureIoTPollPeriodSeconds, .tv_nsec = 0 };
-        azureTimer =
-            CreateEventLoopPeriodicTimer(eventLoop, &AzureTimerEventHandler, &azureTelemetryPeriod);
+        azureTimer = CreateEventLoopDisarmedTimer(eventLoop, &AzureTimerEventHandler);
         if (azureTimer == NULL) {
             Log_Debug("ERROR: Failure creating azure timer!\n");
         }
         else {
+            ScheduleAzureTimer();
         }
     }
-    
 }
 
 void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* userContextCallback)
 {
     if (reason != IOTHUB_CLIENT_CONNECTION_OK) {
         Log_Debug("IoT Hub Disconnected\n");
-        GPIO_SetValue(systemStatusDPSLedGpioFd, GPIO_Value_Low);
     }
-    if (result == IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED) {
+    // The client is recreated once the backoff expires; it cannot be destroyed from its own callback.
+    if (result == IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED && iothubAuthenticated) {
         iothubAuthenticated = false;
-        GPIO_SetValue(systemStatusIoTHubStatusLedGpioFd, GPIO_Value_Low);
+        EnterBackoff();
+    }
+    else if (result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED && reconnectAttempts > 0) {
+        Log_Debug("INFO: IoT Hub connection authenticated after %d retries.\n", reconnectAttempts);
+        reconnectAttempts = 0;
+        reconnectDelaySeconds = 0;
     }
 }
 /// <summary>
@@ -175,58 +504,188 @@ void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLI
 static void AzureIoTHub_SendEventCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* context)
 {
     Log_Debug("INFO: Azure IoT Hub send telemetry event callback: status code %d.\n", result);
+
+    PendingSend* pending = context;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latencyMs = (now.tv_sec - pending->enqueuedAt.tv_sec) * 1000L +
+        (now.tv_nsec - pending->enqueuedAt.tv_nsec) / 1000000L;
+    int bucket = 0;
+    while (bucket < AZUREIOTHUB_LATENCY_BUCKETS - 1 && latencyMs >= (long)AzureIoTHub_LatencyBucketLimitsMs[bucket]) {
+        bucket++;
+    }
+    sendStats.latencyBuckets[bucket]++;
+    if ((unsigned int)result < AZUREIOTHUB_CONFIRMATION_RESULTS) {
+        sendStats.results[result]++;
+    }
+    if (result != IOTHUB_CLIENT_CONFIRMATION_OK) {
+        Log_Debug("WARNING: message %lu not delivered after %ld ms: status code %d.\n", pending->id, latencyMs, result);
+    }
+
+    if (pending->callback != NULL) {
+        pending->callback(result == IOTHUB_CLIENT_CONFIRMATION_OK, pending->body, pending->length, pending->context);
+    }
+    pending->inUse = false;
+    pendingSendCount--;
 }
 
 /// <summary>
-/// Azure timer event:  Check connection status and send telemetry
+/// Azure timer event: advance the connection state machine and let the client do its work.
 /// </summary>
 static void AzureTimerEventHandler(EventLoopTimer* timer)
 {
     if (ConsumeEventLoopTimerEvent(timer) != 0) {
         Log_Debug("ERROR: failure notify event consuming\n");
+    }
+    doWorkRequested = false;
+    if (scopeId == NULL) {
+        // Nothing to connect to; the timer stays disarmed.
+        Log_Debug("ScopeId needs to be set in the app_manifest CmdArgs for IoT Hub telemetry\n");
         return;
     }
     bool isNetworkingReady = false;
     if ((Networking_IsNetworkingReady(&isNetworkingReady) == -1) || !isNetworkingReady) {
-        Log_Debug("WARNING: Network is not ready. Device cannot connect until network is ready.\n");
-    }
-    if (scopeId == NULL) {
-        Log_Debug("ScopeId needs to be set in the app_manifest CmdArgs for IoT Hub telemetry\n");
         isNetworkingReady = false;
+        if (connectionState != AzureIoTHub_NetworkDown) {
+            Log_Debug("WARNING: Network is not ready. Device cannot connect until network is ready.\n");
+        }
     }
 
-    if (isNetworkingReady && iothubAuthenticated == false)
-    {
-        AzureIoTHub_SetupAzureClient(scopeId, eventLoop, systemStatusDPSLedGpioFd, systemStatusIoTHubStatusLedGpioFd);
+    switch (connectionState) {
+    case AzureIoTHub_NetworkDown:
+        if (isNetworkingReady) {
+            // A client which was connected before the outage reconnects by itself.
+            if (iothubAuthenticated) {
+                SetConnectionState(AzureIoTHub_Connected);
+            }
+            else {
+                ProvisionClient();
+            }
+        }
+        break;
+    case AzureIoTHub_Backoff:
+        // The timer only fires here once the backoff delay has passed.
+        if (isNetworkingReady) {
+            ProvisionClient();
+        }
+        else {
+            SetConnectionState(AzureIoTHub_NetworkDown);
+        }
+        break;
+    case AzureIoTHub_Connected:
+        if (!isNetworkingReady) {
+            SetConnectionState(AzureIoTHub_NetworkDown);
+        }
+        break;
+    default:
+        break;
     }
 
-    if (iothubAuthenticated) {
-        Log_Debug("INFO: iot hub work doing...\n");
-        IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+    if (connectionState == AzureIoTHub_Connected) {
+        DoWork();
     }
+    ScheduleAzureTimer();
+}
+
+bool AzureIoTHub_IsConnected(void)
+{
+    return connectionState == AzureIoTHub_Connected;
 }
 
 static int waitForSending = 1;
 static int loopIndex = 0;
 
-void AzureIoTHub_SendMessage(char* messageBody, int systemStatusIoTSendingLedFd, int systemStatusIoTRetryLedFd)
+void AzureIoTHub_SendMessage(char* messageBody, int systemStatusIoTSendingLedFd)
+{
+    AzureIoTHub_SendMessageBytes((const unsigned char*)messageBody, strlen(messageBody), NULL, NULL, NULL,
+        systemStatusIoTSendingLedFd);
+}
+
+/// <summary>
+///     Stamps the system and application properties IoT Hub routing can filter on.
+/// </summary>
+static void ApplyMessageOptions(IOTHUB_MESSAGE_HANDLE messageHandle, const AzureIoTHub_MessageOptions* options)
 {
-    if (iothubAuthenticated)
+    if (options->contentType != NULL && IoTHubMessage_SetContentTypeSystemProperty(messageHandle, options->contentType) != IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set message content type '%s'.\n", options->contentType);
+    }
+    if (options->contentEncoding != NULL && IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, options->contentEncoding) != IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set message content encoding '%s'.\n", options->contentEncoding);
+    }
+    if (options->messageId != NULL && IoTHubMessage_SetMessageId(messageHandle, options->messageId) != IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set message id '%s'.\n", options->messageId);
+    }
+    if (options->schemaVersion != NULL && IoTHubMessage_SetProperty(messageHandle, "schemaVersion", options->schemaVersion) != IOTHUB_MESSAGE_OK) {
+        Log_Debug("WARNING: unable to set message schema version '%s'.\n", options->schemaVersion);
+    }
+    for (size_t i = 0; i < options->propertyCount; i++) {
+        const AzureIoTHub_MessageProperty* property = &options->properties[i];
+        if (IoTHubMessage_SetProperty(messageHandle, property->name, property->value) != IOTHUB_MESSAGE_OK) {
+            Log_Debug("WARNING: unable to set message property '%s'.\n", property->name);
+        }
+    }
+}
+
+bool AzureIoTHub_SendMessageBytes(const unsigned char* messageBody, size_t messageLength,
+    const AzureIoTHub_MessageOptions* options, AZUREIOTHUB_SEND_CALLBACK callback, void* context,
+    int systemStatusIoTSendingLedFd)
+{
+    bool accepted = false;
+    if (connectionState == AzureIoTHub_Connected)
     {
-        IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(messageBody);
-        if (messageHandle == 0) {
+        PendingSend* pending = NULL;
+        if (pendingSendCount < sendWindow) {
+            for (int i = 0; i < messagePoolSlots; i++) {
+                if (!pendingSends[i].inUse) {
+                    pending = &pendingSends[i];
+                    break;
+                }
+            }
+        }
+        IOTHUB_MESSAGE_HANDLE messageHandle = NULL;
+        if (pending == NULL) {
+            // Backpressure: the caller keeps the message until the window has room.
+            sendStats.windowFull++;
+        }
+        else if (messageLength > messagePoolSlotBytes) {
+            Log_Debug("ERROR: message of %zu bytes exceeds the %zu byte message pool buffers.\n", messageLength,
+                messagePoolSlotBytes);
+        }
+        else if ((messageHandle = IoTHubMessage_CreateFromByteArray(messageBody, messageLength)) == NULL) {
             Log_Debug("Error: unable to create a new IoTHubMessage.\n");
         }
         else {
+            if (options != NULL) {
+                ApplyMessageOptions(messageHandle, options);
+            }
             if (((loopIndex++) % waitForSending) == 0) {
-                if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, AzureIoTHub_SendEventCallback, NULL) != IOTHUB_CLIENT_OK)
+                // The body stays in the pool slot until its confirmation so an undelivered
+                // message can be handed back.
+                pending->inUse = true;
+                memcpy(pending->body, messageBody, messageLength);
+                pending->length = messageLength;
+                pending->callback = callback;
+                pending->context = context;
+                pending->id = nextMessageId++;
+                clock_gettime(CLOCK_MONOTONIC, &pending->enqueuedAt);
+                if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, AzureIoTHub_SendEventCallback, pending) != IOTHUB_CLIENT_OK)
                 {
                     Log_Debug("ERROR: failure requesting IoTHubClient to send telemetry event.\n");
+                    pending->inUse = false;
                 }
                 else {
-                    Log_Debug("INFO: IoTHubClient accepted the telemetry event for delivery.\n");
+                    Log_Debug("INFO: IoTHubClient accepted telemetry event %lu for delivery.\n", pending->id);
+                    accepted = true;
+                    pendingSendCount++;
+                    sendStats.accepted++;
+                    if ((unsigned long)pendingSendCount > sendStats.maxInFlight) {
+                        sendStats.maxInFlight = (unsigned long)pendingSendCount;
+                    }
+                    RequestDoWork();
                 }
             }
+            // The client queues its own clone of the message.
+            IoTHubMessage_Destroy(messageHandle);
         }
         GPIO_Value_Type sendingStatusLED;
         int ledValue = GPIO_GetValue(systemStatusIoTSendingLedFd, &sendingStatusLED);
@@ -239,13 +698,58 @@ void AzureIoTHub_SendMessage(char* messageBody, int systemStatusIoTSendingLedFd,
             }
         }
     }
-    else {
-        GPIO_SetValue(systemStatusIoTRetryLedFd, GPIO_Value_Low);
-        if (AzureIoTHub_CheckNetworkStatus(systemStatusNetworkLedGpioFd)) {
-            AzureIoTHub_SetupAzureClient(scopeId, eventLoop, systemStatusDPSLedGpioFd,systemStatusIoTHubStatusLedGpioFd);
-        }
-        GPIO_SetValue(systemStatusIoTRetryLedFd, GPIO_Value_High);
+    return accepted;
+}
+
+int AzureIoTHub_InitMessagePool(int slots, size_t slotBytes)
+{
+    if (messagePool != NULL) {
+        errno = EBUSY;
+        return -1;
     }
+    if (slots < 1 || slots > AZUREIOTHUB_MAX_SEND_WINDOW || slotBytes == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    messagePool = malloc((size_t)slots * slotBytes);
+    if (messagePool == NULL) {
+        Log_Debug("ERROR: Could not allocate %d message buffers of %zu bytes.\n", slots, slotBytes);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < slots; i++) {
+        pendingSends[i].body = messagePool + (size_t)i * slotBytes;
+        pendingSends[i].inUse = false;
+    }
+    messagePoolSlots = slots;
+    messagePoolSlotBytes = slotBytes;
+    sendWindow = slots;
+    return 0;
+}
+
+void AzureIoTHub_SetSendWindow(int maxInFlight)
+{
+    if (maxInFlight < 1) {
+        maxInFlight = 1;
+    }
+    if (maxInFlight > messagePoolSlots) {
+        maxInFlight = messagePoolSlots;
+    }
+    sendWindow = maxInFlight;
+}
+
+int AzureIoTHub_GetSendWindowAvailable(void)
+{
+    if (connectionState != AzureIoTHub_Connected || pendingSendCount >= sendWindow) {
+        return 0;
+    }
+    return sendWindow - pendingSendCount;
+}
+
+void AzureIoTHub_GetSendStats(AzureIoTHub_SendStats* stats)
+{
+    *stats = sendStats;
+    stats->inFlight = (unsigned long)pendingSendCount;
 }
 
 static void ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE message, void* userContextCallback)
@@ -253,6 +757,7 @@ static void ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE message, void* userCont
     unsigned char* buffer;
     size_t length;
     IOTHUB_MESSAGE_RESULT result = IoTHubMessage_GetByteArray(message, &buffer, &length);
+    NoteInboundActivity();
     iothubMessageCallback(buffer, length);
   //  IoTHubMessage_Destroy(message);
 }
@@ -264,6 +769,7 @@ static void ReceiveMessageCallback(IOTHUB_MESSAGE_HANDLE message, void* userCont
 static void DeviceTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
     size_t payloadSize, void* userContextCallback)
 {
+    NoteInboundActivity();
     size_t nullTerminatedJsonSize = payloadSize + 1;
     char* nullTerminatedJsonString = (char*)malloc(nullTerminatedJsonSize);
     if (nullTerminatedJsonString == NULL) {
@@ -312,6 +818,10 @@ void AzureIoTHub_UpdateTwinReportState(const char* jsonState)
         else {
             Log_Debug("INFO: Azure IoT Hub client accepted request to report state '%s'.\n",
                 jsonState);
+            pendingReportedStates++;
+            if (connectionState == AzureIoTHub_Connected) {
+                RequestDoWork();
+            }
         }
     }
 }
@@ -323,6 +833,9 @@ void AzureIoTHub_UpdateTwinReportState(const char* jsonState)
 static void ReportedStateCallback(int result, void* context)
 {
     Log_Debug("INFO: Azure IoT Hub Device Twin reported state callback: status code %d.\n", result);
+    if (pendingReportedStates > 0) {
+        pendingReportedStates--;
+    }
 }
 
 /// <summary>
@@ -332,22 +845,56 @@ static int DeviceMethodCallback(const char* methodName, const unsigned char* pay
     size_t payloadSize, unsigned char** response, size_t* responseSize,
     void* userContextCallback)
 {
-    int result;
-    char* responseString;
-    unsigned char payloadJson[payloadSize + 1];
-    strncpy(payloadJson, payload, payloadSize);
-
     Log_Debug("Received Device Method callback: Method name %s.\n", methodName);
-    if (payloadSize > 0) {
-        payloadJson[payloadSize] = '\0';
+    NoteInboundActivity();
+    char payloadString[payloadSize + 1];
+    memcpy(payloadString, payload, payloadSize);
+    payloadString[payloadSize] = '\0';
+
+    static AzureIoTHub_MethodResponse methodResponse;
+    methodResponse.length = 0;
+    methodResponse.overflow = false;
+    JSON_Value* json = NULL;
+    int status;
+    const MethodEntry* method = FindMethodSlot(methodName);
+    if (method->name == NULL) {
+        Log_Debug("WARNING: method %s is not registered.\n", methodName);
+        AzureIoTHub_MethodResponse_SetMessage(&methodResponse, "Method not found");
+        status = 404;
+    }
+    else if ((method->flags & AzureIoTHub_MethodFlag_RequirePayload)
+        && (payloadSize == 0 || strcmp(payloadString, "null") == 0)) {
+        AzureIoTHub_MethodResponse_SetMessage(&methodResponse, "Payload required");
+        status = 400;
+    }
+    else if ((method->flags & AzureIoTHub_MethodFlag_ParseJson)
+        && (json = json_parse_string(payloadString)) == NULL) {
+        AzureIoTHub_MethodResponse_SetMessage(&methodResponse, "Payload is not valid JSON");
+        status = 400;
+    }
+    else {
+        status = method->handler(payloadString, payloadSize, json, &methodResponse);
+    }
+    if (json != NULL) {
+        json_value_free(json);
+    }
+    if (methodResponse.overflow) {
+        Log_Debug("ERROR: response to method %s is too large.\n", methodName);
+        AzureIoTHub_MethodResponse_SetMessage(&methodResponse, "Response too large");
+        status = 500;
+    }
+    if (methodResponse.length == 0) {
+        AppendResponseBytes(&methodResponse, "{}", 2);
     }
 
-    size_t resSize = 0;
-    result = iothubMethodCallback(methodName, payloadJson, payloadSize, &responseString, &resSize);
-    // if 'response' is non-NULL, the Azure IoT library frees it after use, so copy it to heap
-    *responseSize = resSize;
-    *response = malloc(*responseSize);
-    memcpy(*response, responseString, *responseSize);
-    return result;
+    // The Azure IoT library frees the response after use, so it goes on the heap.
+    *response = malloc(methodResponse.length);
+    if (*response == NULL) {
+        *responseSize = 0;
+        return 500;
+    }
+    memcpy(*response, methodResponse.body, methodResponse.length);
+    *responseSize = methodResponse.length;
+    return status;
 }
 
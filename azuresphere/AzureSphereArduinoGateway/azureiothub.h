@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 // Azure IoT SDK
 #include <iothub_client_core_common.h>
 #include <iothub_device_client_ll.h>
@@ -12,12 +14,166 @@
 
 #include "parson.h" // used to parse Device Twin messages.
 
-void AzureIoTHub_SetupAzureClient(char* scopeId, EventLoop* eventLoop, int dpsStatusLedFd, int IoTHubStatusLedFd);
+/// <summary>
+/// Where the client is in getting a connection to IoT Hub.
+/// </summary>
+typedef enum {
+    AzureIoTHub_NetworkDown = 0,  // waiting for the network, or no scope id configured
+    AzureIoTHub_Provisioning = 1, // registering through DPS and creating the client
+    AzureIoTHub_Connected = 2,    // messages are accepted
+    AzureIoTHub_Backoff = 3       // provisioning or authentication failed, waiting to retry
+} AzureIoTHub_ConnectionState;
+
+typedef struct {
+    AzureIoTHub_ConnectionState state;
+    int reconnectAttempts;     // consecutive failures, reset once IoT Hub authenticates the device
+    int reconnectDelaySeconds; // wait before the current or last retry, with jitter
+} AzureIoTHub_ConnectionStatus;
+
+typedef void(*AZUREIOTHUB_CONNECTION_STATE_CALLBACK)(AzureIoTHub_ConnectionState state);
+
+/// <summary>
+/// Starts connecting from the azure timer. Returns without waiting for the network or DPS.
+/// The retry LED lights while the client backs off between connection attempts.
+/// </summary>
+void AzureIoTHub_SetupAzureClient(char* scopeId, EventLoop* eventLoop, int dpsStatusLedFd, int IoTHubStatusLedFd,
+    int IoTRetryLedFd);
+/// <summary>
+/// Registers the network LED and checks the network once, without waiting for it.
+/// </summary>
 bool AzureIoTHub_CheckNetworkStatus(int systemStatusNetworkLedFd);
-void AzureIoTHub_SendMessage(char* messageBody, int systemStatusIoTSendingLedFd, int systemStatusIoTRetryLedFd);
+AzureIoTHub_ConnectionState AzureIoTHub_GetConnectionState(void);
+void AzureIoTHub_GetConnectionStatus(AzureIoTHub_ConnectionStatus* status);
+const char* AzureIoTHub_ConnectionStateToString(AzureIoTHub_ConnectionState state);
+void AzureIoTHub_SetConnectionStateCallback(AZUREIOTHUB_CONNECTION_STATE_CALLBACK callback);
+bool AzureIoTHub_IsConnected(void);
+
+typedef struct {
+    unsigned long calls;
+    uint64_t totalMicroseconds; // 32 bits would wrap after 71 minutes of DoWork
+    unsigned long maxMicroseconds;
+} AzureIoTHub_DoWorkStats;
+
+/// <summary>
+/// How often and how long IoTHubDeviceClient_LL_DoWork ran.
+/// </summary>
+void AzureIoTHub_GetDoWorkStats(AzureIoTHub_DoWorkStats* stats);
+
+/// <summary>
+/// Invoked once IoT Hub confirms or rejects a message. body is the message as it was sent,
+/// so an undelivered message can be kept for a later retry.
+/// </summary>
+typedef void(*AZUREIOTHUB_SEND_CALLBACK)(bool delivered, const unsigned char* body, size_t length, void* context);
+
+/// <summary>
+/// Most messages that can await confirmation at once; see <see cref="AzureIoTHub_InitMessagePool" />.
+/// </summary>
+#define AZUREIOTHUB_MAX_SEND_WINDOW 32
+
+/// <summary>
+/// Confirmation latency histogram: bucket i counts latencies below
+/// AzureIoTHub_LatencyBucketLimitsMs[i], the last bucket everything slower.
+/// </summary>
+#define AZUREIOTHUB_LATENCY_BUCKETS 9
+extern const unsigned int AzureIoTHub_LatencyBucketLimitsMs[AZUREIOTHUB_LATENCY_BUCKETS - 1];
+
+// Indexed by IOTHUB_CLIENT_CONFIRMATION_RESULT.
+#define AZUREIOTHUB_CONFIRMATION_RESULTS 4
+
+typedef struct {
+    unsigned long accepted;
+    unsigned long windowFull;  // sends refused because the window was full
+    unsigned long inFlight;
+    unsigned long maxInFlight;
+    unsigned long results[AZUREIOTHUB_CONFIRMATION_RESULTS];
+    unsigned long latencyBuckets[AZUREIOTHUB_LATENCY_BUCKETS];
+} AzureIoTHub_SendStats;
+
+/// <summary>
+/// Allocates slots reusable buffers of slotBytes for outgoing message bodies, once, before
+/// the first send. Without it <see cref="AzureIoTHub_SetupAzureClient" /> allocates 8 of 4 KB.
+/// The send window starts at slots.
+/// </summary>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int AzureIoTHub_InitMessagePool(int slots, size_t slotBytes);
+/// <summary>
+/// Limits how many messages may await confirmation, clamped to 1..the message pool slots.
+/// Sends beyond it are refused so the producer can hold on to them.
+/// </summary>
+void AzureIoTHub_SetSendWindow(int maxInFlight);
+/// <summary>
+/// Number of messages that would be accepted now; 0 when not connected.
+/// </summary>
+int AzureIoTHub_GetSendWindowAvailable(void);
+void AzureIoTHub_GetSendStats(AzureIoTHub_SendStats* stats);
+
+typedef struct {
+    const char* name;
+    const char* value;
+} AzureIoTHub_MessageProperty;
+
+/// <summary>
+/// Message metadata IoT Hub routing queries can filter on without parsing the body.
+/// Any member may be NULL.
+/// </summary>
+typedef struct {
+    const char* contentType;     // e.g. "application/json"
+    const char* contentEncoding; // e.g. "utf-8"; leave NULL for binary bodies
+    const char* messageId;
+    const char* schemaVersion;   // sent as the "schemaVersion" application property
+    const AzureIoTHub_MessageProperty* properties;
+    size_t propertyCount;
+} AzureIoTHub_MessageOptions;
+
+void AzureIoTHub_SendMessage(char* messageBody, int systemStatusIoTSendingLedFd);
+/// <summary>
+/// Hands a message to the IoT Hub client. options and callback may be NULL.
+/// </summary>
+/// <returns>true if the client accepted the message, in which case callback will be invoked;
+/// false when not connected or the send window is full.</returns>
+bool AzureIoTHub_SendMessageBytes(const unsigned char* messageBody, size_t messageLength,
+    const AzureIoTHub_MessageOptions* options, AZUREIOTHUB_SEND_CALLBACK callback, void* context,
+    int systemStatusIoTSendingLedFd);
 void AzureIoTHub_UpdateTwinReportState(const char* jsonState);
 
 typedef void(*AZUREIOTHUB_DEVICE_TWIN_CALLBACK)(const JSON_Object* desiredProps);
-typedef int(*AZUREIOTHUB_DEVICE_METHOD_CALLBACK)(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size);
 typedef void(*AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK)(const unsigned char* message, size_t size);
-void AzureIoTHub_SetRequestHandle(AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK msgCallback, AZUREIOTHUB_DEVICE_TWIN_CALLBACK twinCallback, AZUREIOTHUB_DEVICE_METHOD_CALLBACK methodCallback);
+void AzureIoTHub_SetRequestHandle(AZUREIOTHUB_DEVICE_MESSAGE_CALLBACK msgCallback, AZUREIOTHUB_DEVICE_TWIN_CALLBACK twinCallback);
+
+/// <summary>
+/// Collects the JSON payload a direct method responds with. A response that does not fit
+/// in AZUREIOTHUB_METHOD_RESPONSE_MAX_BYTES fails the method with status 500; an empty
+/// one is sent as {}.
+/// </summary>
+typedef struct AzureIoTHub_MethodResponse AzureIoTHub_MethodResponse;
+#define AZUREIOTHUB_METHOD_RESPONSE_MAX_BYTES 2048
+/// <summary>
+/// Appends printf-style formatted JSON text to the response.
+/// </summary>
+void AzureIoTHub_MethodResponse_Append(AzureIoTHub_MethodResponse* response, const char* format, ...);
+/// <summary>
+/// Replaces the response with message as a JSON string.
+/// </summary>
+void AzureIoTHub_MethodResponse_SetMessage(AzureIoTHub_MethodResponse* response, const char* message);
+
+typedef enum {
+    AzureIoTHub_MethodFlag_None = 0,
+    AzureIoTHub_MethodFlag_RequirePayload = 1, // an empty or null payload is answered with 400
+    AzureIoTHub_MethodFlag_ParseJson = 2       // the handler gets the parsed payload; invalid JSON is answered with 400
+} AzureIoTHub_MethodFlags;
+
+/// <summary>
+/// Handles one direct method. payload is NUL terminated; json is the parsed payload when
+/// registered with AzureIoTHub_MethodFlag_ParseJson and NULL otherwise.
+/// </summary>
+/// <returns>The method status, e.g. 200, 400 or 500.</returns>
+typedef int(*AZUREIOTHUB_METHOD_HANDLER)(const char* payload, size_t size, const JSON_Value* json,
+    AzureIoTHub_MethodResponse* response);
+
+#define AZUREIOTHUB_MAX_METHODS 16
+/// <summary>
+/// Registers handler for direct method name, replacing any handler already registered for
+/// it. name must stay valid while registered. Unregistered methods are answered with 404.
+/// </summary>
+/// <returns>false when name or handler is NULL or AZUREIOTHUB_MAX_METHODS are registered.</returns>
+bool AzureIoTHub_RegisterMethod(const char* name, AZUREIOTHUB_METHOD_HANDLER handler, unsigned int flags);
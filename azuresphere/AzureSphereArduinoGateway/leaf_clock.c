@@ -0,0 +1,137 @@
+#include <string.h>
+
+#include "leaf_clock.h"
+
+/// <summary>
+/// Smallest arrival minus tick offset in a window, and the tick it was seen at.
+/// </summary>
+typedef struct {
+    int64_t tick;
+    int64_t offset;
+} ClockPoint;
+
+static bool synced = false;
+static uint32_t lastSequence = 0;
+static uint32_t lastTick = 0;
+// Ticks since the first sample, continuing across the 49.7 day millis() wrap.
+static int64_t unwrappedTick = 0;
+static int64_t windowStart = 0;
+static ClockPoint windowMin;
+// Minima of the last complete windows, oldest first. Neighbouring minima can be close
+// together, so the drift is taken between the oldest and the latest.
+#define CLOCK_ANCHORS 4
+static ClockPoint anchors[CLOCK_ANCHORS];
+static int anchorCount = 0;
+static LeafClockStats clockStats;
+
+static int64_t ToMilliseconds(const struct timespec* time)
+{
+    return (int64_t)time->tv_sec * 1000 + time->tv_nsec / 1000000;
+}
+
+static void ToTimespec(int64_t milliseconds, struct timespec* time)
+{
+    time->tv_sec = (time_t)(milliseconds / 1000);
+    time->tv_nsec = (long)(milliseconds % 1000) * 1000000;
+}
+
+/// <summary>
+/// Offset with the estimated drift taken out, so points of a window compare by their delay.
+/// </summary>
+static int64_t Detrended(const ClockPoint* point)
+{
+    return point->offset - point->tick * clockStats.driftPpm / 1000000;
+}
+
+static void Restart(int64_t offset)
+{
+    synced = true;
+    unwrappedTick = 0;
+    windowStart = 0;
+    windowMin.tick = 0;
+    windowMin.offset = offset;
+    anchorCount = 0;
+    clockStats.driftPpm = 0;
+}
+
+/// <summary>
+/// Offset expected at atTick from the anchors, or the current window's minimum before
+/// there are any.
+/// </summary>
+static int64_t EstimateOffset(int64_t atTick)
+{
+    if (anchorCount == 0) {
+        return windowMin.offset;
+    }
+    const ClockPoint* latest = &anchors[anchorCount - 1];
+    const ClockPoint* oldest = &anchors[0];
+    int64_t ticks = latest->tick - oldest->tick;
+    if (ticks < LEAF_CLOCK_WINDOW_MILLISECONDS) {
+        return latest->offset;
+    }
+    int64_t change = latest->offset - oldest->offset;
+    int64_t maxChange = ticks * LEAF_CLOCK_MAX_DRIFT_PPM / 1000000;
+    if (change > maxChange) {
+        change = maxChange;
+    }
+    else if (change < -maxChange) {
+        change = -maxChange;
+    }
+    clockStats.driftPpm = (long)(change * 1000000 / ticks);
+    return latest->offset + change * (atTick - latest->tick) / ticks;
+}
+
+void LeafClock_Map(uint32_t sequence, uint32_t tick, const struct timespec* arrival, struct timespec* taken)
+{
+    int64_t arrivalMilliseconds = ToMilliseconds(arrival);
+    if (!synced || sequence < lastSequence) {
+        if (synced) {
+            clockStats.resets++;
+        }
+        Restart(arrivalMilliseconds);
+    }
+    else {
+        unwrappedTick += (uint32_t)(tick - lastTick);
+    }
+    lastSequence = sequence;
+    lastTick = tick;
+
+    ClockPoint point = {.tick = unwrappedTick, .offset = arrivalMilliseconds - unwrappedTick};
+    if (unwrappedTick - windowStart >= LEAF_CLOCK_WINDOW_MILLISECONDS) {
+        if (anchorCount == CLOCK_ANCHORS) {
+            memmove(anchors, anchors + 1, sizeof(anchors) - sizeof(anchors[0]));
+            anchorCount--;
+        }
+        anchors[anchorCount++] = windowMin;
+        windowStart = unwrappedTick;
+        windowMin = point;
+    }
+    else if (Detrended(&point) < Detrended(&windowMin)) {
+        windowMin = point;
+    }
+
+    int64_t estimate = EstimateOffset(unwrappedTick);
+    if (estimate > point.offset) {
+        // Taken no later than it arrived.
+        estimate = point.offset;
+    }
+    int64_t takenMilliseconds = unwrappedTick + estimate;
+    ToTimespec(takenMilliseconds, taken);
+    clockStats.samples++;
+    clockStats.lastDelayMilliseconds = (long)(arrivalMilliseconds - takenMilliseconds);
+}
+
+bool LeafClock_MapEarlier(uint32_t tick, struct timespec* taken)
+{
+    if (!synced) {
+        return false;
+    }
+    int64_t earlierTick = unwrappedTick - (uint32_t)(lastTick - tick);
+    ToTimespec(earlierTick + EstimateOffset(earlierTick), taken);
+    return true;
+}
+
+void LeafClock_GetStats(LeafClockStats* stats)
+{
+    *stats = clockStats;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+/// Maps the leaf's millis() ticks to gateway CLOCK_MONOTONIC time. A sample arrives some
+/// time after it was taken, so arrival minus tick overstates the clock offset by that
+/// delay; its minimum over a window of LEAF_CLOCK_WINDOW_MILLISECONDS is close to the true
+/// offset. The line through the recent window minima also gives the leaf clock's drift,
+/// up to LEAF_CLOCK_MAX_DRIFT_PPM. Mapped times trail the true ones by the shortest
+/// measurement and transfer delay, but not by its jitter.
+/// </summary>
+#define LEAF_CLOCK_WINDOW_MILLISECONDS 60000
+#define LEAF_CLOCK_MAX_DRIFT_PPM 5000
+
+typedef struct {
+    unsigned long samples;
+    unsigned long resets;         // the leaf restarted, its sequence went backwards
+    long driftPpm;                // leaf clock rate error, positive when it runs slow
+    long lastDelayMilliseconds;   // arrival minus mapped time of the latest sample
+} LeafClockStats;
+
+/// <summary>
+/// Returns in taken the CLOCK_MONOTONIC time at which the leaf's tick happened, for a sample
+/// with the given sequence number that arrived at arrival. taken is never after arrival.
+/// </summary>
+void LeafClock_Map(uint32_t sequence, uint32_t tick, const struct timespec* arrival, struct timespec* taken);
+
+/// <summary>
+/// Maps the tick of a sample older than the latest one passed to LeafClock_Map, such as one
+/// resent on request, without using it for the estimate.
+/// </summary>
+/// <returns>false if no sample was mapped yet.</returns>
+bool LeafClock_MapEarlier(uint32_t tick, struct timespec* taken);
+
+void LeafClock_GetStats(LeafClockStats* stats);
@@ -0,0 +1,276 @@
+#include <applibs/log.h>
+
+#include "leaf_link.h"
+#include "leaf_protocol.h"
+
+static const int replyTimeoutSeconds = 2;
+static const int retrySeconds = 30;
+// Keeps the leaf from falling back while the gateway has nothing else to send.
+static const int keepaliveSeconds = 5;
+// Step down when a window holds at least minWindowErrors damaged frames and they are at
+// least maxErrorPercent of all frames.
+static const int errorWindowSeconds = 10;
+static const unsigned long minWindowErrors = 3;
+static const unsigned long maxErrorPercent = 5;
+
+static const LeafLinkHandlers* linkHandlers = NULL;
+static LeafLinkState linkState = LeafLink_Waiting;
+static uint16_t localRates = 1;
+static uint16_t peerRates = 1;
+static int rateIndex = 0;
+static int pendingIndex = 0;
+static int maxRateIndex = LEAF_BAUD_RATE_COUNT - 1;
+// False after setBaudRate failed and may have left the UART closed.
+static bool uartOpen = true;
+static struct timespec stateEnteredAt;
+static struct timespec lastFrameAt;
+static struct timespec keepaliveSentAt;
+static struct timespec errorWindowAt;
+static unsigned long windowFrames = 0;
+static unsigned long windowErrors = 0;
+static unsigned long totalFrames = 0;
+static unsigned long totalErrors = 0;
+static unsigned long negotiations = 0;
+static unsigned long stepDowns = 0;
+static unsigned long fallbacks = 0;
+
+static long SecondsSince(const struct timespec* now, const struct timespec* then)
+{
+    return (long)(now->tv_sec - then->tv_sec);
+}
+
+static uint16_t RatesUpTo(int index)
+{
+    return (uint16_t)((1u << (index + 1)) - 1);
+}
+
+static void Enter(LeafLinkState state, const struct timespec* now)
+{
+    if (state != linkState) {
+        Log_Debug("INFO: leaf link %s at %u baud.\n", LeafLink_StateToString(state),
+            (unsigned int)LeafFrame_BaudRates[rateIndex]);
+    }
+    if (state == LeafLink_Established) {
+        errorWindowAt = *now;
+        windowFrames = totalFrames;
+        windowErrors = totalErrors;
+    }
+    linkState = state;
+    stateEnteredAt = *now;
+}
+
+static void SendCapabilities(const struct timespec* now)
+{
+    linkHandlers->sendCapabilities((uint16_t)(localRates & RatesUpTo(maxRateIndex)));
+    keepaliveSentAt = *now;
+}
+
+/// <summary>
+/// Highest rate both ends support, not above maxRateIndex. The base rate always qualifies.
+/// </summary>
+static int HighestCommonRate(void)
+{
+    uint16_t common = (uint16_t)(localRates & peerRates & RatesUpTo(maxRateIndex));
+    for (int i = maxRateIndex; i > 0; i--) {
+        if (common & (1u << i)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+/// Moves to the best rate still allowed, or settles if the link already runs at it.
+/// </summary>
+static void Renegotiate(const struct timespec* now)
+{
+    int index = HighestCommonRate();
+    if (index == rateIndex) {
+        Enter(LeafLink_Established, now);
+        return;
+    }
+    pendingIndex = index;
+    linkHandlers->sendBaudRate(LeafFrame_BaudRates[index]);
+    Enter(LeafLink_Switching, now);
+}
+
+static bool ReopenAtBaseRate(void)
+{
+    uartOpen = linkHandlers->setBaudRate(LEAF_BASE_BAUD_RATE);
+    if (!uartOpen) {
+        Log_Debug("ERROR: could not return the leaf UART to %u baud.\n", (unsigned int)LEAF_BASE_BAUD_RATE);
+    }
+    return uartOpen;
+}
+
+/// <summary>
+/// Returns to the base rate without asking the leaf, which can no longer be reached; it
+/// falls back by itself once it hears nothing valid. A UART left closed by a failed switch
+/// is reopened even if the link already ran at the base rate.
+/// </summary>
+static void FallBack(const struct timespec* now)
+{
+    if (rateIndex != 0 || !uartOpen) {
+        ReopenAtBaseRate();
+    }
+    if (rateIndex != 0) {
+        rateIndex = 0;
+        fallbacks++;
+    }
+    Enter(LeafLink_Waiting, now);
+}
+
+void LeafLink_Init(const LeafLinkHandlers* handlers, uint16_t baudRates, const struct timespec* now)
+{
+    linkHandlers = handlers;
+    localRates = (uint16_t)(baudRates | 1);
+    peerRates = 1;
+    rateIndex = 0;
+    maxRateIndex = LEAF_BAUD_RATE_COUNT - 1;
+    uartOpen = true;
+    lastFrameAt = *now;
+    SendCapabilities(now);
+    Enter(LeafLink_Probing, now);
+}
+
+void LeafLink_FrameReceived(const struct timespec* now)
+{
+    lastFrameAt = *now;
+}
+
+void LeafLink_CapabilitiesReceived(uint16_t baudRates, const struct timespec* now)
+{
+    lastFrameAt = *now;
+    peerRates = (uint16_t)(baudRates | 1);
+    switch (linkState) {
+    case LeafLink_Probing:
+    case LeafLink_Waiting:
+        Renegotiate(now);
+        break;
+    case LeafLink_Verifying:
+        negotiations++;
+        Enter(LeafLink_Established, now);
+        break;
+    default:
+        // Answers to keepalives, or late ones to an earlier probe.
+        break;
+    }
+}
+
+void LeafLink_BaudRateAcked(bool accepted, const struct timespec* now)
+{
+    if (linkState != LeafLink_Switching) {
+        return;
+    }
+    lastFrameAt = *now;
+    if (!accepted) {
+        maxRateIndex = pendingIndex > 0 ? pendingIndex - 1 : 0;
+        Renegotiate(now);
+        return;
+    }
+    if (!linkHandlers->setBaudRate(LeafFrame_BaudRates[pendingIndex])) {
+        Log_Debug("ERROR: could not switch the leaf UART to %u baud.\n",
+            (unsigned int)LeafFrame_BaudRates[pendingIndex]);
+        maxRateIndex = pendingIndex > 0 ? pendingIndex - 1 : 0;
+        uartOpen = false;
+        FallBack(now);
+        return;
+    }
+    rateIndex = pendingIndex;
+    SendCapabilities(now);
+    Enter(LeafLink_Verifying, now);
+}
+
+void LeafLink_Poll(const struct timespec* now, unsigned long frames, unsigned long errors)
+{
+    totalFrames = frames;
+    totalErrors = errors;
+    long inState = SecondsSince(now, &stateEnteredAt);
+    switch (linkState) {
+    case LeafLink_Probing:
+    case LeafLink_Switching:
+        // If the leaf switched but its ack was lost, it falls back by itself.
+        if (inState >= replyTimeoutSeconds) {
+            if (linkState == LeafLink_Switching && pendingIndex < rateIndex) {
+                // A leaf that does not answer a step-down was not listening at this rate at
+                // all, e.g. it restarted, so the errors do not count against the rate.
+                maxRateIndex = rateIndex;
+            }
+            FallBack(now);
+        }
+        break;
+    case LeafLink_Verifying:
+        if (inState >= replyTimeoutSeconds) {
+            // A silent base rate only means the leaf is away; it caps nothing.
+            if (rateIndex > 0) {
+                maxRateIndex = rateIndex - 1;
+            }
+            FallBack(now);
+        }
+        break;
+    case LeafLink_Waiting:
+        if (inState >= retrySeconds) {
+            if (!uartOpen && !ReopenAtBaseRate()) {
+                Enter(LeafLink_Waiting, now);
+                break;
+            }
+            SendCapabilities(now);
+            Enter(LeafLink_Probing, now);
+        }
+        break;
+    case LeafLink_Established:
+        if (rateIndex == 0) {
+            break;
+        }
+        if (SecondsSince(now, &lastFrameAt) >= LEAF_LINK_SILENCE_SECONDS) {
+            FallBack(now);
+            break;
+        }
+        if (SecondsSince(now, &errorWindowAt) >= errorWindowSeconds) {
+            unsigned long windowGood = frames - windowFrames;
+            unsigned long windowBad = errors - windowErrors;
+            errorWindowAt = *now;
+            windowFrames = frames;
+            windowErrors = errors;
+            if (windowBad >= minWindowErrors && windowBad * 100 >= (windowGood + windowBad) * maxErrorPercent) {
+                Log_Debug("WARNING: leaf link lost %lu of %lu frames at %u baud, stepping down.\n", windowBad,
+                    windowGood + windowBad, (unsigned int)LeafFrame_BaudRates[rateIndex]);
+                maxRateIndex = rateIndex - 1;
+                stepDowns++;
+                Renegotiate(now);
+                break;
+            }
+        }
+        if (SecondsSince(now, &keepaliveSentAt) >= keepaliveSeconds) {
+            SendCapabilities(now);
+        }
+        break;
+    }
+}
+
+void LeafLink_GetStatus(LeafLinkStatus* status)
+{
+    status->state = linkState;
+    status->baudRate = LeafFrame_BaudRates[rateIndex];
+    status->maxBaudRate = LeafFrame_BaudRates[maxRateIndex];
+    status->negotiations = negotiations;
+    status->stepDowns = stepDowns;
+    status->fallbacks = fallbacks;
+}
+
+const char* LeafLink_StateToString(LeafLinkState state)
+{
+    switch (state) {
+    case LeafLink_Probing:
+        return "probing";
+    case LeafLink_Switching:
+        return "switching";
+    case LeafLink_Verifying:
+        return "verifying";
+    case LeafLink_Established:
+        return "established";
+    case LeafLink_Waiting:
+        return "waiting";
+    }
+    return "unknown";
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+/// Negotiates the leaf UART baud rate. Both ends start at LEAF_BASE_BAUD_RATE and exchange
+/// capability frames; the gateway then asks for the highest rate both support, switches
+/// once the leaf acks, and checks the link answers at the new rate. A rising error rate
+/// steps the link down a rate; a silent link drops back to the base rate, as the leaf does
+/// on its own when it hears nothing valid for LEAF_LINK_SILENCE_SECONDS.
+/// </summary>
+typedef enum {
+    LeafLink_Probing = 0,     // capabilities sent, waiting for the leaf's
+    LeafLink_Switching = 1,   // rate change sent, waiting for its ack
+    LeafLink_Verifying = 2,   // switched, waiting for the leaf to answer at the new rate
+    LeafLink_Established = 3,
+    LeafLink_Waiting = 4      // the leaf did not answer, probing again later
+} LeafLinkState;
+
+#define LEAF_LINK_SILENCE_SECONDS 15
+
+typedef struct {
+    void (*sendCapabilities)(uint16_t baudRates);
+    void (*sendBaudRate)(uint32_t baudRate);
+    /// <summary>
+    /// Reopens the local UART at baudRate. false may leave it closed; the link keeps trying
+    /// to reopen it at the base rate.
+    /// </summary>
+    bool (*setBaudRate)(uint32_t baudRate);
+} LeafLinkHandlers;
+
+typedef struct {
+    LeafLinkState state;
+    uint32_t baudRate;
+    uint32_t maxBaudRate;        // highest rate still worth trying, lowered after errors
+    unsigned long negotiations;  // rate changes both ends completed
+    unsigned long stepDowns;     // rate lowered because of receive errors
+    unsigned long fallbacks;     // returns to the base rate after the link went silent
+} LeafLinkStatus;
+
+/// <summary>
+/// Starts probing at the base rate the UART was opened with. baudRates is the mask of
+/// LeafFrame_BaudRates the gateway may use.
+/// </summary>
+void LeafLink_Init(const LeafLinkHandlers* handlers, uint16_t baudRates, const struct timespec* now);
+
+/// <summary>
+/// Records that a valid frame arrived, of any type.
+/// </summary>
+void LeafLink_FrameReceived(const struct timespec* now);
+void LeafLink_CapabilitiesReceived(uint16_t baudRates, const struct timespec* now);
+void LeafLink_BaudRateAcked(bool accepted, const struct timespec* now);
+
+/// <summary>
+/// Handles timeouts, keepalives and the receive error rate. frames and errors are running
+/// totals of valid and damaged frames. Call about once a second.
+/// </summary>
+void LeafLink_Poll(const struct timespec* now, unsigned long frames, unsigned long errors);
+
+void LeafLink_GetStatus(LeafLinkStatus* status);
+const char* LeafLink_StateToString(LeafLinkState state);
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "leaf_protocol.h"
+
+const uint32_t LeafFrame_BaudRates[LEAF_BAUD_RATE_COUNT] = { 9600, 19200, 38400, 57600, 115200, 230400 };
+
+static uint16_t Crc16(const uint8_t* data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint16_t ReadUint16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t ReadUint32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void WriteUint16(uint8_t* p, uint16_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void WriteUint32(uint8_t* p, uint32_t value)
+{
+    WriteUint16(p, (uint16_t)value);
+    WriteUint16(p + 2, (uint16_t)(value >> 16));
+}
+
+size_t LeafFrame_Encode(uint8_t type, uint16_t sequence, const void* payload, size_t length, uint8_t* out,
+    size_t outSize)
+{
+    if (length > LEAF_FRAME_MAX_PAYLOAD || outSize < LEAF_FRAME_OVERHEAD + length + 3) {
+        return 0;
+    }
+    uint8_t raw[LEAF_FRAME_OVERHEAD + LEAF_FRAME_MAX_PAYLOAD];
+    size_t rawLength = 0;
+    raw[rawLength++] = LEAF_PROTOCOL_VERSION;
+    raw[rawLength++] = type;
+    WriteUint16(raw + rawLength, sequence);
+    rawLength += 2;
+    memcpy(raw + rawLength, payload, length);
+    rawLength += length;
+    WriteUint16(raw + rawLength, Crc16(raw, rawLength));
+    rawLength += 2;
+
+    // COBS: each code byte tells how far away the next 0 is. Frames are under 254 bytes,
+    // so no code ever reaches 0xFF.
+    size_t written = 0;
+    out[written++] = 0;
+    size_t codeIndex = written++;
+    uint8_t code = 1;
+    for (size_t i = 0; i < rawLength; i++) {
+        if (raw[i] == 0) {
+            out[codeIndex] = code;
+            codeIndex = written++;
+            code = 1;
+        }
+        else {
+            out[written++] = raw[i];
+            code++;
+        }
+    }
+    out[codeIndex] = code;
+    out[written++] = 0;
+    return written;
+}
+
+/// <summary>
+/// Decodes COBS data without delimiters and checks the frame it holds.
+/// </summary>
+static bool DecodeFrame(const uint8_t* data, size_t length, LeafFrame* frame, LeafFrameStats* stats)
+{
+    uint8_t raw[LEAF_FRAME_MAX_ENCODED];
+    size_t rawLength = 0;
+    size_t read = 0;
+    while (read < length) {
+        uint8_t code = data[read++];
+        if (code == 0 || read + code - 1 > length || rawLength + code > sizeof(raw)) {
+            stats->malformed++;
+            return false;
+        }
+        memcpy(raw + rawLength, data + read, (size_t)code - 1);
+        rawLength += (size_t)code - 1;
+        read += (size_t)code - 1;
+        if (code != 0xFF && read < length) {
+            raw[rawLength++] = 0;
+        }
+    }
+
+    if (rawLength < LEAF_FRAME_OVERHEAD || rawLength > LEAF_FRAME_OVERHEAD + LEAF_FRAME_MAX_PAYLOAD) {
+        stats->malformed++;
+        return false;
+    }
+    if (Crc16(raw, rawLength - 2) != ReadUint16(raw + rawLength - 2)) {
+        stats->crcErrors++;
+        return false;
+    }
+    if (raw[0] != LEAF_PROTOCOL_VERSION) {
+        stats->unsupportedVersion++;
+        return false;
+    }
+    frame->type = raw[1];
+    frame->sequence = ReadUint16(raw + 2);
+    frame->length = rawLength - LEAF_FRAME_OVERHEAD;
+    memcpy(frame->payload, raw + 4, frame->length);
+    stats->frames++;
+    return true;
+}
+
+bool LeafFrame_Decode(const uint8_t* data, size_t length, LeafFrame* frame)
+{
+    LeafFrameStats stats = {0};
+    while (length > 0 && data[0] == 0) {
+        data++;
+        length--;
+    }
+    while (length > 0 && data[length - 1] == 0) {
+        length--;
+    }
+    return DecodeFrame(data, length, frame, &stats);
+}
+
+void LeafFrameDecoder_Init(LeafFrameDecoder* decoder)
+{
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+void LeafFrameDecoder_Reset(LeafFrameDecoder* decoder)
+{
+    decoder->length = 0;
+    decoder->oversized = false;
+}
+
+bool LeafFrameDecoder_Push(LeafFrameDecoder* decoder, uint8_t byte, LeafFrame* frame)
+{
+    if (byte != 0) {
+        if (decoder->length < sizeof(decoder->buffer)) {
+            decoder->buffer[decoder->length++] = byte;
+        }
+        else {
+            decoder->oversized = true;
+        }
+        return false;
+    }
+
+    size_t length = decoder->length;
+    bool oversized = decoder->oversized;
+    decoder->length = 0;
+    decoder->oversized = false;
+    if (length == 0) {
+        // Back to back delimiters.
+        return false;
+    }
+    if (oversized) {
+        decoder->stats.oversized++;
+        return false;
+    }
+    return DecodeFrame(decoder->buffer, length, frame, &decoder->stats);
+}
+
+bool LeafFrame_ReadSensorSample(const LeafFrame* leafFrame, SensorFrame* frame)
+{
+    if ((leafFrame->type != LeafFrame_SensorSample && leafFrame->type != LeafFrame_StoredSample)
+        || leafFrame->length < LEAF_SENSOR_SAMPLE_PAYLOAD) {
+        return false;
+    }
+    const uint8_t* p = leafFrame->payload;
+    frame->fields = p[0] & SENSOR_FIELDS_ALL;
+    frame->temperature = (float)(int16_t)ReadUint16(p + 1) / 100.0f;
+    frame->humidity = (float)ReadUint16(p + 3) / 100.0f;
+    frame->pressure = (float)ReadUint32(p + 5);
+    frame->altitude = (float)(int32_t)ReadUint32(p + 9) / 100.0f;
+    frame->stamped = leafFrame->length >= LEAF_SENSOR_SAMPLE_STAMPED_PAYLOAD;
+    if (frame->stamped) {
+        frame->sequence = ReadUint32(p + 13);
+        frame->tick = ReadUint32(p + 17);
+    }
+    return true;
+}
+
+bool LeafFrame_ReadAck(const LeafFrame* frame, LeafAck* ack)
+{
+    if (frame->type != LeafFrame_Ack || frame->length < 4) {
+        return false;
+    }
+    ack->type = frame->payload[0];
+    ack->sequence = ReadUint16(frame->payload + 1);
+    ack->status = frame->payload[3];
+    return true;
+}
+
+size_t LeafFrame_WriteMotorOrders(const char* orders, uint8_t* payload, size_t size)
+{
+    size_t length = 0;
+    const char* p = orders;
+    while (*p != '\0') {
+        if (*p == ';' || *p == ' ') {
+            p++;
+            continue;
+        }
+        if ((p[0] != 'L' && p[0] != 'R') || p[1] == '\0' || strchr("FRBS", p[1]) == NULL || length + 3 > size) {
+            return 0;
+        }
+        unsigned int speed = 0;
+        int digits = 0;
+        const char* d = p + 2;
+        while (*d >= '0' && *d <= '9') {
+            speed = speed * 10 + (unsigned int)(*d - '0');
+            digits++;
+            d++;
+        }
+        if ((digits != 0 && digits != 3) || speed > 255) {
+            return 0;
+        }
+        payload[length++] = (uint8_t)p[0];
+        payload[length++] = (uint8_t)p[1];
+        payload[length++] = (uint8_t)speed;
+        p = d;
+    }
+    return length;
+}
+
+bool LeafFrame_ReadMotorOrders(const uint8_t* payload, size_t length, char* orders, size_t size)
+{
+    size_t written = 0;
+    if (size == 0 || length % 3 != 0) {
+        return false;
+    }
+    orders[0] = '\0';
+    for (size_t i = 0; i + 3 <= length; i += 3) {
+        int n = snprintf(orders + written, size - written, "%s%c%c%03u", written > 0 ? ";" : "", payload[i],
+            payload[i + 1], (unsigned int)payload[i + 2]);
+        if (n < 0 || (size_t)n >= size - written) {
+            return false;
+        }
+        written += (size_t)n;
+    }
+    return true;
+}
+
+size_t LeafFrame_WriteConfig(LeafConfigKey key, uint32_t value, uint8_t* payload, size_t size)
+{
+    if (size < 5) {
+        return 0;
+    }
+    payload[0] = (uint8_t)key;
+    WriteUint32(payload + 1, value);
+    return 5;
+}
+
+size_t LeafFrame_WriteMotorPlan(uint8_t replaceMotors, const LeafMotorSegment* segments, size_t count,
+    uint8_t* payload, size_t size)
+{
+    if (count == 0 || count > LEAF_MOTOR_PLAN_MAX_SEGMENTS || size < 1 + count * LEAF_MOTOR_SEGMENT_PAYLOAD) {
+        return 0;
+    }
+    size_t length = 0;
+    payload[length++] = replaceMotors;
+    for (size_t i = 0; i < count; i++) {
+        const LeafMotorSegment* segment = &segments[i];
+        if ((segment->motor != 'L' && segment->motor != 'R') || segment->order == '\0'
+            || strchr("FRBS", segment->order) == NULL) {
+            return 0;
+        }
+        payload[length++] = (uint8_t)segment->motor;
+        payload[length++] = (uint8_t)segment->order;
+        payload[length++] = segment->speed;
+        WriteUint16(payload + length, segment->rampPerSecond);
+        WriteUint16(payload + length + 2, segment->durationMilliseconds);
+        length += 4;
+    }
+    return length;
+}
+
+size_t LeafFrame_WriteCapabilities(uint16_t baudRates, uint8_t* payload, size_t size)
+{
+    if (size < 2) {
+        return 0;
+    }
+    WriteUint16(payload, baudRates);
+    return 2;
+}
+
+bool LeafFrame_ReadCapabilities(const LeafFrame* frame, uint16_t* baudRates)
+{
+    if (frame->type != LeafFrame_Capabilities || frame->length < 2) {
+        return false;
+    }
+    *baudRates = ReadUint16(frame->payload);
+    return true;
+}
+
+size_t LeafFrame_WriteBaudRate(uint32_t baudRate, uint8_t* payload, size_t size)
+{
+    if (size < 4) {
+        return 0;
+    }
+    WriteUint32(payload, baudRate);
+    return 4;
+}
+
+size_t LeafFrame_WriteFetchSamples(uint32_t sequence, uint8_t* payload, size_t size)
+{
+    if (size < 4) {
+        return 0;
+    }
+    WriteUint32(payload, sequence);
+    return 4;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensor_frame_parser.h"
+
+/// <summary>
+/// Binary frames exchanged with the leaf device over the UART. A frame is
+///   version, type, sequence (uint16), payload, CRC16 (uint16)
+/// with integers little endian and the CRC16-CCITT (0x1021, initial 0xFFFF) taken over
+/// everything before it. It is COBS encoded and sent between two 0 bytes, so a damaged
+/// frame costs only itself. motor_dirve_by_serial.ino implements the other end.
+/// </summary>
+#define LEAF_PROTOCOL_VERSION 1
+#define LEAF_FRAME_MAX_PAYLOAD 32
+#define LEAF_FRAME_OVERHEAD 6
+/// <summary>
+/// Longest encoded frame: one COBS code byte per 254 bytes, and both delimiters.
+/// </summary>
+#define LEAF_FRAME_MAX_ENCODED (LEAF_FRAME_OVERHEAD + LEAF_FRAME_MAX_PAYLOAD + 1 + 2)
+
+typedef enum {
+    LeafFrame_SensorSample = 0x01, // leaf to gateway: LeafSensorSamplePayload
+    LeafFrame_MotorCommand = 0x02, // gateway to leaf: one order of channel, operation and speed bytes per motor
+    LeafFrame_Ack = 0x03,          // leaf to gateway: type, sequence and LeafAckStatus of a received frame
+    LeafFrame_Config = 0x04,       // gateway to leaf: LeafConfigKey byte and a uint32 value
+    LeafFrame_Capabilities = 0x05, // both ways: uint16 mask of supported LeafFrame_BaudRates; the leaf answers with its own
+    LeafFrame_SetBaudRate = 0x06,  // gateway to leaf: uint32 baud rate, acked at the old rate before the leaf switches
+    LeafFrame_FetchSamples = 0x07, // gateway to leaf: uint32 sequence; the leaf resends the samples it holds from there on
+    LeafFrame_StoredSample = 0x08, // leaf to gateway: a LeafFrame_SensorSample payload resent for LeafFrame_FetchSamples
+    LeafFrame_MotorPlan = 0x09     // gateway to leaf: mask of motors to replace the plan of, and LeafMotorSegment entries
+} LeafFrameType;
+
+typedef enum {
+    LeafAck_Ok = 0,
+    LeafAck_Unsupported = 1, // unknown frame type or config key
+    LeafAck_Invalid = 2,     // payload could not be used
+    LeafAck_Full = 3         // no room to queue the payload; nothing of it was used
+} LeafAckStatus;
+
+typedef enum {
+    LeafConfig_SensorPeriodMilliseconds = 1
+} LeafConfigKey;
+
+/// <summary>
+/// Baud rates the link may run at; bit i of a capability mask stands for rate i. Both ends
+/// start at, and fall back to, LEAF_BASE_BAUD_RATE.
+/// </summary>
+#define LEAF_BAUD_RATE_COUNT 6
+#define LEAF_BASE_BAUD_RATE 9600
+extern const uint32_t LeafFrame_BaudRates[LEAF_BAUD_RATE_COUNT];
+
+// Sensor sample payload: SensorField bits (uint8), temperature in 0.01 degrees Celsius
+// (int16), humidity in 0.01 % (uint16), pressure in Pa (uint32), altitude in cm (int32),
+// optionally followed by the sample sequence number (uint32) and the leaf's millis() when
+// the measurement was triggered (uint32).
+#define LEAF_SENSOR_SAMPLE_PAYLOAD 13
+#define LEAF_SENSOR_SAMPLE_STAMPED_PAYLOAD 21
+/// <summary>
+/// Number of most recent samples the leaf keeps for LeafFrame_FetchSamples.
+/// </summary>
+#define LEAF_SAMPLE_HISTORY 16
+
+/// <summary>
+/// A motor plan is a queue of segments per motor. The leaf ramps the motor's PWM toward the
+/// segment's speed at rampPerSecond steps per second, or jumps to it for 0, and moves on to
+/// the next segment after durationMilliseconds from the start of this one. A segment with
+/// duration 0 runs until it reached its speed and another one is queued, or else until the
+/// leaf's idle stop. Brake orders ignore the ramp. Motor commands replace a motor's plan.
+/// A plan frame first replaces the plans of the motors in its mask, bit 0 for 'L' and bit 1
+/// for 'R': they drop their queued segments and hold their current speed. Its segments are
+/// then queued behind whatever each motor still runs.
+/// </summary>
+
+typedef struct {
+    char motor;                    // 'L' or 'R'
+    char order;                    // 'F'orward, 'R'everse, 'B'rake or 'S'top
+    uint8_t speed;
+    uint16_t rampPerSecond;
+    uint16_t durationMilliseconds;
+} LeafMotorSegment;
+
+// Motor plan segment payload: motor and order characters, speed (uint8), ramp (uint16) and
+// duration (uint16).
+#define LEAF_MOTOR_SEGMENT_PAYLOAD 7
+#define LEAF_MOTOR_PLAN_MAX_SEGMENTS ((LEAF_FRAME_MAX_PAYLOAD - 1) / LEAF_MOTOR_SEGMENT_PAYLOAD)
+/// <summary>
+/// Number of segments the leaf queues per motor, besides the running one.
+/// </summary>
+#define LEAF_MOTOR_QUEUE 8
+
+typedef struct {
+    uint8_t type;
+    uint16_t sequence;
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    size_t length;
+} LeafFrame;
+
+typedef struct {
+    uint8_t type;
+    uint16_t sequence;
+    uint8_t status;
+} LeafAck;
+
+typedef struct {
+    unsigned long frames;
+    unsigned long crcErrors;
+    unsigned long malformed;  // bad COBS encoding or too short
+    unsigned long oversized;
+    unsigned long unsupportedVersion;
+} LeafFrameStats;
+
+/// <summary>
+/// Reassembles frames from UART bytes arriving in arbitrary pieces.
+/// </summary>
+typedef struct {
+    uint8_t buffer[LEAF_FRAME_MAX_ENCODED];
+    size_t length;
+    bool oversized; // the frame being received did not fit and is dropped
+    LeafFrameStats stats;
+} LeafFrameDecoder;
+
+/// <summary>
+/// Encodes a frame, with both delimiters, into out.
+/// </summary>
+/// <returns>Encoded length, or 0 if payload or out is too large or small respectively.</returns>
+size_t LeafFrame_Encode(uint8_t type, uint16_t sequence, const void* payload, size_t length, uint8_t* out,
+    size_t outSize);
+
+/// <summary>
+/// Decodes one complete encoded frame, such as LeafFrame_Encode produced.
+/// </summary>
+bool LeafFrame_Decode(const uint8_t* data, size_t length, LeafFrame* frame);
+
+void LeafFrameDecoder_Init(LeafFrameDecoder* decoder);
+
+/// <summary>
+/// Drops a partly received frame, keeping the stats, e.g. after the baud rate changed.
+/// </summary>
+void LeafFrameDecoder_Reset(LeafFrameDecoder* decoder);
+
+/// <summary>
+/// Feeds one received byte.
+/// </summary>
+/// <returns>true when the byte completed a valid frame, which is copied to frame.</returns>
+bool LeafFrameDecoder_Push(LeafFrameDecoder* decoder, uint8_t byte, LeafFrame* frame);
+
+/// <summary>
+/// Reads a sensor sample or stored sample payload into frame; its fields still need
+/// SensorFrame_Check.
+/// </summary>
+bool LeafFrame_ReadSensorSample(const LeafFrame* leafFrame, SensorFrame* frame);
+bool LeafFrame_ReadAck(const LeafFrame* frame, LeafAck* ack);
+
+/// <summary>
+/// Converts motor orders such as "LF150;RS" to a motor command payload.
+/// </summary>
+/// <returns>Payload length, 0 if an order is malformed or they do not fit.</returns>
+size_t LeafFrame_WriteMotorOrders(const char* orders, uint8_t* payload, size_t size);
+
+/// <summary>
+/// Converts a motor command payload back to orders such as "LF150;RS".
+/// </summary>
+bool LeafFrame_ReadMotorOrders(const uint8_t* payload, size_t length, char* orders, size_t size);
+
+size_t LeafFrame_WriteConfig(LeafConfigKey key, uint32_t value, uint8_t* payload, size_t size);
+
+/// <summary>
+/// Writes up to LEAF_MOTOR_PLAN_MAX_SEGMENTS segments as a motor plan payload.
+/// </summary>
+/// <returns>Payload length, 0 if a segment is malformed or they do not fit.</returns>
+size_t LeafFrame_WriteMotorPlan(uint8_t replaceMotors, const LeafMotorSegment* segments, size_t count,
+    uint8_t* payload, size_t size);
+
+size_t LeafFrame_WriteCapabilities(uint16_t baudRates, uint8_t* payload, size_t size);
+bool LeafFrame_ReadCapabilities(const LeafFrame* frame, uint16_t* baudRates);
+size_t LeafFrame_WriteBaudRate(uint32_t baudRate, uint8_t* payload, size_t size);
+size_t LeafFrame_WriteFetchSamples(uint32_t sequence, uint8_t* payload, size_t size);
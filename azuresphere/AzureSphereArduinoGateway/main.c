@@ -3,14 +3,18 @@
 
 #include <stdbool.h>
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
-#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include <applibs/log.h>
 #include <applibs/gpio.h>
 #include <applibs/uart.h>
+#include <applibs/storage.h>
 
 // The following #include imports a "template appliance" definition. This app comes with multiple
 // implementations of the template appliance, each in a separate directory, which allow the code
@@ -28,6 +32,20 @@
 #include <hw/template_appliance.h>
 
 #include "azureiothub.h"
+#include "uart_line_buffer.h"
+#include "sample_queue.h"
+#include "sensor_frame_parser.h"
+#include "telemetry_batch.h"
+#include "sensor_aggregate.h"
+#include "telemetry_deadband.h"
+#include "telemetry_encoder.h"
+#include "telemetry_journal.h"
+#include "uart_command_queue.h"
+#include "motor_command_coalescer.h"
+#include "leaf_protocol.h"
+#include "leaf_link.h"
+#include "leaf_clock.h"
+#include "sample_gaps.h"
 
 #define AZUREIOTHUB_TEST_SEND true
 
@@ -39,7 +57,14 @@
 typedef enum {
     ExitCode_Success = 0,
 
-    ExitCode_Main_Led = 1
+    ExitCode_Main_Led = 1,
+    ExitCode_TermHandler_SigTerm = 2,
+    ExitCode_Main_EventLoopFail = 3,
+    ExitCode_Init_EventLoop = 4,
+    ExitCode_Init_UartRegistration = 5,
+    ExitCode_Init_TelemetryTimer = 6,
+    ExitCode_Init_AlarmTimer = 7,
+    ExitCode_Init_MotorTimer = 8
 } ExitCode;
 
 // LED
@@ -53,24 +78,139 @@ static int systemStatusIoTRetry = -1;
 static char* scopeId;
 
 static void deviceTwinCallback(const JSON_Object* desiredProps);
-static int directMethodCallback(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size);
+static void RegisterDirectMethods(void);
 static void c2dMessageCallback(const unsigned char* message, size_t size);
+static void connectionStateChanged(AzureIoTHub_ConnectionState state);
+
+// TriggerAlarm blinks this LED for a while.
+static int alarmLedGpioFd = -1;
+static EventLoopTimer* alarmTimer = NULL;
+static int alarmBlinksRemaining = 0;
+static const long alarmBlinkPeriodMilliseconds = 250;
+static const int alarmDefaultDurationSeconds = 10;
+static const int alarmMaxDurationSeconds = 300;
+static void AlarmTimerEventHandler(EventLoopTimer* timer);
 
 static int uartFd = -1;
 static UART_Config uartConfig;
+static EventRegistration* uartEventReg = NULL;
+// Commands for the leaf device are queued by method handlers and written while the UART
+// can take them, so IoT Hub callbacks never wait for the serial line.
+static UartCommandQueue uartCommandQueue;
+static bool uartWritePending = false;
+// Drive orders wait here, newest per motor, until the UART has no motor command waiting
+// and the coalescing window since the last one has passed.
+static EventLoopTimer* motorCoalesceTimer = NULL;
+static const int motorCoalesceMaxMilliseconds = 5000;
+static void MotorCoalesceTimerEventHandler(EventLoopTimer* timer);
+static void ReleaseMotorOrders(void);
+static bool QueueLeafConfig(LeafConfigKey key, uint32_t value);
+
+/// <summary>
+/// What the gateway sends upstream for the samples received from the leaf device.
+/// </summary>
+typedef enum {
+    TelemetryMode_Samples = 0,   // every sample, batched into JSON arrays
+    TelemetryMode_Aggregates = 1 // one min/max/mean/stddev summary per telemetry interval
+} TelemetryMode;
 
-static pthread_t sensorReadingThread;
-static pthread_mutex_t mutex_for_sensor_reading_buffer = PTHREAD_MUTEX_INITIALIZER;
-static float lastTemperature = 0.0;
-static float lastHumidity = 0.0;
-static float lastPressure = 0.0;
-static float lastAltitude = 0.0;
 static int telemetryIntervalSec = 5;
-static bool sensorReadingFromArduino = false;
-static void sensorReadingReceiveHandler(void* context);
+static TelemetryMode telemetryMode = TelemetryMode_Aggregates;
+static const TelemetryEncoder* telemetryEncoder = TELEMETRY_ENCODER;
+// The queue is drained at this rate; the batch limits or the window length decide when to send.
+static const int telemetryDrainPeriodSeconds = 1;
+static SensorWindow telemetryWindow;
+static struct timespec telemetryWindowOpenedAt;
+static struct timespec deadbandStatsReportedAt;
+static const TelemetryBatchConfig telemetryBatchConfig = {
+    .maxSamples = 50, .maxBytes = TELEMETRY_BATCH_MAX_BYTES, .maxAgeSeconds = 5};
+static EventLoopTimer* telemetryTimer = NULL;
+// The leaf device talks binary frames (leaf_protocol.h) unless built with the
+// LEAF_PROTOCOL_TEXT option for sketches still using the text protocol.
+#if defined(LEAF_PROTOCOL_TEXT)
+static UartLineBuffer uartLineBuffer;
+#else
+static LeafFrameDecoder leafFrameDecoder;
+static uint16_t leafFrameSequence = 0;
+static unsigned long leafAcks = 0;
+static unsigned long leafNacks = 0;
+// The link starts at LEAF_BASE_BAUD_RATE and moves to the fastest rate both ends offer;
+// the MT3620 ISU UARTs handle every rate in LeafFrame_BaudRates.
+static const uint16_t leafLinkBaudRates = (1u << LEAF_BAUD_RATE_COUNT) - 1;
+static void SendLeafCapabilities(uint16_t baudRates);
+static void SendLeafBaudRate(uint32_t baudRate);
+static bool SetUartBaudRate(uint32_t baudRate);
+static const LeafLinkHandlers leafLinkHandlers = {
+    .sendCapabilities = SendLeafCapabilities, .sendBaudRate = SendLeafBaudRate, .setBaudRate = SetUartBaudRate};
+// Nothing is written after a rate change frame until the switch ends: the leaf may already
+// listen at the new rate, and the link reopens the UART at one rate or the other.
+static bool leafBaudRateFrameQueued = false;
+static uint32_t leafBaudRateFrameSequence = 0;
+static void ResumeUartCommands(void);
+// Samples skipped on the live stream are fetched again from the leaf's history as soon as
+// the gap shows, and again every backfillRetrySeconds while any are missing.
+static const int backfillRetrySeconds = 2;
+static bool backfillRequested = false;
+static struct timespec backfillRequestedAt;
+static unsigned long backfillRequests = 0;
+static void RequestSampleBackfill(bool newGap, const struct timespec* now);
+#endif
+static const int leafSensorPeriodMinMilliseconds = 100;
+static const int leafSensorPeriodMaxMilliseconds = 60000;
+// Samples flow from the UART event handler (producer) to the telemetry timer (consumer).
+static SampleQueue sensorSampleQueue;
+static const SampleQueue_OverflowPolicy sensorSampleOverflowPolicy = SampleQueue_DropOldest;
+static unsigned long reportedSampleDrops = 0;
+static unsigned long reportedMalformedFrames = 0;
+static void UartEventHandler(EventLoop* el, int fd, EventLoop_IoEvents events, void* context);
+static void TelemetryTimerEventHandler(EventLoopTimer* timer);
+static void SendTelemetryBatch(const unsigned char* body, size_t length, size_t sampleCount, unsigned int fields);
+static void SendTelemetryWindow(void);
+static void ReportDeadbandState(void);
+
+// Telemetry that could not be delivered is kept in mutable storage and replayed once
+// IoT Hub is reachable again, a few records per drain period next to the live messages.
+static int journalFd = -1;
+static const size_t journalCapacityBytes = 64 * 1024; // MutableStorage SizeKB in app_manifest.json
+static const size_t journalReplayPerPeriod = 4;
+static const int sendWindowSize = 8;
+
+/// <summary>
+/// Kinds of telemetry message, sent as the "messageType" application property.
+/// </summary>
+typedef enum {
+    TelemetryMessage_Samples = 0,
+    TelemetryMessage_Window = 1
+} TelemetryMessageType;
+static const char* const telemetryMessageTypeNames[] = {"sensorSamples", "sensorWindow"};
+static const char telemetrySchemaVersion[] = "1";
+
+/// <summary>
+/// Describes a telemetry message for its application properties and message id. Journaled
+/// bodies are stored behind it so replays are sent with the same properties.
+/// </summary>
+typedef struct {
+    uint8_t version; // TELEMETRY_RECORD_VERSION, 0 marks a free liveTelemetry slot
+    uint8_t messageType;
+    uint16_t sampleCount;
+    uint32_t fields;
+    uint32_t bootId;
+    uint32_t sequence;
+} TelemetryRecord;
+#define TELEMETRY_RECORD_VERSION 1
+static uint32_t telemetryBootId = 0;
+static uint32_t telemetrySequence = 0;
+// Live messages awaiting confirmation, so undelivered ones can be journaled with their record.
+static TelemetryRecord liveTelemetry[AZUREIOTHUB_MAX_SEND_WINDOW];
+static unsigned char journalRecordBuffer[TELEMETRY_JOURNAL_MAX_RECORD];
+static void SendTelemetry(TelemetryMessageType messageType, size_t sampleCount, unsigned int fields,
+    const unsigned char* body, size_t length);
+static bool SendJournalRecord(const unsigned char* body, size_t length, uint32_t sequence);
 
 static EventLoop* eventLoop = NULL;
-static bool WorkOnEventLoop();
+static volatile sig_atomic_t exitCode = ExitCode_Success;
+static void TerminationHandler(int signalNumber);
+static void ClosePeripheralsAndHandlers(void);
 
 int main(int argc, char* argv[])
 {
@@ -78,8 +218,13 @@ int main(int argc, char* argv[])
         "\nVisit https://github.com/Azure/azure-sphere-samples for extensible samples to use as a "
         "starting point for full applications.\n");
 
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = TerminationHandler;
+    sigaction(SIGTERM, &action, NULL);
+
     UART_InitConfig(&uartConfig);
-    uartConfig.baudRate = 9600;
+    uartConfig.baudRate = LEAF_BASE_BAUD_RATE;
     uartConfig.flowControl = UART_FlowControl_None;
     uartFd = UART_Open(MT3620_ISU3_UART, &uartConfig);
     if (uartFd < 0) {
@@ -96,213 +241,1278 @@ int main(int argc, char* argv[])
     systemStatusIoTRetry = GPIO_OpenAsOutput(MT3620_RDB_LED4_RED, GPIO_OutputMode_PushPull, GPIO_Value_High);
 
 
-    bool isNetworkingReady = false;
     if (argc > 1) {
         scopeId = argv[1];
         Log_Debug("Using Azure IoT DPS Scope ID %s\n", scopeId);
     }
     else {
         Log_Debug("ScopeId needs to be set in the app_manifest CmdArgs for IoT Hub telemetry\n");
-        isNetworkingReady = false;
     }
 
     eventLoop = EventLoop_Create();
     if (eventLoop == NULL) {
         Log_Debug("Error - Failed to create event loop!");
+        return ExitCode_Init_EventLoop;
     }
 
-    isNetworkingReady = AzureIoTHub_CheckNetworkStatus(systemStatusNetworkLedGpioFd);
-    if (isNetworkingReady)
-    {
-        AzureIoTHub_SetupAzureClient(scopeId,eventLoop, systemStatusDPSStatusLedGpioFd, systemStatusIoTHubLedGpioFd);
-        AzureIoTHub_SetRequestHandle(c2dMessageCallback, deviceTwinCallback, directMethodCallback);
-        unsigned char* reportedProps = "{\"status\":\"ready\"}";
-        AzureIoTHub_UpdateTwinReportState(reportedProps);
+    // Connecting happens in the background; "ready" is reported once connected.
+    AzureIoTHub_SetRequestHandle(c2dMessageCallback, deviceTwinCallback);
+    RegisterDirectMethods();
+    AzureIoTHub_SetConnectionStateCallback(connectionStateChanged);
+    // Message ids combine this with a per-message sequence number.
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    telemetryBootId = (uint32_t)(realtime.tv_sec ^ realtime.tv_nsec ^ monotonic.tv_nsec);
+    if (AzureIoTHub_InitMessagePool(sendWindowSize, TELEMETRY_BATCH_MAX_BYTES) != 0) {
+        Log_Debug("WARNING: message pool not allocated: %s (%d).\n", strerror(errno), errno);
     }
+    AzureIoTHub_CheckNetworkStatus(systemStatusNetworkLedGpioFd);
+    AzureIoTHub_SetupAzureClient(scopeId, eventLoop, systemStatusDPSStatusLedGpioFd, systemStatusIoTHubLedGpioFd,
+        systemStatusIoTRetry);
 
-    int fd = GPIO_OpenAsOutput(MT3620_RDB_LED1_RED, GPIO_OutputMode_PushPull, GPIO_Value_High);
-    if (fd < 0) {
+    alarmLedGpioFd = GPIO_OpenAsOutput(MT3620_RDB_LED1_RED, GPIO_OutputMode_PushPull, GPIO_Value_High);
+    if (alarmLedGpioFd < 0) {
         Log_Debug(
             "Error opening GPIO: %s (%d). Check that app_manifest.json includes the GPIO used.\n",
             strerror(errno), errno);
         return ExitCode_Main_Led;
     }
+    alarmTimer = CreateEventLoopDisarmedTimer(eventLoop, AlarmTimerEventHandler);
+    if (alarmTimer == NULL) {
+        Log_Debug("ERROR: Failure creating alarm timer!\n");
+        return ExitCode_Init_AlarmTimer;
+    }
+    motorCoalesceTimer = CreateEventLoopDisarmedTimer(eventLoop, MotorCoalesceTimerEventHandler);
+    if (motorCoalesceTimer == NULL) {
+        Log_Debug("ERROR: Failure creating motor command timer!\n");
+        return ExitCode_Init_MotorTimer;
+    }
 
-    int thread_create_result = pthread_create(&sensorReadingThread, NULL, sensorReadingReceiveHandler, (void*)uartFd);
-    if (thread_create_result != 0) {
-        Log_Debug("Sensor Reading Thread can't be created! - %d\n", thread_create_result);
+    journalFd = Storage_OpenMutableFile();
+    if (journalFd < 0 || TelemetryJournal_Open(journalFd, journalCapacityBytes) != 0) {
+        Log_Debug("WARNING: telemetry journal unavailable, undelivered telemetry will be lost: %s (%d).\n",
+            strerror(errno), errno);
     }
 
-//    int count = 0;
-    unsigned char messageBody[1024];
-    const struct timespec sendInterval = { .tv_sec = telemetryIntervalSec, .tv_nsec = 0 };
-//    const struct timespec sleepTime = { .tv_sec = 1, .tv_nsec = 0 };
-    while (true) {
-        //        GPIO_SetValue(fd, GPIO_Value_Low);
-        //        nanosleep(&sleepTime, NULL);
-        //        GPIO_SetValue(fd, GPIO_Value_High);
-        //        nanosleep(&sleepTime, NULL);
-
-        //        if (AZUREIOTHUB_TEST_SEND) {
-        time_t now = time(NULL);
-        struct tm tm;
-        localtime_r(&now, &tm);
-
-        float temp, humi, pres;
-        bool isSend = false;
-        pthread_mutex_lock(&mutex_for_sensor_reading_buffer);
-        temp = lastTemperature;
-        humi = lastHumidity;
-        pres = lastPressure;
-        isSend = sensorReadingFromArduino;
-        pthread_mutex_unlock(&mutex_for_sensor_reading_buffer);
-
-        //            sprintf(messageBody, "{\"count\":%d,\"timestamp\":\"%04d/%02d/%02dT%02d:%02d:%02d\"}", count++, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-        if (isSend) {
-            sprintf(messageBody, "{\"temperature\":%.2f,\"humidity\":%.2f,\"pressure\":%.2f,\"timestamp\":\"%04d/%02d/%02dT%02d:%02d:%02d\"}",
-                temp, humi, pres, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-            AzureIoTHub_SendMessage(messageBody, systemStatusIoTSending, systemStatusIoTRetry);
-        }
-        nanosleep(&sendInterval, NULL);
-        //        }
-        WorkOnEventLoop();
-    }
-}
-
-bool WorkOnEventLoop()
-{
-    EventLoop_Run_Result result = EventLoop_Run(eventLoop, -1, true);
-    if (result == EventLoop_Run_Failed) {
-        return false;
+    SampleQueue_Init(&sensorSampleQueue, sensorSampleOverflowPolicy);
+#if defined(LEAF_PROTOCOL_TEXT)
+    UartLineBuffer_Init(&uartLineBuffer);
+#else
+    LeafFrameDecoder_Init(&leafFrameDecoder);
+#endif
+    UartCommandQueue_Init(&uartCommandQueue);
+    if (uartFd >= 0) {
+        uartEventReg = EventLoop_RegisterIo(eventLoop, uartFd, EventLoop_Input, UartEventHandler, NULL);
+        if (uartEventReg == NULL) {
+            Log_Debug("ERROR: Unable to register UART event: %s (%d).\n", strerror(errno), errno);
+            return ExitCode_Init_UartRegistration;
+        }
     }
-    return true;
+#if !defined(LEAF_PROTOCOL_TEXT)
+    struct timespec linkStartedAt;
+    clock_gettime(CLOCK_MONOTONIC, &linkStartedAt);
+    LeafLink_Init(&leafLinkHandlers, leafLinkBaudRates, &linkStartedAt);
+#endif
+
+    TelemetryBatchConfig batchConfig = telemetryBatchConfig;
+    batchConfig.maxAgeSeconds = telemetryIntervalSec;
+    TelemetryBatch_Init(&batchConfig, telemetryEncoder, SendTelemetryBatch);
+    Log_Debug("INFO: telemetry encoding %s.\n", telemetryEncoder->name);
+    SensorWindow_Reset(&telemetryWindow);
+    clock_gettime(CLOCK_MONOTONIC, &telemetryWindowOpenedAt);
+    deadbandStatsReportedAt = telemetryWindowOpenedAt;
+
+    struct timespec telemetryPeriod = { .tv_sec = telemetryDrainPeriodSeconds, .tv_nsec = 0 };
+    telemetryTimer = CreateEventLoopPeriodicTimer(eventLoop, TelemetryTimerEventHandler, &telemetryPeriod);
+    if (telemetryTimer == NULL) {
+        Log_Debug("ERROR: Failure creating telemetry timer!\n");
+        return ExitCode_Init_TelemetryTimer;
+    }
+
+    // UART input, telemetry and IoT Hub work are all dispatched from here.
+    while (exitCode == ExitCode_Success) {
+        EventLoop_Run_Result result = EventLoop_Run(eventLoop, -1, true);
+        // Continue if interrupted by signal, e.g. due to breakpoint being set.
+        if (result == EventLoop_Run_Failed && errno != EINTR) {
+            exitCode = ExitCode_Main_EventLoopFail;
+        }
+    }
+
+    ClosePeripheralsAndHandlers();
+    Log_Debug("Application exiting.\n");
+    return exitCode;
 }
 
-static void sensorReadingReceiveHandler(void* args)
-{
-    char readBuf[128];
-    char* sensormark = "sensors:";
-    char* delim = ":";
-    size_t readBufMax = 128;
-    size_t readSize = 64;
-    float temp, humi, pres, alti;
-    int fd = (int)args;
-
-    while (true) {
-        ssize_t readLen = read(fd, (void*)readBuf, readSize);
-        char* p = readBuf;
-        if (readLen > strlen(sensormark)) {
-            bool valid = true;
-            int index = 0;
-            if (readBuf[index] == '\r' && readBuf[index + 1] == '\n') {
-                p = readBuf + 2;
-                readSize -= 2;
-            }
-            for (int i = 0; i < strlen(sensormark); i++) {
-                if (p[i] != sensormark[i]) {
-                    valid = false;
-                    break;
-                }
+/// <summary>
+/// Signal handler for termination requests. This handler must be async-signal-safe.
+/// </summary>
+static void TerminationHandler(int signalNumber)
+{
+    exitCode = ExitCode_TermHandler_SigTerm;
+}
+
+static void ClosePeripheralsAndHandlers(void)
+{
+    DisposeEventLoopTimer(telemetryTimer);
+    DisposeEventLoopTimer(alarmTimer);
+    DisposeEventLoopTimer(motorCoalesceTimer);
+    if (uartEventReg != NULL) {
+        EventLoop_UnregisterIo(eventLoop, uartEventReg);
+    }
+    EventLoop_Close(eventLoop);
+    if (uartFd >= 0) {
+        close(uartFd);
+    }
+    if (journalFd >= 0) {
+        TelemetryJournal_Flush();
+        close(journalFd);
+    }
+}
+
+/// <summary>
+/// Telemetry timer event: move every queued sample into the current batch or window.
+/// </summary>
+static void TelemetryTimerEventHandler(EventLoopTimer* timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_Main_EventLoopFail;
+        return;
+    }
+
+    SensorSample sample;
+    while (SampleQueue_Pop(&sensorSampleQueue, &sample)) {
+        if (telemetryMode == TelemetryMode_Samples) {
+            if (TelemetryDeadband_Check(&sample)) {
+                TelemetryBatch_Add(&sample);
             }
-            if (valid) {
-                int index = readSize - 1;
-                while (p[index] != ':') {
-                    index--;
-                }
-                p[index] = '\0';
-
-                sscanf(p, "sensors:temp=%f,humi=%f,pres=%f,alti=%f", &temp, &humi, &pres, &alti);
-                pthread_mutex_lock(&mutex_for_sensor_reading_buffer);
-                lastTemperature = temp;
-                lastHumidity = humi;
-                lastPressure = pres;
-                lastAltitude = alti;
-                sensorReadingFromArduino = true;
-                pthread_mutex_unlock(&mutex_for_sensor_reading_buffer);
+        }
+        else {
+            SensorWindow_Add(&telemetryWindow, &sample);
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (telemetryMode == TelemetryMode_Samples) {
+        TelemetryBatch_Poll();
+    }
+    else if (now.tv_sec - telemetryWindowOpenedAt.tv_sec >= telemetryIntervalSec) {
+        SendTelemetryWindow();
+        SensorWindow_Reset(&telemetryWindow);
+        telemetryWindowOpenedAt = now;
+    }
+
+    DeadbandConfig deadbandConfig;
+    TelemetryDeadband_GetConfig(&deadbandConfig);
+    if (deadbandConfig.enabled && now.tv_sec - deadbandStatsReportedAt.tv_sec >= deadbandConfig.maxSilenceSeconds) {
+        ReportDeadbandState();
+        deadbandStatsReportedAt = now;
+    }
+
+#if !defined(LEAF_PROTOCOL_TEXT)
+    const LeafFrameStats* link = &leafFrameDecoder.stats;
+    LeafLink_Poll(&now, link->frames, link->crcErrors + link->malformed + link->oversized);
+    ResumeUartCommands();
+#endif
+
+    // Replays leave one slot of the send window to live telemetry.
+    int sendWindowAvailable = AzureIoTHub_GetSendWindowAvailable();
+    if (sendWindowAvailable > 1) {
+        size_t replayLimit = (size_t)sendWindowAvailable - 1;
+        TelemetryJournal_Replay(replayLimit < journalReplayPerPeriod ? replayLimit : journalReplayPerPeriod,
+            SendJournalRecord);
+    }
+    TelemetryJournal_Flush();
+
+    SampleQueueStats queueStats;
+    SampleQueue_GetStats(&sensorSampleQueue, &queueStats);
+    unsigned long sampleDrops = queueStats.droppedOldest + queueStats.droppedNewest;
+    if (sampleDrops != reportedSampleDrops) {
+        Log_Debug("WARNING: sensor sample queue overflow - dropped oldest %lu, newest %lu of %lu.\n",
+            queueStats.droppedOldest, queueStats.droppedNewest, queueStats.pushed);
+        reportedSampleDrops = sampleDrops;
+    }
+    SensorFrameParserStats parserStats;
+    SensorFrame_GetStats(&parserStats);
+    if (parserStats.malformed != reportedMalformedFrames) {
+        Log_Debug("WARNING: %lu malformed sensor frames (%lu parsed, %lu incomplete, %lu values out of range).\n",
+            parserStats.malformed, parserStats.parsed, parserStats.incomplete, parserStats.outOfRange);
+        reportedMalformedFrames = parserStats.malformed;
+    }
+}
+
+static void FormatSensorSet(unsigned int fields, char* buffer, size_t size)
+{
+    static const struct {
+        unsigned int field;
+        const char* name;
+    } sensorNames[] = {{SensorField_Temperature, "temperature"},
+                       {SensorField_Humidity, "humidity"},
+                       {SensorField_Pressure, "pressure"},
+                       {SensorField_Altitude, "altitude"}};
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (size_t i = 0; i < sizeof(sensorNames) / sizeof(sensorNames[0]); i++) {
+        if ((fields & sensorNames[i].field) && length < size) {
+            int written = snprintf(buffer + length, size - length, "%s%s", length > 0 ? "," : "", sensorNames[i].name);
+            if (written > 0) {
+                length += (size_t)written;
             }
         }
     }
 }
 
+/// <summary>
+/// Sends a telemetry body with the properties IoT Hub routing filters on.
+/// </summary>
+static bool SendTelemetryRecord(const TelemetryRecord* record, const unsigned char* body, size_t length,
+    AZUREIOTHUB_SEND_CALLBACK callback, void* context)
+{
+    char messageId[20];
+    char sampleCount[8];
+    char sensors[48];
+    snprintf(messageId, sizeof(messageId), "%08x-%08x", (unsigned int)record->bootId, (unsigned int)record->sequence);
+    snprintf(sampleCount, sizeof(sampleCount), "%u", (unsigned int)record->sampleCount);
+    FormatSensorSet(record->fields, sensors, sizeof(sensors));
+    const char* messageType = "unknown";
+    if (record->messageType < sizeof(telemetryMessageTypeNames) / sizeof(telemetryMessageTypeNames[0])) {
+        messageType = telemetryMessageTypeNames[record->messageType];
+    }
 
-static void deviceTwinCallback(const JSON_Object* desiredProps)
+    const AzureIoTHub_MessageProperty properties[] = {
+        {"messageType", messageType}, {"sensors", sensors}, {"batchSize", sampleCount}};
+    const AzureIoTHub_MessageOptions options = {.contentType = telemetryEncoder->contentType,
+                                                .contentEncoding = telemetryEncoder->contentEncoding,
+                                                .messageId = messageId,
+                                                .schemaVersion = telemetrySchemaVersion,
+                                                .properties = properties,
+                                                .propertyCount = sizeof(properties) / sizeof(properties[0])};
+    return AzureIoTHub_SendMessageBytes(body, length, &options, callback, context, systemStatusIoTSending);
+}
+
+static void JournalRecordConfirmed(bool delivered, const unsigned char* body, size_t length, void* context)
 {
-    ;
+    TelemetryJournal_Confirm((uint32_t)(uintptr_t)context, delivered);
 }
 
-static void MotorDriveOrder(const char* command)
+static bool SendJournalRecord(const unsigned char* data, size_t length, uint32_t sequence)
 {
-    size_t msgLen = strlen(command);
-    int byteSent = write(uartFd, command, msgLen + 1);
-    if (byteSent > 0) {
-        Log_Debug("Send message:'%s' to UART\n", command);
+    TelemetryRecord record = {.version = 0};
+    if (length > sizeof(record)) {
+        memcpy(&record, data, sizeof(record));
     }
-    else {
-        Log_Debug("UAR send failed\n");
-    }
-}
-
-static int directMethodCallback(const char* methodName, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size)
-{
-    unsigned char* responseString = "{}";
-    response_size = strlen(responseString) + 1;
-    response = &responseString;
-    int result = 404;
-
-    if (strcmp("MotorDrive", methodName) == 0) {
-        responseString = "\"Invalid MotorDrive Order\"";
-        Log_Debug("MotorDrive Invoked\n");
-        JSON_Value* root_value = json_parse_string(payload);
-        JSON_Value_Type jsonValueType = json_value_get_type(root_value);
-        if (jsonValueType == JSONString) {
-            const char* motorCommandJson = json_value_get_string(root_value);
-            JSON_Value* contentValue = json_parse_string(motorCommandJson);
-            jsonValueType = json_value_get_type(contentValue);
-            if (jsonValueType == JSONObject) {
-                JSON_Object* contentObject = json_value_get_object(contentValue);
-                const char* motorCommand = json_object_get_string(contentObject, "command");
-                Log_Debug("Command:%s\n", motorCommand);
-                MotorDriveOrder(motorCommand);
-                responseString = "\"Received MotorDrive invocation - string style\"";
+    if (record.version != TELEMETRY_RECORD_VERSION) {
+        // Not written by this version; send it as it is rather than lose it.
+        record = (TelemetryRecord){.messageType = UINT8_MAX, .bootId = telemetryBootId, .sequence = telemetrySequence++};
+        return SendTelemetryRecord(&record, data, length, JournalRecordConfirmed, (void*)(uintptr_t)sequence);
+    }
+    return SendTelemetryRecord(&record, data + sizeof(record), length - sizeof(record), JournalRecordConfirmed,
+        (void*)(uintptr_t)sequence);
+}
+
+static void JournalTelemetry(const TelemetryRecord* record, const unsigned char* body, size_t length)
+{
+    if (sizeof(*record) + length > sizeof(journalRecordBuffer)) {
+        Log_Debug("ERROR: telemetry message of %zu bytes lost.\n", length);
+        return;
+    }
+    memcpy(journalRecordBuffer, record, sizeof(*record));
+    memcpy(journalRecordBuffer + sizeof(*record), body, length);
+    if (!TelemetryJournal_Append(journalRecordBuffer, sizeof(*record) + length)) {
+        Log_Debug("ERROR: telemetry message of %zu bytes lost.\n", length);
+    }
+}
+
+static void TelemetryMessageConfirmed(bool delivered, const unsigned char* body, size_t length, void* context)
+{
+    TelemetryRecord* record = context;
+    if (!delivered && body != NULL) {
+        JournalTelemetry(record, body, length);
+    }
+    record->version = 0;
+}
+
+/// <summary>
+/// Sends a telemetry message now, or journals it if IoT Hub cannot take it.
+/// </summary>
+static void SendTelemetry(TelemetryMessageType messageType, size_t sampleCount, unsigned int fields,
+    const unsigned char* body, size_t length)
+{
+    TelemetryRecord record = {.version = TELEMETRY_RECORD_VERSION,
+                              .messageType = (uint8_t)messageType,
+                              .sampleCount = (uint16_t)sampleCount,
+                              .fields = fields,
+                              .bootId = telemetryBootId,
+                              .sequence = telemetrySequence++};
+    TelemetryRecord* live = NULL;
+    for (size_t i = 0; i < sizeof(liveTelemetry) / sizeof(liveTelemetry[0]); i++) {
+        if (liveTelemetry[i].version == 0) {
+            live = &liveTelemetry[i];
+            break;
+        }
+    }
+    if (live != NULL && AzureIoTHub_IsConnected()) {
+        *live = record;
+        if (SendTelemetryRecord(live, body, length, TelemetryMessageConfirmed, live)) {
+            return;
+        }
+        live->version = 0;
+    }
+    JournalTelemetry(&record, body, length);
+}
+
+static void SendTelemetryBatch(const unsigned char* body, size_t length, size_t sampleCount, unsigned int fields)
+{
+    Log_Debug("INFO: sending telemetry batch of %zu samples, %zu bytes.\n", sampleCount, length);
+    SendTelemetry(TelemetryMessage_Samples, sampleCount, fields, body, length);
+}
+
+/// <summary>
+/// Sends the summary of the current window, if it received any sample.
+/// </summary>
+static void SendTelemetryWindow(void)
+{
+    if (telemetryWindow.samples == 0) {
+        return;
+    }
+
+    // The deadband compares window means against the means last sent.
+    SensorSample means = {.timestamp = telemetryWindow.end, .fields = 0};
+    if (telemetryWindow.temperature.count > 0) {
+        means.temperature = (float)telemetryWindow.temperature.mean;
+        means.fields |= SensorField_Temperature;
+    }
+    if (telemetryWindow.humidity.count > 0) {
+        means.humidity = (float)telemetryWindow.humidity.mean;
+        means.fields |= SensorField_Humidity;
+    }
+    if (telemetryWindow.pressure.count > 0) {
+        means.pressure = (float)telemetryWindow.pressure.mean;
+        means.fields |= SensorField_Pressure;
+    }
+    if (!TelemetryDeadband_Check(&means)) {
+        return;
+    }
+
+    unsigned char messageBody[1024];
+    size_t length = telemetryEncoder->encodeWindow(messageBody, sizeof(messageBody), &telemetryWindow);
+    if (length == 0) {
+        Log_Debug("ERROR: telemetry window does not fit the message buffer.\n");
+        return;
+    }
+    SendTelemetry(TelemetryMessage_Window, telemetryWindow.samples, means.fields, messageBody, length);
+}
+
+/// <summary>
+/// Queues a sample for telemetry. resent is set for samples the leaf sent again on request,
+/// which are older than the latest live one.
+/// </summary>
+static void QueueSensorFrame(const SensorFrame* frame, bool resent)
+{
+    SensorSample sample;
+    sample.temperature = frame->temperature;
+    sample.humidity = frame->humidity;
+    sample.pressure = frame->pressure;
+    sample.altitude = frame->altitude;
+    sample.fields = frame->fields;
+    clock_gettime(CLOCK_REALTIME, &sample.timestamp);
+    if (frame->stamped) {
+        // Back-date the sample to when the leaf took it, as far as its clock tells.
+        struct timespec arrival, taken;
+        clock_gettime(CLOCK_MONOTONIC, &arrival);
+        if (!resent) {
+            LeafClock_Map(frame->sequence, frame->tick, &arrival, &taken);
+        }
+        else if (!LeafClock_MapEarlier(frame->tick, &taken)) {
+            taken = arrival;
+        }
+        long delayMilliseconds =
+            (long)(arrival.tv_sec - taken.tv_sec) * 1000L + (arrival.tv_nsec - taken.tv_nsec) / 1000000L;
+        sample.timestamp.tv_sec -= delayMilliseconds / 1000;
+        sample.timestamp.tv_nsec -= (delayMilliseconds % 1000) * 1000000L;
+        if (sample.timestamp.tv_nsec < 0) {
+            sample.timestamp.tv_nsec += 1000000000L;
+            sample.timestamp.tv_sec--;
+        }
+    }
+    SampleQueue_Push(&sensorSampleQueue, &sample);
+}
+
+#if defined(LEAF_PROTOCOL_TEXT)
+static void sensorFrameReceived(const char* line, size_t length)
+{
+    SensorFrame frame;
+    if (SensorFrame_Parse(line, length, &frame) == SensorFrame_Ok) {
+        QueueSensorFrame(&frame, false);
+    }
+}
+#else
+static void LeafFrameReceived(const LeafFrame* leafFrame)
+{
+    SensorFrame frame;
+    LeafAck ack;
+    uint16_t baudRates;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    LeafLink_FrameReceived(&now);
+    switch (leafFrame->type) {
+    case LeafFrame_SensorSample:
+        if (LeafFrame_ReadSensorSample(leafFrame, &frame) && SensorFrame_Check(&frame) == SensorFrame_Ok) {
+            if (frame.stamped) {
+                RequestSampleBackfill(SampleGaps_Live(frame.sequence), &now);
             }
+            QueueSensorFrame(&frame, false);
+        }
+        break;
+    case LeafFrame_StoredSample:
+        if (LeafFrame_ReadSensorSample(leafFrame, &frame) && SensorFrame_Check(&frame) == SensorFrame_Ok
+            && frame.stamped && SampleGaps_Resent(frame.sequence)) {
+            QueueSensorFrame(&frame, true);
+        }
+        break;
+    case LeafFrame_Ack:
+        if (!LeafFrame_ReadAck(leafFrame, &ack)) {
+            break;
         }
-        else if (jsonValueType == JSONObject) {
-            JSON_Object* contentObject = json_value_get_object(root_value);
-            const char* motorCommand = json_object_get_string(contentObject, "command");
-            Log_Debug("Command:%s\n", motorCommand);
-            MotorDriveOrder(motorCommand);
-            responseString = "\"Received MotorDrive invocation - json style\"";
+        if (ack.type == LeafFrame_SetBaudRate) {
+            LeafLink_BaudRateAcked(ack.status == LeafAck_Ok, &now);
+            ResumeUartCommands();
+        }
+        if (ack.status == LeafAck_Ok) {
+            leafAcks++;
         }
         else {
+            leafNacks++;
+            Log_Debug("WARNING: leaf device refused frame %u of type %u with status %u.\n",
+                (unsigned int)ack.sequence, (unsigned int)ack.type, (unsigned int)ack.status);
+        }
+        break;
+    case LeafFrame_Capabilities:
+        if (LeafFrame_ReadCapabilities(leafFrame, &baudRates)) {
+            LeafLink_CapabilitiesReceived(baudRates, &now);
+        }
+        break;
+    default:
+        break;
+    }
+}
+#endif
+
+/// <summary>
+/// UART input event: drain the non-blocking fd and hand every complete frame to its handler.
+/// </summary>
+static void ReadUartInput(int fd)
+{
+    char readBuf[64];
+#if defined(LEAF_PROTOCOL_TEXT)
+    char line[128];
+#else
+    LeafFrame frame;
+#endif
+
+    for (;;) {
+        ssize_t readLen = read(fd, (void*)readBuf, sizeof(readBuf));
+        if (readLen <= 0) {
+            if (readLen < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                Log_Debug("ERROR: UART read failed: %s (%d).\n", strerror(errno), errno);
+            }
+            return;
+        }
+
+        // Reads may end anywhere in a frame or carry several frames at once.
+#if defined(LEAF_PROTOCOL_TEXT)
+        size_t offset = 0;
+        while (offset < (size_t)readLen) {
+            offset += UartLineBuffer_Append(&uartLineBuffer, readBuf + offset, (size_t)readLen - offset);
+            int lineLength;
+            while ((lineLength = UartLineBuffer_NextLine(&uartLineBuffer, line, sizeof(line))) >= 0) {
+                sensorFrameReceived(line, (size_t)lineLength);
+            }
+        }
+#else
+        for (ssize_t i = 0; i < readLen; i++) {
+            if (LeafFrameDecoder_Push(&leafFrameDecoder, (uint8_t)readBuf[i], &frame)) {
+                LeafFrameReceived(&frame);
+            }
+        }
+        if (fd != uartFd) {
+            // A baud rate change reopened the UART; the new fd has its own registration.
+            return;
+        }
+#endif
+    }
+}
+
+/// <summary>
+/// Waits for the UART to become writable while commands are queued, and only then.
+/// </summary>
+static void WatchUartWritable(bool watch)
+{
+    if (watch == uartWritePending || uartEventReg == NULL) {
+        return;
+    }
+    EventLoop_IoEvents events = watch ? (EventLoop_Input | EventLoop_Output) : EventLoop_Input;
+    if (EventLoop_ModifyIoEvents(eventLoop, uartEventReg, events) != 0) {
+        Log_Debug("ERROR: Unable to modify UART events: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+    uartWritePending = watch;
+}
+
+/// <summary>
+/// Whether queued commands wait for a baud switch: the rate change frame is written, and the
+/// link has neither reopened the UART at the new rate nor given up on it.
+/// </summary>
+static bool UartWritesHeld(void)
+{
+#if defined(LEAF_PROTOCOL_TEXT)
+    return false;
+#else
+    LeafLinkStatus status;
+    LeafLink_GetStatus(&status);
+    return status.state == LeafLink_Switching && !leafBaudRateFrameQueued;
+#endif
+}
+
+/// <summary>
+/// Writes queued commands until the queue is empty or the UART would block.
+/// </summary>
+static void WriteUartCommands(int fd)
+{
+    const UartCommand* command;
+    while ((command = UartCommandQueue_Front(&uartCommandQueue)) != NULL) {
+        if (UartWritesHeld()) {
+            // ResumeUartCommands watches the UART again once the switch ends.
+            WatchUartWritable(false);
+            return;
+        }
+        ssize_t written = write(fd, command->data + command->written, command->length - command->written);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                WatchUartWritable(true);
+                return;
+            }
+            Log_Debug("ERROR: UART command %u dropped: %s (%d).\n", (unsigned int)command->sequence,
+                strerror(errno), errno);
+            UartCommandQueue_Drop(&uartCommandQueue);
+            continue;
+        }
+        if (written == 0) {
+            // Nothing was taken; wait for the UART rather than spin on it.
+            WatchUartWritable(true);
+            return;
+        }
+#if !defined(LEAF_PROTOCOL_TEXT)
+        if (leafBaudRateFrameQueued && command->sequence == leafBaudRateFrameSequence
+            && command->written + (size_t)written == command->length) {
+            leafBaudRateFrameQueued = false;
+        }
+#endif
+        UartCommandQueue_Advance(&uartCommandQueue, (size_t)written);
+    }
+    ReleaseMotorOrders();
+    WatchUartWritable(UartCommandQueue_Front(&uartCommandQueue) != NULL);
+}
+
+#if !defined(LEAF_PROTOCOL_TEXT)
+/// <summary>
+/// Watches the UART again for queued commands once a baud switch no longer holds them.
+/// </summary>
+static void ResumeUartCommands(void)
+{
+    WatchUartWritable(UartCommandQueue_Front(&uartCommandQueue) != NULL && !UartWritesHeld());
+}
+#endif
+
+static void UartEventHandler(EventLoop* el, int fd, EventLoop_IoEvents events, void* context)
+{
+    if (events & EventLoop_Input) {
+        ReadUartInput(fd);
+    }
+    if ((events & EventLoop_Output) && fd == uartFd) {
+        WriteUartCommands(fd);
+    }
+}
+
+
+/// <summary>
+/// Reports the deadband settings and suppression counters as twin reported properties.
+/// </summary>
+static void ReportDeadbandState(void)
+{
+    DeadbandConfig config;
+    DeadbandStats stats;
+    TelemetryDeadband_GetConfig(&config);
+    TelemetryDeadband_GetStats(&stats);
+
+    char reportedProps[256];
+    snprintf(reportedProps, sizeof(reportedProps),
+        "{\"deadband\":{\"enabled\":%s,\"maxSilenceSeconds\":%d,\"reported\":%lu,\"suppressed\":%lu,\"heartbeats\":%lu}}",
+        config.enabled ? "true" : "false", config.maxSilenceSeconds, stats.reported, stats.suppressed, stats.heartbeats);
+    AzureIoTHub_UpdateTwinReportState(reportedProps);
+}
 
+static void ReadDeadbandThreshold(const JSON_Object* deadband, const char* name, DeadbandThreshold* threshold)
+{
+    const JSON_Object* channel = json_object_get_object(deadband, name);
+    if (channel == NULL) {
+        return;
+    }
+    if (json_object_has_value_of_type(channel, "absolute", JSONNumber)) {
+        threshold->absolute = (float)json_object_get_number(channel, "absolute");
+    }
+    if (json_object_has_value_of_type(channel, "relative", JSONNumber)) {
+        threshold->relative = (float)json_object_get_number(channel, "relative");
+    }
+}
+
+/// <summary>
+/// Applies settings from desired properties or the SetConfig method. Supported:
+///   "deadband": { "enabled": bool, "maxSilenceSeconds": n,
+///                 "temperature"|"humidity"|"pressure": { "absolute": x, "relative": y } }
+///   "motorCoalesceMilliseconds": n, the least time between drive commands to the leaf device
+///   "leafSensorPeriodMilliseconds": n, how often the leaf device samples its sensors
+/// Settings that are not present keep their current value.
+/// </summary>
+static void ApplyConfig(const JSON_Object* config)
+{
+    if (json_object_has_value_of_type(config, "leafSensorPeriodMilliseconds", JSONNumber)) {
+        int period = (int)json_object_get_number(config, "leafSensorPeriodMilliseconds");
+        if (period < leafSensorPeriodMinMilliseconds || period > leafSensorPeriodMaxMilliseconds) {
+            Log_Debug("WARNING: leafSensorPeriodMilliseconds %d ignored, must be %d to %d.\n", period,
+                leafSensorPeriodMinMilliseconds, leafSensorPeriodMaxMilliseconds);
+        }
+        else if (uartFd < 0 || !QueueLeafConfig(LeafConfig_SensorPeriodMilliseconds, (uint32_t)period)) {
+            Log_Debug("WARNING: leaf sensor period not sent.\n");
+        }
+        else {
+            WatchUartWritable(true);
         }
-        result = 200;
     }
-    else if (strcmp("SendOrderToLeafDevice", methodName) == 0) {
-        responseString = "\"Invalid Order\"";
-        Log_Debug("SendOrderToLeafDevice Invoked\n");
-        if (strlen(payload) > 0) {
-            size_t order_result = write(uartFd, payload, strlen(payload));
-            if (order_result == 0) {
-                responseString = "\"Failed to send order to leaf device\"";
-                response = 500;
+    if (json_object_has_value_of_type(config, "motorCoalesceMilliseconds", JSONNumber)) {
+        int window = (int)json_object_get_number(config, "motorCoalesceMilliseconds");
+        if (window >= 0 && window <= motorCoalesceMaxMilliseconds) {
+            MotorCoalescer_SetWindow(window);
+            Log_Debug("INFO: motor commands coalesced over %d ms.\n", window);
+        }
+        else {
+            Log_Debug("WARNING: motorCoalesceMilliseconds %d ignored, must be 0 to %d.\n", window,
+                motorCoalesceMaxMilliseconds);
+        }
+    }
+    const JSON_Object* deadband = json_object_get_object(config, "deadband");
+    if (deadband != NULL) {
+        DeadbandConfig deadbandConfig;
+        TelemetryDeadband_GetConfig(&deadbandConfig);
+        if (json_object_has_value_of_type(deadband, "enabled", JSONBoolean)) {
+            deadbandConfig.enabled = json_object_get_boolean(deadband, "enabled") == 1;
+        }
+        if (json_object_has_value_of_type(deadband, "maxSilenceSeconds", JSONNumber)) {
+            // Below a second every drain period would send a heartbeat and a twin update.
+            int maxSilenceSeconds = (int)json_object_get_number(deadband, "maxSilenceSeconds");
+            if (maxSilenceSeconds >= 1) {
+                deadbandConfig.maxSilenceSeconds = maxSilenceSeconds;
             }
             else {
-                responseString = "\"Succeeded\"";
-                response = 200;
+                Log_Debug("WARNING: deadband maxSilenceSeconds %d ignored, must be at least 1.\n", maxSilenceSeconds);
             }
         }
-        else {
-            Log_Debug("payload noting!");
-            responseString = "\"need payload\"";
-            result = 400;
+        ReadDeadbandThreshold(deadband, "temperature", &deadbandConfig.temperature);
+        ReadDeadbandThreshold(deadband, "humidity", &deadbandConfig.humidity);
+        ReadDeadbandThreshold(deadband, "pressure", &deadbandConfig.pressure);
+        TelemetryDeadband_SetConfig(&deadbandConfig);
+        Log_Debug("INFO: deadband %s, heartbeat %d s.\n", deadbandConfig.enabled ? "enabled" : "disabled",
+            deadbandConfig.maxSilenceSeconds);
+        ReportDeadbandState();
+    }
+}
+
+static void deviceTwinCallback(const JSON_Object* desiredProps)
+{
+    ApplyConfig(desiredProps);
+}
+
+#if !defined(LEAF_PROTOCOL_TEXT)
+static bool QueueLeafFrame(LeafFrameType type, const uint8_t* payload, size_t length, bool urgent,
+    uint32_t* sequence)
+{
+    uint8_t frame[LEAF_FRAME_MAX_ENCODED];
+    size_t frameLength = LeafFrame_Encode(type, leafFrameSequence++, payload, length, frame, sizeof(frame));
+    return frameLength > 0 && UartCommandQueue_PushTagged(&uartCommandQueue, frame, frameLength, 0, urgent, sequence);
+}
+#endif
+
+/// <summary>
+/// Queues motor orders such as "LF150;RF150" in the leaf device protocol.
+/// </summary>
+static bool QueueMotorCommand(const char* orders, unsigned int channels, bool urgent, uint32_t* sequence)
+{
+#if defined(LEAF_PROTOCOL_TEXT)
+    // The leaf device expects the command NUL terminated.
+    return UartCommandQueue_PushTagged(&uartCommandQueue, orders, strlen(orders) + 1, channels, urgent, sequence);
+#else
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    uint8_t frame[LEAF_FRAME_MAX_ENCODED];
+    size_t payloadLength = LeafFrame_WriteMotorOrders(orders, payload, sizeof(payload));
+    size_t frameLength = LeafFrame_Encode(LeafFrame_MotorCommand, leafFrameSequence++, payload, payloadLength,
+        frame, sizeof(frame));
+    return payloadLength > 0 && frameLength > 0
+        && UartCommandQueue_PushTagged(&uartCommandQueue, frame, frameLength, channels, urgent, sequence);
+#endif
+}
+
+/// <summary>
+/// Recovers the orders of a motor command queued by QueueMotorCommand.
+/// </summary>
+static bool GetMotorCommandOrders(const UartCommand* command, char* orders, size_t size)
+{
+#if defined(LEAF_PROTOCOL_TEXT)
+    if (command->length > size) {
+        return false;
+    }
+    memcpy(orders, command->data, command->length);
+    orders[command->length - 1] = '\0';
+    return true;
+#else
+    // Motor plans share the motors' tags but carry no orders.
+    LeafFrame frame;
+    return LeafFrame_Decode(command->data, command->length, &frame) && frame.type == LeafFrame_MotorCommand
+        && LeafFrame_ReadMotorOrders(frame.payload, frame.length, orders, size);
+#endif
+}
+
+static bool QueueLeafConfig(LeafConfigKey key, uint32_t value)
+{
+#if defined(LEAF_PROTOCOL_TEXT)
+    // The text protocol only knows the sensor period.
+    char command[24];
+    int length = snprintf(command, sizeof(command), "sensor:%u", (unsigned int)value);
+    return key == LeafConfig_SensorPeriodMilliseconds
+        && UartCommandQueue_Push(&uartCommandQueue, command, (size_t)length + 1, NULL);
+#else
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    size_t payloadLength = LeafFrame_WriteConfig(key, value, payload, sizeof(payload));
+    return payloadLength > 0 && QueueLeafFrame(LeafFrame_Config, payload, payloadLength, false, NULL);
+#endif
+}
+
+#if !defined(LEAF_PROTOCOL_TEXT)
+static void SendLeafCapabilities(uint16_t baudRates)
+{
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    size_t payloadLength = LeafFrame_WriteCapabilities(baudRates, payload, sizeof(payload));
+    if (uartFd >= 0 && QueueLeafFrame(LeafFrame_Capabilities, payload, payloadLength, true, NULL)) {
+        WatchUartWritable(true);
+    }
+}
+
+static void SendLeafBaudRate(uint32_t baudRate)
+{
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    size_t payloadLength = LeafFrame_WriteBaudRate(baudRate, payload, sizeof(payload));
+    if (uartFd >= 0
+        && QueueLeafFrame(LeafFrame_SetBaudRate, payload, payloadLength, true, &leafBaudRateFrameSequence)) {
+        leafBaudRateFrameQueued = true;
+        WatchUartWritable(true);
+    }
+}
+
+/// <summary>
+/// Asks the leaf to resend the samples from the oldest missing one it may still hold.
+/// The leaf resends everything it has from there on; SampleGaps drops what already arrived.
+/// </summary>
+static void RequestSampleBackfill(bool newGap, const struct timespec* now)
+{
+    uint32_t first;
+    if (!SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first)) {
+        return;
+    }
+    if (!newGap && backfillRequested && now->tv_sec - backfillRequestedAt.tv_sec < backfillRetrySeconds) {
+        return;
+    }
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    size_t payloadLength = LeafFrame_WriteFetchSamples(first, payload, sizeof(payload));
+    if (uartFd >= 0 && QueueLeafFrame(LeafFrame_FetchSamples, payload, payloadLength, false, NULL)) {
+        WatchUartWritable(true);
+        backfillRequested = true;
+        backfillRequestedAt = *now;
+        backfillRequests++;
+    }
+}
+
+/// <summary>
+/// Reopens the leaf UART at baudRate, which cannot change while it is open. Queued commands
+/// are kept and written at the new rate.
+/// </summary>
+static bool SetUartBaudRate(uint32_t baudRate)
+{
+    if (uartEventReg != NULL) {
+        EventLoop_UnregisterIo(eventLoop, uartEventReg);
+        uartEventReg = NULL;
+    }
+    if (uartFd >= 0) {
+        close(uartFd);
+    }
+    uartWritePending = false;
+    LeafFrameDecoder_Reset(&leafFrameDecoder);
+
+    uartConfig.baudRate = baudRate;
+    uartFd = UART_Open(MT3620_ISU3_UART, &uartConfig);
+    if (uartFd < 0) {
+        Log_Debug("ERROR: Unable to open UART at %u baud: %s (%d).\n", (unsigned int)baudRate, strerror(errno),
+            errno);
+        return false;
+    }
+    uartEventReg = EventLoop_RegisterIo(eventLoop, uartFd, EventLoop_Input, UartEventHandler, NULL);
+    if (uartEventReg == NULL) {
+        Log_Debug("ERROR: Unable to register UART event: %s (%d).\n", strerror(errno), errno);
+        close(uartFd);
+        uartFd = -1;
+        return false;
+    }
+    WatchUartWritable(UartCommandQueue_Front(&uartCommandQueue) != NULL);
+    return true;
+}
+#endif
+
+/// <summary>
+/// Queues a command for the leaf device and acknowledges it with its sequence number and
+/// the queue depth; it is written to the UART once the event loop finds the UART writable.
+/// </summary>
+static int QueueLeafDeviceCommand(const void* data, size_t length, AzureIoTHub_MethodResponse* response)
+{
+    uint32_t sequence;
+    if (uartFd < 0) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Leaf device UART is not open");
+        return 503;
+    }
+    if (!UartCommandQueue_Push(&uartCommandQueue, data, length, &sequence)) {
+        Log_Debug("WARNING: UART command of %zu bytes rejected, %zu queued.\n", length,
+            UartCommandQueue_GetDepth(&uartCommandQueue));
+        AzureIoTHub_MethodResponse_SetMessage(response,
+            length > UART_COMMAND_MAX_BYTES ? "Command too long" : "Command queue full");
+        return length > UART_COMMAND_MAX_BYTES ? 400 : 503;
+    }
+    WatchUartWritable(true);
+    AzureIoTHub_MethodResponse_Append(response, "{\"sequence\":%u,\"queueDepth\":%zu}", (unsigned int)sequence,
+        UartCommandQueue_GetDepth(&uartCommandQueue));
+    return 202;
+}
+
+/// <summary>
+/// Hands coalesced drive orders to the UART queue once no earlier motor command is waiting
+/// there and the coalescing window has passed, or arms the timer for when it will have.
+/// </summary>
+static void ReleaseMotorOrders(void)
+{
+    if (UartCommandQueue_HasUnstarted(&uartCommandQueue, MOTOR_CHANNEL_ALL)) {
+        // Retried once the UART has written it.
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long delayMilliseconds = MotorCoalescer_GetDelay(&now);
+    if (delayMilliseconds < 0) {
+        return;
+    }
+    if (delayMilliseconds > 0) {
+        struct timespec delay = {.tv_sec = delayMilliseconds / 1000, .tv_nsec = (delayMilliseconds % 1000) * 1000000L};
+        SetEventLoopTimerOneShot(motorCoalesceTimer, &delay);
+        return;
+    }
+
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int channels = MotorCoalescer_Take(&now, command, sizeof(command));
+    if (!QueueMotorCommand(command, channels, false, NULL)) {
+        Log_Debug("WARNING: UART command queue full, motor command %s held back.\n", command);
+        MotorCoalescer_Restore(command, 0);
+        return;
+    }
+    WatchUartWritable(true);
+}
+
+static void MotorCoalesceTimerEventHandler(EventLoopTimer* timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_Main_EventLoopFail;
+        return;
+    }
+    ReleaseMotorOrders();
+}
+
+/// <summary>
+/// Drive orders are coalesced per motor, newest wins. Brake and stop orders go ahead of every
+/// command not yet written, and drive orders for the same motors still waiting are dropped.
+/// </summary>
+static int SubmitMotorCommand(const char* command, AzureIoTHub_MethodResponse* response)
+{
+    if (uartFd < 0) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Leaf device UART is not open");
+        return 503;
+    }
+    char halt[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int haltChannels;
+    if (MotorCoalescer_Submit(command, halt, sizeof(halt), &haltChannels) <= 0) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Invalid MotorDrive Order");
+        return 400;
+    }
+
+    uint32_t haltSequence = 0;
+    if (haltChannels != 0) {
+        UartCommand superseded;
+        char orders[MOTOR_COMMAND_MAX_BYTES * 2];
+        // Only drive orders and plans come back; halts still queued, possibly for other
+        // motors too, go out as they are.
+        while (UartCommandQueue_TakeUnstarted(&uartCommandQueue, haltChannels, &superseded)) {
+            if (GetMotorCommandOrders(&superseded, orders, sizeof(orders))) {
+                MotorCoalescer_Restore(orders, haltChannels);
+            }
+        }
+        if (!QueueMotorCommand(halt, haltChannels, true, &haltSequence)) {
+            Log_Debug("ERROR: UART command queue full, motor command %s lost.\n", halt);
+            AzureIoTHub_MethodResponse_SetMessage(response, "Command queue full");
+            return 503;
+        }
+        WatchUartWritable(true);
+    }
+    ReleaseMotorOrders();
+
+    AzureIoTHub_MethodResponse_Append(response, "{");
+    if (haltSequence != 0) {
+        AzureIoTHub_MethodResponse_Append(response, "\"sequence\":%u,", (unsigned int)haltSequence);
+    }
+    AzureIoTHub_MethodResponse_Append(response, "\"pendingOrders\":%zu,\"queueDepth\":%zu}",
+        MotorCoalescer_GetPendingCount(), UartCommandQueue_GetDepth(&uartCommandQueue));
+    return 202;
+}
+
+/// <summary>
+/// MotorDrive: {"command": "..."}, either as an object or as a string holding one.
+/// </summary>
+static int MotorDriveMethod(const char* payload, size_t size, const JSON_Value* json, AzureIoTHub_MethodResponse* response)
+{
+    Log_Debug("MotorDrive Invoked\n");
+    JSON_Value* contentValue = NULL;
+    const JSON_Object* contentObject = json_value_get_object(json);
+    const char* style = "json";
+    if (json_value_get_type(json) == JSONString) {
+        contentValue = json_parse_string(json_value_get_string(json));
+        contentObject = json_value_get_object(contentValue);
+        style = "string";
+    }
+    const char* motorCommand = json_object_get_string(contentObject, "command");
+    int status = 400;
+    if (motorCommand == NULL) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Invalid MotorDrive Order");
+    }
+    else {
+        Log_Debug("Command:%s (%s)\n", motorCommand, style);
+        status = SubmitMotorCommand(motorCommand, response);
+    }
+    if (contentValue != NULL) {
+        json_value_free(contentValue);
+    }
+    return status;
+}
+
+#if !defined(LEAF_PROTOCOL_TEXT)
+/// <summary>
+/// Reads one motor plan segment, e.g. {"motor": "L", "order": "F", "speed": 150,
+/// "rampPerSecond": 300, "durationMilliseconds": 2000}; the last two default to 0.
+/// </summary>
+static bool ReadMotorSegment(const JSON_Object* object, LeafMotorSegment* segment)
+{
+    const char* motor = json_object_get_string(object, "motor");
+    const char* order = json_object_get_string(object, "order");
+    if (motor == NULL || strlen(motor) != 1 || (motor[0] != 'L' && motor[0] != 'R') || order == NULL
+        || strlen(order) != 1 || strchr("FRBS", order[0]) == NULL) {
+        return false;
+    }
+    double speed = json_object_has_value_of_type(object, "speed", JSONNumber)
+        ? json_object_get_number(object, "speed") : 0;
+    double ramp = json_object_has_value_of_type(object, "rampPerSecond", JSONNumber)
+        ? json_object_get_number(object, "rampPerSecond") : 0;
+    double duration = json_object_has_value_of_type(object, "durationMilliseconds", JSONNumber)
+        ? json_object_get_number(object, "durationMilliseconds") : 0;
+    if (speed < 0 || speed > 255 || ramp < 0 || ramp > UINT16_MAX || duration < 0 || duration > UINT16_MAX) {
+        return false;
+    }
+    segment->motor = motor[0];
+    segment->order = order[0];
+    segment->speed = (uint8_t)speed;
+    segment->rampPerSecond = (uint16_t)ramp;
+    segment->durationMilliseconds = (uint16_t)duration;
+    return true;
+}
+#endif
+
+/// <summary>
+/// MotorPlan: {"segments": [...], "append": false}, see ReadMotorSegment, sent to the leaf in
+/// one go instead of an order per step. Unless appending, the plan replaces the queued
+/// segments and pending drive orders of its motors. A later brake or stop order cancels the
+/// parts for its motors not yet written; the other motor's plan is still sent.
+/// </summary>
+static int MotorPlanMethod(const char* payload, size_t size, const JSON_Value* json, AzureIoTHub_MethodResponse* response)
+{
+    Log_Debug("MotorPlan Invoked\n");
+#if defined(LEAF_PROTOCOL_TEXT)
+    AzureIoTHub_MethodResponse_SetMessage(response, "Motor plans need the binary protocol");
+    return 501;
+#else
+    const JSON_Object* request = json_value_get_object(json);
+    const JSON_Array* segmentArray = json_object_get_array(request, "segments");
+    size_t count = json_array_get_count(segmentArray);
+    // Segments in request order per motor.
+    LeafMotorSegment segments[MOTOR_CHANNEL_COUNT][LEAF_MOTOR_QUEUE];
+    size_t perMotor[MOTOR_CHANNEL_COUNT] = {0};
+    unsigned int channels = 0;
+    if (count == 0 || count > MOTOR_CHANNEL_COUNT * LEAF_MOTOR_QUEUE) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Invalid MotorPlan segment count");
+        return 400;
+    }
+    for (size_t i = 0; i < count; i++) {
+        LeafMotorSegment segment;
+        if (!ReadMotorSegment(json_array_get_object(segmentArray, i), &segment)) {
+            AzureIoTHub_MethodResponse_SetMessage(response, "Invalid MotorPlan segment");
+            return 400;
+        }
+        MotorChannel channel = segment.motor == 'L' ? MotorChannel_Left : MotorChannel_Right;
+        if (perMotor[channel] == LEAF_MOTOR_QUEUE) {
+            AzureIoTHub_MethodResponse_SetMessage(response, "Too many MotorPlan segments for one motor");
+            return 400;
+        }
+        segments[channel][perMotor[channel]++] = segment;
+        channels |= MOTOR_CHANNEL_BIT(channel);
+    }
+    if (uartFd < 0) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Leaf device UART is not open");
+        return 503;
+    }
+    size_t frames = 0;
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        frames += (perMotor[channel] + LEAF_MOTOR_PLAN_MAX_SEGMENTS - 1) / LEAF_MOTOR_PLAN_MAX_SEGMENTS;
+    }
+    if (UartCommandQueue_GetDepth(&uartCommandQueue) + frames > UART_COMMAND_QUEUE_CAPACITY) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Command queue full");
+        return 503;
+    }
+
+    bool append = json_object_has_value_of_type(request, "append", JSONBoolean)
+        && json_object_get_boolean(request, "append") == 1;
+    if (!append) {
+        MotorCoalescer_Discard(channels);
+    }
+    // Each frame carries one motor's segments and is tagged with that motor alone, so a halt
+    // takes back the frames of its motors that are not yet written and leaves the others.
+    uint32_t sequence = 0;
+    size_t queued = 0;
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        size_t motorCount = perMotor[channel];
+        for (size_t first = 0; first < motorCount; first += LEAF_MOTOR_PLAN_MAX_SEGMENTS) {
+            size_t chunk = motorCount - first < LEAF_MOTOR_PLAN_MAX_SEGMENTS ? motorCount - first
+                                                                            : LEAF_MOTOR_PLAN_MAX_SEGMENTS;
+            uint8_t planPayload[LEAF_FRAME_MAX_PAYLOAD];
+            uint8_t frame[LEAF_FRAME_MAX_ENCODED];
+            size_t payloadLength = LeafFrame_WriteMotorPlan(
+                (uint8_t)(first == 0 && !append ? MOTOR_CHANNEL_BIT(channel) : 0), segments[channel] + first, chunk,
+                planPayload, sizeof(planPayload));
+            size_t frameLength = LeafFrame_Encode(LeafFrame_MotorPlan, leafFrameSequence++, planPayload,
+                payloadLength, frame, sizeof(frame));
+            if (payloadLength == 0 || frameLength == 0
+                || !UartCommandQueue_PushTagged(&uartCommandQueue, frame, frameLength, MOTOR_CHANNEL_BIT(channel),
+                    false, &sequence)) {
+                Log_Debug("ERROR: motor plan frame %zu of %zu could not be queued.\n", queued + 1, frames);
+                AzureIoTHub_MethodResponse_SetMessage(response, "Command queue full");
+                return 503;
+            }
+            queued++;
         }
     }
+    WatchUartWritable(true);
+    AzureIoTHub_MethodResponse_Append(response, "{\"sequence\":%u,\"frames\":%zu,\"queueDepth\":%zu}",
+        (unsigned int)sequence, frames, UartCommandQueue_GetDepth(&uartCommandQueue));
+    return 202;
+#endif
+}
+
+static int SendOrderToLeafDeviceMethod(const char* payload, size_t size, const JSON_Value* json,
+    AzureIoTHub_MethodResponse* response)
+{
+    Log_Debug("SendOrderToLeafDevice Invoked\n");
+#if defined(LEAF_PROTOCOL_TEXT)
+    return QueueLeafDeviceCommand(payload, size, response);
+#else
+    AzureIoTHub_MethodResponse_SetMessage(response,
+        "Raw orders need the text protocol; use MotorDrive or SetConfig");
+    return 501;
+#endif
+}
+
+/// <summary>
+/// TriggerAlarm: blinks the alarm LED for "durationSeconds" if given, otherwise for the
+/// default duration. Any other payload, such as a motion detection event, is accepted.
+/// </summary>
+static int TriggerAlarmMethod(const char* payload, size_t size, const JSON_Value* json, AzureIoTHub_MethodResponse* response)
+{
+    int durationSeconds = alarmDefaultDurationSeconds;
+    const JSON_Object* request = json_value_get_object(json);
+    if (json_object_has_value_of_type(request, "durationSeconds", JSONNumber)) {
+        // Range checked as a double: converting NaN or a value out of int range is undefined.
+        double duration = json_object_get_number(request, "durationSeconds");
+        if (!isfinite(duration) || duration < 1 || duration > alarmMaxDurationSeconds) {
+            char message[48];
+            snprintf(message, sizeof(message), "durationSeconds must be 1 to %d", alarmMaxDurationSeconds);
+            AzureIoTHub_MethodResponse_SetMessage(response, message);
+            return 400;
+        }
+        durationSeconds = (int)duration;
+    }
+
+    Log_Debug("INFO: alarm triggered for %d s.\n", durationSeconds);
+    alarmBlinksRemaining = (int)(durationSeconds * 1000L / alarmBlinkPeriodMilliseconds);
+    struct timespec blinkPeriod = {.tv_sec = 0, .tv_nsec = alarmBlinkPeriodMilliseconds * 1000000L};
+    if (SetEventLoopTimerPeriod(alarmTimer, &blinkPeriod) != 0) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Failed to start the alarm");
+        return 500;
+    }
+    AzureIoTHub_MethodResponse_Append(response, "{\"alarm\":\"on\",\"durationSeconds\":%d}", durationSeconds);
+    return 200;
+}
+
+static void AlarmTimerEventHandler(EventLoopTimer* timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_Main_EventLoopFail;
+        return;
+    }
+    // The LED is active low; it ends up off.
+    alarmBlinksRemaining--;
+    GPIO_SetValue(alarmLedGpioFd, (alarmBlinksRemaining % 2 == 0) ? GPIO_Value_High : GPIO_Value_Low);
+    if (alarmBlinksRemaining <= 0) {
+        DisarmEventLoopTimer(timer);
+    }
+}
+
+/// <summary>
+/// GetMetrics: connection, send, IoT Hub client, journal, sensor input, UART command, motor
+/// order, leaf clock, leaf link and sample backfill counters.
+/// </summary>
+static int GetMetricsMethod(const char* payload, size_t size, const JSON_Value* json, AzureIoTHub_MethodResponse* response)
+{
+    AzureIoTHub_ConnectionStatus connection;
+    AzureIoTHub_SendStats send;
+    AzureIoTHub_DoWorkStats doWork;
+    TelemetryJournalStats journal;
+    SampleQueueStats queue;
+    SensorFrameParserStats parser;
+    UartCommandQueueStats uart;
+    MotorCoalescerStats motor;
+    AzureIoTHub_GetConnectionStatus(&connection);
+    AzureIoTHub_GetSendStats(&send);
+    AzureIoTHub_GetDoWorkStats(&doWork);
+    TelemetryJournal_GetStats(&journal);
+    SampleQueue_GetStats(&sensorSampleQueue, &queue);
+    SensorFrame_GetStats(&parser);
+    UartCommandQueue_GetStats(&uartCommandQueue, &uart);
+    MotorCoalescer_GetStats(&motor);
 
-    return result;
+    AzureIoTHub_MethodResponse_Append(response,
+        "{\"connection\":{\"state\":\"%s\",\"reconnectAttempts\":%d,\"reconnectDelaySeconds\":%d},",
+        AzureIoTHub_ConnectionStateToString(connection.state), connection.reconnectAttempts,
+        connection.reconnectDelaySeconds);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"send\":{\"accepted\":%lu,\"windowFull\":%lu,\"inFlight\":%lu,\"maxInFlight\":%lu,\"results\":[",
+        send.accepted, send.windowFull, send.inFlight, send.maxInFlight);
+    for (int i = 0; i < AZUREIOTHUB_CONFIRMATION_RESULTS; i++) {
+        AzureIoTHub_MethodResponse_Append(response, "%s%lu", i > 0 ? "," : "", send.results[i]);
+    }
+    AzureIoTHub_MethodResponse_Append(response, "],\"latencyBuckets\":[");
+    for (int i = 0; i < AZUREIOTHUB_LATENCY_BUCKETS; i++) {
+        AzureIoTHub_MethodResponse_Append(response, "%s%lu", i > 0 ? "," : "", send.latencyBuckets[i]);
+    }
+    AzureIoTHub_MethodResponse_Append(response,
+        "]},\"doWork\":{\"calls\":%lu,\"totalMicroseconds\":%llu,\"maxMicroseconds\":%lu},",
+        doWork.calls, (unsigned long long)doWork.totalMicroseconds, doWork.maxMicroseconds);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"journal\":{\"records\":%lu,\"appended\":%lu,\"evicted\":%lu,\"replayed\":%lu,\"acknowledged\":%lu,\"corrupt\":%lu},",
+        journal.records, journal.appended, journal.evicted, journal.replayed, journal.acknowledged, journal.corrupt);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"sensor\":{\"parsed\":%lu,\"malformed\":%lu,\"queued\":%lu,\"droppedOldest\":%lu,\"droppedNewest\":%lu},",
+        parser.parsed, parser.malformed, queue.pushed, queue.droppedOldest, queue.droppedNewest);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"uartCommands\":{\"depth\":%zu,\"maxDepth\":%zu,\"enqueued\":%lu,\"completed\":%lu,\"rejected\":%lu,\"failed\":%lu,\"maxLatencyMilliseconds\":%ld},",
+        uart.depth, uart.maxDepth, uart.enqueued, uart.completed, uart.rejected, uart.failed,
+        uart.maxLatencyMilliseconds);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"motorOrders\":{\"pending\":%zu,\"orders\":%lu,\"coalesced\":%lu,\"halts\":%lu,\"released\":%lu,\"invalid\":%lu}",
+        MotorCoalescer_GetPendingCount(), motor.orders, motor.coalesced, motor.halts, motor.released, motor.invalid);
+    LeafClockStats leafClock;
+    LeafClock_GetStats(&leafClock);
+    AzureIoTHub_MethodResponse_Append(response,
+        ",\"leafClock\":{\"samples\":%lu,\"resets\":%lu,\"driftPpm\":%ld,\"lastDelayMilliseconds\":%ld}",
+        leafClock.samples, leafClock.resets, leafClock.driftPpm, leafClock.lastDelayMilliseconds);
+#if !defined(LEAF_PROTOCOL_TEXT)
+    const LeafFrameStats* link = &leafFrameDecoder.stats;
+    LeafLinkStatus linkStatus;
+    LeafLink_GetStatus(&linkStatus);
+    AzureIoTHub_MethodResponse_Append(response,
+        ",\"leafLink\":{\"frames\":%lu,\"crcErrors\":%lu,\"malformed\":%lu,\"oversized\":%lu,\"unsupportedVersion\":%lu,\"acks\":%lu,\"nacks\":%lu,",
+        link->frames, link->crcErrors, link->malformed, link->oversized, link->unsupportedVersion, leafAcks,
+        leafNacks);
+    AzureIoTHub_MethodResponse_Append(response,
+        "\"state\":\"%s\",\"baudRate\":%u,\"maxBaudRate\":%u,\"negotiations\":%lu,\"stepDowns\":%lu,\"fallbacks\":%lu}",
+        LeafLink_StateToString(linkStatus.state), (unsigned int)linkStatus.baudRate,
+        (unsigned int)linkStatus.maxBaudRate, linkStatus.negotiations, linkStatus.stepDowns, linkStatus.fallbacks);
+    SampleGapsStats gaps;
+    SampleGaps_GetStats(&gaps);
+    AzureIoTHub_MethodResponse_Append(response,
+        ",\"sampleGaps\":{\"missed\":%lu,\"requests\":%lu,\"recovered\":%lu,\"lost\":%lu,\"duplicates\":%lu,\"restarts\":%lu}",
+        gaps.missed, backfillRequests, gaps.recovered, gaps.lost, gaps.duplicates, gaps.restarts);
+#endif
+    AzureIoTHub_MethodResponse_Append(response, "}");
+    return 200;
+}
+
+/// <summary>
+/// SetConfig: applies the same settings as desired properties, see ApplyConfig.
+/// </summary>
+static int SetConfigMethod(const char* payload, size_t size, const JSON_Value* json, AzureIoTHub_MethodResponse* response)
+{
+    const JSON_Object* config = json_value_get_object(json);
+    if (config == NULL) {
+        AzureIoTHub_MethodResponse_SetMessage(response, "Configuration must be a JSON object");
+        return 400;
+    }
+    ApplyConfig(config);
+
+    DeadbandConfig deadband;
+    TelemetryDeadband_GetConfig(&deadband);
+    AzureIoTHub_MethodResponse_Append(response,
+        "{\"deadband\":{\"enabled\":%s,\"maxSilenceSeconds\":%d},\"motorCoalesceMilliseconds\":%d}",
+        deadband.enabled ? "true" : "false", deadband.maxSilenceSeconds, MotorCoalescer_GetWindow());
+    return 200;
+}
+
+static void RegisterDirectMethods(void)
+{
+    AzureIoTHub_RegisterMethod("MotorDrive", MotorDriveMethod, AzureIoTHub_MethodFlag_ParseJson);
+    AzureIoTHub_RegisterMethod("MotorPlan", MotorPlanMethod, AzureIoTHub_MethodFlag_ParseJson);
+    AzureIoTHub_RegisterMethod("SendOrderToLeafDevice", SendOrderToLeafDeviceMethod,
+        AzureIoTHub_MethodFlag_RequirePayload);
+    AzureIoTHub_RegisterMethod("TriggerAlarm", TriggerAlarmMethod, AzureIoTHub_MethodFlag_ParseJson);
+    AzureIoTHub_RegisterMethod("GetMetrics", GetMetricsMethod, AzureIoTHub_MethodFlag_None);
+    AzureIoTHub_RegisterMethod("SetConfig", SetConfigMethod,
+        AzureIoTHub_MethodFlag_RequirePayload | AzureIoTHub_MethodFlag_ParseJson);
 }
 
 static void c2dMessageCallback(const unsigned char* message, size_t size)
 {
     ;
 }
+
+static void connectionStateChanged(AzureIoTHub_ConnectionState state)
+{
+    if (state == AzureIoTHub_Connected) {
+        AzureIoTHub_UpdateTwinReportState("{\"status\":\"ready\"}");
+    }
+}
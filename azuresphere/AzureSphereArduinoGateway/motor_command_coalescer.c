@@ -0,0 +1,227 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "motor_command_coalescer.h"
+
+// Orders one command may carry.
+#define MAX_ORDERS_PER_COMMAND 8
+
+typedef struct {
+    MotorChannel channel;
+    bool halt;
+    char text[MOTOR_ORDER_MAX_BYTES];
+} MotorOrder;
+
+static int windowMilliseconds = 100;
+static MotorOrder pendingOrders[MOTOR_CHANNEL_COUNT];
+static bool orderPending[MOTOR_CHANNEL_COUNT];
+static struct timespec lastReleasedAt;
+static bool hasReleased = false;
+static MotorCoalescerStats coalescerStats;
+
+void MotorCoalescer_SetWindow(int milliseconds)
+{
+    windowMilliseconds = milliseconds < 0 ? 0 : milliseconds;
+}
+
+int MotorCoalescer_GetWindow(void)
+{
+    return windowMilliseconds;
+}
+
+/// <summary>
+/// Parses "<L|R><F|R|B|S>[ddd]", the orders the leaf device understands.
+/// </summary>
+static bool ParseOrder(const char* text, size_t length, MotorOrder* order)
+{
+    if (length != 2 && length != 5) {
+        return false;
+    }
+    if (text[0] == 'L') {
+        order->channel = MotorChannel_Left;
+    }
+    else if (text[0] == 'R') {
+        order->channel = MotorChannel_Right;
+    }
+    else {
+        return false;
+    }
+    if (text[1] == '\0' || strchr("FRBS", text[1]) == NULL) {
+        return false;
+    }
+    for (size_t i = 2; i < length; i++) {
+        if (!isdigit((unsigned char)text[i])) {
+            return false;
+        }
+    }
+    order->halt = text[1] == 'B' || text[1] == 'S';
+    memcpy(order->text, text, length);
+    order->text[length] = '\0';
+    return true;
+}
+
+/// <summary>
+/// Splits command at ';', ignoring surrounding white space and empty orders.
+/// </summary>
+/// <returns>Number of orders, or -1 if one is malformed or there are too many.</returns>
+static int ParseCommand(const char* command, MotorOrder* orders)
+{
+    int count = 0;
+    const char* start = command;
+    for (;;) {
+        const char* end = strchr(start, ';');
+        if (end == NULL) {
+            end = start + strlen(start);
+        }
+        const char* first = start;
+        const char* last = end;
+        while (first < last && isspace((unsigned char)*first)) {
+            first++;
+        }
+        while (last > first && isspace((unsigned char)last[-1])) {
+            last--;
+        }
+        if (last > first) {
+            if (count == MAX_ORDERS_PER_COMMAND || !ParseOrder(first, (size_t)(last - first), &orders[count])) {
+                return -1;
+            }
+            count++;
+        }
+        if (*end == '\0') {
+            return count;
+        }
+        start = end + 1;
+    }
+}
+
+static void JoinOrders(const MotorOrder* orders, const bool* present, char* command, size_t size)
+{
+    size_t length = 0;
+    command[0] = '\0';
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        if (!present[channel]) {
+            continue;
+        }
+        size_t orderLength = strlen(orders[channel].text);
+        if (length + (length > 0 ? 1 : 0) + orderLength >= size) {
+            break;
+        }
+        if (length > 0) {
+            command[length++] = ';';
+        }
+        memcpy(command + length, orders[channel].text, orderLength + 1);
+        length += orderLength;
+    }
+}
+
+int MotorCoalescer_Submit(const char* command, char* halt, size_t haltSize, unsigned int* haltChannels)
+{
+    MotorOrder orders[MAX_ORDERS_PER_COMMAND];
+    int count = ParseCommand(command, orders);
+    *haltChannels = 0;
+    if (haltSize > 0) {
+        halt[0] = '\0';
+    }
+    if (count < 0) {
+        coalescerStats.invalid++;
+        return -1;
+    }
+
+    // Later orders in the command win over earlier ones for the same motor.
+    MotorOrder haltOrders[MOTOR_CHANNEL_COUNT];
+    bool haltPresent[MOTOR_CHANNEL_COUNT] = {false};
+    for (int i = 0; i < count; i++) {
+        MotorChannel channel = orders[i].channel;
+        coalescerStats.orders++;
+        if (orders[i].halt) {
+            coalescerStats.halts++;
+            if (orderPending[channel]) {
+                coalescerStats.coalesced++;
+            }
+            orderPending[channel] = false;
+            haltOrders[channel] = orders[i];
+            haltPresent[channel] = true;
+            *haltChannels |= MOTOR_CHANNEL_BIT(channel);
+        }
+        else {
+            if (orderPending[channel]) {
+                coalescerStats.coalesced++;
+            }
+            // Staged after any halt of this command, so it is sent after the halt.
+            pendingOrders[channel] = orders[i];
+            orderPending[channel] = true;
+        }
+    }
+    JoinOrders(haltOrders, haltPresent, halt, haltSize);
+    return count;
+}
+
+void MotorCoalescer_Restore(const char* command, unsigned int excludeChannels)
+{
+    MotorOrder orders[MAX_ORDERS_PER_COMMAND];
+    int count = ParseCommand(command, orders);
+    for (int i = 0; i < count; i++) {
+        MotorChannel channel = orders[i].channel;
+        if (orders[i].halt || orderPending[channel] || (excludeChannels & MOTOR_CHANNEL_BIT(channel))) {
+            continue;
+        }
+        pendingOrders[channel] = orders[i];
+        orderPending[channel] = true;
+    }
+}
+
+long MotorCoalescer_GetDelay(const struct timespec* now)
+{
+    if (MotorCoalescer_GetPendingCount() == 0) {
+        return -1;
+    }
+    if (!hasReleased) {
+        return 0;
+    }
+    long elapsedMilliseconds = (now->tv_sec - lastReleasedAt.tv_sec) * 1000L
+        + (now->tv_nsec - lastReleasedAt.tv_nsec) / 1000000L;
+    return elapsedMilliseconds >= windowMilliseconds ? 0 : windowMilliseconds - elapsedMilliseconds;
+}
+
+unsigned int MotorCoalescer_Take(const struct timespec* now, char* command, size_t size)
+{
+    unsigned int channels = 0;
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        if (orderPending[channel]) {
+            channels |= MOTOR_CHANNEL_BIT(channel);
+        }
+    }
+    JoinOrders(pendingOrders, orderPending, command, size);
+    if (channels == 0) {
+        return 0;
+    }
+    memset(orderPending, 0, sizeof(orderPending));
+    lastReleasedAt = *now;
+    hasReleased = true;
+    coalescerStats.released++;
+    return channels;
+}
+
+void MotorCoalescer_Discard(unsigned int channels)
+{
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        if (orderPending[channel] && (channels & MOTOR_CHANNEL_BIT(channel))) {
+            orderPending[channel] = false;
+            coalescerStats.coalesced++;
+        }
+    }
+}
+
+size_t MotorCoalescer_GetPendingCount(void)
+{
+    size_t count = 0;
+    for (int channel = 0; channel < MOTOR_CHANNEL_COUNT; channel++) {
+        count += orderPending[channel] ? 1 : 0;
+    }
+    return count;
+}
+
+void MotorCoalescer_GetStats(MotorCoalescerStats* stats)
+{
+    *stats = coalescerStats;
+}
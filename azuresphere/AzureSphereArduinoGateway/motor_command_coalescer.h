@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/// <summary>
+/// The motors the leaf device drives, addressed by the first letter of an order.
+/// </summary>
+typedef enum {
+    MotorChannel_Left = 0,  // "L"
+    MotorChannel_Right = 1  // "R"
+} MotorChannel;
+#define MOTOR_CHANNEL_COUNT 2
+#define MOTOR_CHANNEL_BIT(channel) (1u << (channel))
+#define MOTOR_CHANNEL_ALL ((1u << MOTOR_CHANNEL_COUNT) - 1)
+
+/// <summary>
+/// Longest order, e.g. "LF150", with its terminator.
+/// </summary>
+#define MOTOR_ORDER_MAX_BYTES 6
+/// <summary>
+/// Longest command built from one order per motor, e.g. "LF150;RF150", with its terminator.
+/// </summary>
+#define MOTOR_COMMAND_MAX_BYTES (MOTOR_CHANNEL_COUNT * MOTOR_ORDER_MAX_BYTES)
+
+typedef struct {
+    unsigned long orders;
+    unsigned long coalesced; // drive orders replaced by a newer one before they were sent
+    unsigned long halts;     // brake and stop orders
+    unsigned long released;  // commands taken for sending
+    unsigned long invalid;   // commands rejected as malformed
+} MotorCoalescerStats;
+
+/// <summary>
+/// Sets the minimum time between drive commands; orders arriving faster are merged,
+/// keeping the newest per motor. 0 only merges orders waiting for the UART.
+/// </summary>
+void MotorCoalescer_SetWindow(int windowMilliseconds);
+int MotorCoalescer_GetWindow(void);
+
+/// <summary>
+/// Splits a motor command such as "LF150;RF150" into orders. Drive orders (F, R) replace
+/// their motor's pending order. Brake and stop orders (B, S) cancel it and are joined into
+/// halt instead, with their motors in haltChannels, for the caller to send right away.
+/// </summary>
+/// <returns>Number of orders, or -1 if one is malformed, in which case nothing changes.</returns>
+int MotorCoalescer_Submit(const char* command, char* halt, size_t haltSize, unsigned int* haltChannels);
+
+/// <summary>
+/// Stages again the drive orders of a command that was taken back before it was sent, except
+/// for motors in excludeChannels and motors with a newer order pending.
+/// </summary>
+void MotorCoalescer_Restore(const char* command, unsigned int excludeChannels);
+
+/// <summary>
+/// Milliseconds until the pending orders may be sent, 0 if now, -1 if none are pending.
+/// </summary>
+long MotorCoalescer_GetDelay(const struct timespec* now);
+
+/// <summary>
+/// Removes the pending orders and joins them into command, NUL terminated.
+/// </summary>
+/// <returns>The motors addressed by command, 0 if nothing was pending.</returns>
+unsigned int MotorCoalescer_Take(const struct timespec* now, char* command, size_t size);
+
+/// <summary>
+/// Drops the pending drive orders of the motors in channels, e.g. for a motor plan that
+/// supersedes them.
+/// </summary>
+void MotorCoalescer_Discard(unsigned int channels);
+
+size_t MotorCoalescer_GetPendingCount(void);
+void MotorCoalescer_GetStats(MotorCoalescerStats* stats);
@@ -0,0 +1,85 @@
+#include "sample_gaps.h"
+
+static bool started = false;
+// Sequence after the newest live sample.
+static uint32_t nextSequence = 0;
+// Bit i is set when sequence nextSequence - 1 - i arrived. Positions before the first
+// sample are set, as there is nothing to fetch for them.
+static uint32_t arrived = 0;
+static SampleGapsStats gapsStats;
+
+static int CountMissing(uint32_t bits, int width)
+{
+    int missing = 0;
+    for (int i = 0; i < width; i++) {
+        if ((bits & (1u << i)) == 0) {
+            missing++;
+        }
+    }
+    return missing;
+}
+
+bool SampleGaps_Live(uint32_t sequence)
+{
+    if (!started || sequence < nextSequence) {
+        if (started) {
+            gapsStats.restarts++;
+            gapsStats.lost += (unsigned long)CountMissing(arrived, SAMPLE_GAPS_WINDOW);
+        }
+        started = true;
+        nextSequence = sequence + 1;
+        arrived = 0xFFFFFFFFu;
+        return false;
+    }
+
+    uint32_t shift = sequence - nextSequence + 1;
+    gapsStats.missed += shift - 1;
+    if (shift >= SAMPLE_GAPS_WINDOW) {
+        // The whole window leaves, and so do the skipped ones that do not fit the new one.
+        gapsStats.lost += (unsigned long)CountMissing(arrived, SAMPLE_GAPS_WINDOW) + (shift - SAMPLE_GAPS_WINDOW);
+        arrived = 1;
+    }
+    else {
+        gapsStats.lost += (unsigned long)CountMissing(arrived >> (SAMPLE_GAPS_WINDOW - shift), (int)shift);
+        arrived = (arrived << shift) | 1;
+    }
+    nextSequence = sequence + 1;
+    return shift > 1;
+}
+
+bool SampleGaps_Resent(uint32_t sequence)
+{
+    if (!started || sequence >= nextSequence || nextSequence - 1 - sequence >= SAMPLE_GAPS_WINDOW) {
+        return false;
+    }
+    uint32_t bit = 1u << (nextSequence - 1 - sequence);
+    if (arrived & bit) {
+        gapsStats.duplicates++;
+        return false;
+    }
+    arrived |= bit;
+    gapsStats.recovered++;
+    return true;
+}
+
+bool SampleGaps_FirstMissing(uint32_t maxAge, uint32_t* sequence)
+{
+    if (!started) {
+        return false;
+    }
+    if (maxAge > SAMPLE_GAPS_WINDOW) {
+        maxAge = SAMPLE_GAPS_WINDOW;
+    }
+    for (uint32_t age = maxAge; age-- > 1;) {
+        if ((arrived & (1u << age)) == 0) {
+            *sequence = nextSequence - 1 - age;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SampleGaps_GetStats(SampleGapsStats* stats)
+{
+    *stats = gapsStats;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// <summary>
+/// Tracks which of the last SAMPLE_GAPS_WINDOW leaf sample sequence numbers arrived, so
+/// samples skipped on the live stream can be fetched again from the leaf's history and
+/// resent ones are accepted only once.
+/// </summary>
+#define SAMPLE_GAPS_WINDOW 32
+
+typedef struct {
+    unsigned long missed;     // sequence numbers skipped by live samples
+    unsigned long recovered;  // missed samples that arrived when resent
+    unsigned long lost;       // missed samples that left the window without arriving
+    unsigned long duplicates; // resent samples that had already arrived
+    unsigned long restarts;   // the leaf restarted, its sequence went backwards
+} SampleGapsStats;
+
+/// <summary>
+/// Records a sample received as it was taken. A sequence lower than the last one means the
+/// leaf restarted; anything still missing from before is counted as lost.
+/// </summary>
+/// <returns>true if samples were skipped since the last live one.</returns>
+bool SampleGaps_Live(uint32_t sequence);
+
+/// <summary>
+/// Records a sample the leaf resent on request.
+/// </summary>
+/// <returns>true if it was missing, false if it already arrived or is too old to tell.</returns>
+bool SampleGaps_Resent(uint32_t sequence);
+
+/// <summary>
+/// Finds the oldest missing sequence among the latest maxAge ones.
+/// </summary>
+/// <returns>false if none of them is missing.</returns>
+bool SampleGaps_FirstMissing(uint32_t maxAge, uint32_t* sequence);
+
+void SampleGaps_GetStats(SampleGapsStats* stats);
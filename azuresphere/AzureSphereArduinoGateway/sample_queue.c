@@ -0,0 +1,65 @@
+#include <string.h>
+
+#include "sample_queue.h"
+
+#define SAMPLE_QUEUE_MASK (SAMPLE_QUEUE_CAPACITY - 1)
+
+void SampleQueue_Init(SampleQueue* queue, SampleQueue_OverflowPolicy policy)
+{
+    memset(queue->slots, 0, sizeof(queue->slots));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->pushed, 0);
+    atomic_init(&queue->droppedOldest, 0);
+    atomic_init(&queue->droppedNewest, 0);
+    queue->policy = policy;
+}
+
+bool SampleQueue_Push(SampleQueue* queue, const SensorSample* sample)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head - tail == SAMPLE_QUEUE_CAPACITY) {
+        if (queue->policy == SampleQueue_DropNewest) {
+            atomic_fetch_add_explicit(&queue->droppedNewest, 1, memory_order_relaxed);
+            return false;
+        }
+        // Claim the oldest slot. If the consumer pops it first the exchange fails,
+        // and there is room anyway.
+        if (atomic_compare_exchange_strong_explicit(&queue->tail, &tail, tail + 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&queue->droppedOldest, 1, memory_order_relaxed);
+        }
+    }
+
+    queue->slots[head & SAMPLE_QUEUE_MASK] = *sample;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    atomic_fetch_add_explicit(&queue->pushed, 1, memory_order_relaxed);
+    return true;
+}
+
+bool SampleQueue_Pop(SampleQueue* queue, SensorSample* sample)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    for (;;) {
+        unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+        *sample = queue->slots[tail & SAMPLE_QUEUE_MASK];
+        // The copy is only valid if the producer did not evict this slot meanwhile;
+        // on failure tail is reloaded and the next oldest sample is read instead.
+        if (atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+void SampleQueue_GetStats(SampleQueue* queue, SampleQueueStats* stats)
+{
+    stats->pushed = atomic_load_explicit(&queue->pushed, memory_order_relaxed);
+    stats->droppedOldest = atomic_load_explicit(&queue->droppedOldest, memory_order_relaxed);
+    stats->droppedNewest = atomic_load_explicit(&queue->droppedNewest, memory_order_relaxed);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/// <summary>
+/// Number of samples the queue can hold. Must be a power of two.
+/// </summary>
+#define SAMPLE_QUEUE_CAPACITY 64
+
+/// <summary>
+/// One sensor reading received from the leaf device, stamped when it arrived.
+/// </summary>
+typedef struct {
+    struct timespec timestamp;
+    float temperature;
+    float humidity;
+    float pressure;
+    float altitude;
+    unsigned int fields; // SensorField bits of the readings that are valid
+} SensorSample;
+
+/// <summary>
+/// What <see cref="SampleQueue_Push" /> does when the queue is full.
+/// </summary>
+typedef enum {
+    SampleQueue_DropOldest = 0, // evict the oldest queued sample to make room
+    SampleQueue_DropNewest = 1  // reject the sample being pushed
+} SampleQueue_OverflowPolicy;
+
+typedef struct {
+    unsigned long pushed;
+    unsigned long droppedOldest;
+    unsigned long droppedNewest;
+} SampleQueueStats;
+
+/// <summary>
+/// Bounded lock-free ring for exactly one producer thread and one consumer thread.
+/// </summary>
+typedef struct {
+    SensorSample slots[SAMPLE_QUEUE_CAPACITY];
+    atomic_uint head; // next slot the producer writes
+    atomic_uint tail; // next slot the consumer reads
+    SampleQueue_OverflowPolicy policy;
+    atomic_ulong pushed;
+    atomic_ulong droppedOldest;
+    atomic_ulong droppedNewest;
+} SampleQueue;
+
+void SampleQueue_Init(SampleQueue* queue, SampleQueue_OverflowPolicy policy);
+
+/// <summary>
+/// Producer side. Never blocks.
+/// </summary>
+/// <returns>false if the sample was rejected under <see cref="SampleQueue_DropNewest" />.</returns>
+bool SampleQueue_Push(SampleQueue* queue, const SensorSample* sample);
+
+/// <summary>
+/// Consumer side. Never blocks.
+/// </summary>
+/// <returns>true if a sample was copied to sample, false if the queue is empty.</returns>
+bool SampleQueue_Pop(SampleQueue* queue, SensorSample* sample);
+
+/// <summary>
+/// Snapshot of the queue counters. May be called from either side.
+/// </summary>
+void SampleQueue_GetStats(SampleQueue* queue, SampleQueueStats* stats);
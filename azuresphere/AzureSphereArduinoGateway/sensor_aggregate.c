@@ -0,0 +1,70 @@
+#include <math.h>
+#include <string.h>
+
+#include "sensor_aggregate.h"
+#include "sensor_frame_parser.h"
+
+void SensorAggregate_Reset(SensorAggregate* aggregate)
+{
+    memset(aggregate, 0, sizeof(*aggregate));
+}
+
+void SensorAggregate_Add(SensorAggregate* aggregate, float value)
+{
+    aggregate->count++;
+    if (aggregate->count == 1) {
+        aggregate->min = value;
+        aggregate->max = value;
+        aggregate->first = value;
+    }
+    else {
+        if (value < aggregate->min) {
+            aggregate->min = value;
+        }
+        if (value > aggregate->max) {
+            aggregate->max = value;
+        }
+    }
+    aggregate->last = value;
+
+    double delta = value - aggregate->mean;
+    aggregate->mean += delta / (double)aggregate->count;
+    aggregate->m2 += delta * (value - aggregate->mean);
+}
+
+double SensorAggregate_StdDev(const SensorAggregate* aggregate)
+{
+    if (aggregate->count < 2) {
+        return 0.0;
+    }
+    return sqrt(aggregate->m2 / (double)(aggregate->count - 1));
+}
+
+void SensorWindow_Reset(SensorWindow* window)
+{
+    memset(&window->start, 0, sizeof(window->start));
+    memset(&window->end, 0, sizeof(window->end));
+    window->samples = 0;
+    SensorAggregate_Reset(&window->temperature);
+    SensorAggregate_Reset(&window->humidity);
+    SensorAggregate_Reset(&window->pressure);
+}
+
+void SensorWindow_Add(SensorWindow* window, const SensorSample* sample)
+{
+    if (window->samples == 0) {
+        window->start = sample->timestamp;
+    }
+    window->end = sample->timestamp;
+    window->samples++;
+
+    if (sample->fields & SensorField_Temperature) {
+        SensorAggregate_Add(&window->temperature, sample->temperature);
+    }
+    if (sample->fields & SensorField_Humidity) {
+        SensorAggregate_Add(&window->humidity, sample->humidity);
+    }
+    if (sample->fields & SensorField_Pressure) {
+        SensorAggregate_Add(&window->pressure, sample->pressure);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <time.h>
+
+#include "sample_queue.h"
+
+/// <summary>
+/// Streaming summary of one sensor channel. Updates are O(1); mean and variance use
+/// Welford's method so they stay accurate over long windows.
+/// </summary>
+typedef struct {
+    unsigned long count;
+    double mean;
+    double m2; // sum of squared differences from the mean
+    float min;
+    float max;
+    float first;
+    float last;
+} SensorAggregate;
+
+void SensorAggregate_Reset(SensorAggregate* aggregate);
+void SensorAggregate_Add(SensorAggregate* aggregate, float value);
+
+/// <summary>
+/// Sample standard deviation; 0 for fewer than two values.
+/// </summary>
+double SensorAggregate_StdDev(const SensorAggregate* aggregate);
+
+/// <summary>
+/// Aggregates of every telemetry channel over one window.
+/// </summary>
+typedef struct {
+    struct timespec start; // timestamp of the first sample
+    struct timespec end;   // timestamp of the last sample
+    unsigned long samples;
+    SensorAggregate temperature;
+    SensorAggregate humidity;
+    SensorAggregate pressure;
+} SensorWindow;
+
+void SensorWindow_Reset(SensorWindow* window);
+
+/// <summary>
+/// Adds the readings present in sample to their channels.
+/// </summary>
+void SensorWindow_Add(SensorWindow* window, const SensorSample* sample);
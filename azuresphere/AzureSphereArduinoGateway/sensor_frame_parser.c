@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor_frame_parser.h"
+
+static const char sensorFrameMark[] = "sensors:";
+static const char sequenceKey[4] = {'s', 'e', 'q', 'n'};
+static const char tickKey[4] = {'t', 'i', 'c', 'k'};
+
+typedef struct {
+    char key[4];
+    SensorField field;
+    float minValue;
+    float maxValue;
+} SensorFieldSpec;
+
+// Keys are exactly four characters on the wire; ranges are the BME280 operating range.
+static const SensorFieldSpec sensorFieldSpecs[] = {
+    {{'t', 'e', 'm', 'p'}, SensorField_Temperature, -40.0f, 85.0f},
+    {{'h', 'u', 'm', 'i'}, SensorField_Humidity, 0.0f, 100.0f},
+    {{'p', 'r', 'e', 's'}, SensorField_Pressure, 30000.0f, 110000.0f},
+    {{'a', 'l', 't', 'i'}, SensorField_Altitude, -500.0f, 9000.0f},
+};
+
+static const float negativePowersOfTen[] = {1.0f,  1e-1f, 1e-2f, 1e-3f, 1e-4f,
+                                            1e-5f, 1e-6f, 1e-7f, 1e-8f, 1e-9f};
+
+static SensorFrameParserStats parserStats;
+
+/// <summary>
+/// Parses [+-]digits[.digits] exactly spanning [p, end). Leading zeros do not count
+/// against the 9 digits the mantissa holds; more integer digits than that are rejected,
+/// further fraction digits are below float precision and dropped.
+/// </summary>
+static bool ParseDecimal(const char* p, const char* end, float* value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+
+    uint32_t mantissa = 0;
+    int significantDigits = 0;
+    int fractionDigits = 0;
+    bool hasDigits = false;
+    bool inFraction = false;
+    for (; p < end; p++) {
+        char c = *p;
+        if (c == '.' && !inFraction) {
+            inFraction = true;
+            continue;
+        }
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        hasDigits = true;
+        if (!inFraction) {
+            if (mantissa == 0 && c == '0') {
+                continue;
+            }
+            if (significantDigits == 9) {
+                return false;
+            }
+        }
+        else if (significantDigits == 9 || fractionDigits == 9) {
+            // Keep validating the dropped digits.
+            continue;
+        }
+        else {
+            fractionDigits++;
+        }
+        mantissa = mantissa * 10 + (uint32_t)(c - '0');
+        if (mantissa != 0) {
+            significantDigits++;
+        }
+    }
+    if (!hasDigits) {
+        return false;
+    }
+
+    float result = (float)mantissa * negativePowersOfTen[fractionDigits];
+    *value = negative ? -result : result;
+    return true;
+}
+
+/// <summary>
+/// Parses a uint32_t of digits exactly spanning [p, end).
+/// </summary>
+static bool ParseUnsigned(const char* p, const char* end, uint32_t* value)
+{
+    uint64_t result = 0;
+    if (p == end || end - p > 10) {
+        return false;
+    }
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        result = result * 10 + (uint64_t)(*p - '0');
+    }
+    if (result > UINT32_MAX) {
+        return false;
+    }
+    *value = (uint32_t)result;
+    return true;
+}
+
+static float* FieldStorage(SensorFrame* frame, SensorField field)
+{
+    switch (field) {
+    case SensorField_Temperature:
+        return &frame->temperature;
+    case SensorField_Humidity:
+        return &frame->humidity;
+    case SensorField_Pressure:
+        return &frame->pressure;
+    default:
+        return &frame->altitude;
+    }
+}
+
+/// <summary>
+/// Counts a frame as parsed, incomplete or malformed.
+/// </summary>
+static SensorFrame_Result FinishFrame(const SensorFrame* frame, bool malformed)
+{
+    if (frame->fields == 0) {
+        parserStats.malformed++;
+        return SensorFrame_Malformed;
+    }
+    if (malformed) {
+        parserStats.malformed++;
+    }
+    if (frame->fields != SENSOR_FIELDS_ALL) {
+        parserStats.incomplete++;
+    }
+    parserStats.parsed++;
+    return SensorFrame_Ok;
+}
+
+SensorFrame_Result SensorFrame_Parse(const char* line, size_t length, SensorFrame* frame)
+{
+    const size_t markLength = sizeof(sensorFrameMark) - 1;
+    if (length < markLength || memcmp(line, sensorFrameMark, markLength) != 0) {
+        return SensorFrame_NotSensorFrame;
+    }
+
+    const char* p = line + markLength;
+    const char* end = line + length;
+    bool malformed = false;
+    bool hasSequence = false;
+    bool hasTick = false;
+    frame->fields = 0;
+
+    // Grammar: key=value{,key=value}[:]
+    while (p < end && *p != ':') {
+        const char* key = p;
+        while (p < end && *p != '=' && *p != ',' && *p != ':') {
+            p++;
+        }
+        if (p == end || *p != '=') {
+            malformed = true;
+            break;
+        }
+        size_t keyLength = (size_t)(p - key);
+        const char* value = ++p;
+        while (p < end && *p != ',' && *p != ':') {
+            p++;
+        }
+        const char* valueEnd = p;
+        if (p < end && *p == ',') {
+            p++;
+        }
+
+        if (keyLength == sizeof(sequenceKey) && memcmp(key, sequenceKey, sizeof(sequenceKey)) == 0) {
+            hasSequence = ParseUnsigned(value, valueEnd, &frame->sequence);
+            malformed |= !hasSequence;
+            continue;
+        }
+        if (keyLength == sizeof(tickKey) && memcmp(key, tickKey, sizeof(tickKey)) == 0) {
+            hasTick = ParseUnsigned(value, valueEnd, &frame->tick);
+            malformed |= !hasTick;
+            continue;
+        }
+
+        const SensorFieldSpec* spec = NULL;
+        if (keyLength == sizeof(spec->key)) {
+            for (size_t i = 0; i < sizeof(sensorFieldSpecs) / sizeof(sensorFieldSpecs[0]); i++) {
+                if (memcmp(key, sensorFieldSpecs[i].key, sizeof(spec->key)) == 0) {
+                    spec = &sensorFieldSpecs[i];
+                    break;
+                }
+            }
+        }
+        if (spec == NULL) {
+            continue;
+        }
+
+        float parsed;
+        if (!ParseDecimal(value, valueEnd, &parsed)) {
+            malformed = true;
+            continue;
+        }
+        if (parsed < spec->minValue || parsed > spec->maxValue) {
+            parserStats.outOfRange++;
+            continue;
+        }
+        *FieldStorage(frame, spec->field) = parsed;
+        frame->fields |= spec->field;
+    }
+
+    frame->stamped = hasSequence && hasTick;
+    return FinishFrame(frame, malformed);
+}
+
+SensorFrame_Result SensorFrame_Check(SensorFrame* frame)
+{
+    for (size_t i = 0; i < sizeof(sensorFieldSpecs) / sizeof(sensorFieldSpecs[0]); i++) {
+        const SensorFieldSpec* spec = &sensorFieldSpecs[i];
+        float value = *FieldStorage(frame, spec->field);
+        if ((frame->fields & spec->field) && (value < spec->minValue || value > spec->maxValue)) {
+            parserStats.outOfRange++;
+            frame->fields &= ~(unsigned int)spec->field;
+        }
+    }
+    return FinishFrame(frame, false);
+}
+
+void SensorFrame_GetStats(SensorFrameParserStats* stats)
+{
+    *stats = parserStats;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// Bits of <see cref="SensorFrame.fields" /> telling which readings a frame carried.
+/// </summary>
+typedef enum {
+    SensorField_Temperature = 1 << 0,
+    SensorField_Humidity = 1 << 1,
+    SensorField_Pressure = 1 << 2,
+    SensorField_Altitude = 1 << 3
+} SensorField;
+
+#define SENSOR_FIELDS_ALL \
+    (SensorField_Temperature | SensorField_Humidity | SensorField_Pressure | SensorField_Altitude)
+
+typedef struct {
+    float temperature; // degrees Celsius
+    float humidity;    // percent
+    float pressure;    // Pa
+    float altitude;    // m
+    unsigned int fields;
+    bool stamped;      // the leaf sent sequence and tick
+    uint32_t sequence; // counts samples since the leaf started
+    uint32_t tick;     // leaf millis() when the measurement was triggered
+} SensorFrame;
+
+typedef enum {
+    SensorFrame_Ok = 0,          // at least one field was parsed
+    SensorFrame_NotSensorFrame,  // line does not start with "sensors:"
+    SensorFrame_Malformed        // no usable field
+} SensorFrame_Result;
+
+typedef struct {
+    unsigned long parsed;
+    unsigned long incomplete;  // parsed, but some fields were missing or rejected
+    unsigned long malformed;   // frames with an unparsable token or without any usable field
+    unsigned long outOfRange;  // individual values outside the BME280 operating range
+} SensorFrameParserStats;
+
+/// <summary>
+/// Parses a "sensors:temp=..,humi=..,pres=..,alti=..[,seqn=..,tick=..]:" line in a single
+/// pass, without heap allocation or locale dependent conversions. Unknown keys are skipped;
+/// fields that are missing, unparsable or out of range are left out of frame->fields.
+/// </summary>
+SensorFrame_Result SensorFrame_Parse(const char* line, size_t length, SensorFrame* frame);
+
+/// <summary>
+/// Applies the range checks and counters of <see cref="SensorFrame_Parse" /> to a frame
+/// that arrived in binary form, removing out of range fields from frame->fields.
+/// </summary>
+SensorFrame_Result SensorFrame_Check(SensorFrame* frame);
+
+void SensorFrame_GetStats(SensorFrameParserStats* stats);
@@ -0,0 +1,92 @@
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <applibs/log.h>
+
+#include "telemetry_batch.h"
+
+static TelemetryBatchConfig batchConfig = {.maxSamples = 1, .maxBytes = TELEMETRY_BATCH_MAX_BYTES, .maxAgeSeconds = 5};
+static const TelemetryEncoder* batchEncoder = NULL;
+static TelemetryBatchFlushHandler batchFlushHandler = NULL;
+
+// One spare byte so text encoders can always NUL terminate.
+static unsigned char batchBody[TELEMETRY_BATCH_MAX_BYTES + 1];
+static size_t batchLength = 0;
+static size_t batchSamples = 0;
+static unsigned int batchFields = 0;
+static struct timespec batchOpenedAt;
+
+void TelemetryBatch_Init(const TelemetryBatchConfig* config, const TelemetryEncoder* encoder,
+                         TelemetryBatchFlushHandler flushHandler)
+{
+    batchConfig = *config;
+    if (batchConfig.maxSamples == 0) {
+        batchConfig.maxSamples = 1;
+    }
+    if (batchConfig.maxBytes == 0 || batchConfig.maxBytes > TELEMETRY_BATCH_MAX_BYTES) {
+        batchConfig.maxBytes = TELEMETRY_BATCH_MAX_BYTES;
+    }
+    batchEncoder = encoder;
+    batchFlushHandler = flushHandler;
+    batchLength = 0;
+    batchSamples = 0;
+}
+
+void TelemetryBatch_Add(const SensorSample* sample)
+{
+    unsigned char element[160];
+    size_t elementLength = batchEncoder->encodeSample(element, sizeof(element), sample);
+    if (elementLength == 0) {
+        Log_Debug("ERROR: telemetry sample does not fit the batch element buffer.\n");
+        return;
+    }
+
+    // Separator, the element, and room left for the closing delimiter.
+    if (batchSamples > 0 &&
+        batchLength + TELEMETRY_ENCODER_MAX_DELIMITER + elementLength + TELEMETRY_ENCODER_MAX_DELIMITER >
+            batchConfig.maxBytes) {
+        TelemetryBatch_Flush();
+    }
+    if (batchSamples == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &batchOpenedAt);
+        batchLength = batchEncoder->beginArray(batchBody, sizeof(batchBody));
+        batchFields = 0;
+    }
+    else {
+        batchLength += batchEncoder->arraySeparator(batchBody + batchLength, sizeof(batchBody) - batchLength);
+    }
+    memcpy(batchBody + batchLength, element, elementLength);
+    batchLength += elementLength;
+    batchSamples++;
+    batchFields |= sample->fields;
+
+    if (batchSamples >= batchConfig.maxSamples) {
+        TelemetryBatch_Flush();
+    }
+}
+
+void TelemetryBatch_Poll(void)
+{
+    if (batchSamples == 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - batchOpenedAt.tv_sec >= batchConfig.maxAgeSeconds) {
+        TelemetryBatch_Flush();
+    }
+}
+
+void TelemetryBatch_Flush(void)
+{
+    if (batchSamples == 0) {
+        return;
+    }
+    batchLength += batchEncoder->endArray(batchBody + batchLength, sizeof(batchBody) - batchLength);
+    if (batchFlushHandler != NULL) {
+        batchFlushHandler(batchBody, batchLength, batchSamples, batchFields);
+    }
+    batchLength = 0;
+    batchSamples = 0;
+}
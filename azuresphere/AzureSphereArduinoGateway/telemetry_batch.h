@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "sample_queue.h"
+#include "telemetry_encoder.h"
+
+/// <summary>
+/// Largest body a batch may grow to. IoT Hub meters messages in 4 KB blocks, which
+/// also cover the message properties, so stay a little below that.
+/// </summary>
+#define TELEMETRY_BATCH_MAX_BYTES 3840
+
+/// <summary>
+/// When a batch is flushed. Whichever limit is reached first wins.
+/// </summary>
+typedef struct {
+    size_t maxSamples;  // 1 sends every sample in its own message
+    size_t maxBytes;    // clamped to TELEMETRY_BATCH_MAX_BYTES
+    int maxAgeSeconds;  // age of the oldest sample in the batch
+} TelemetryBatchConfig;
+
+/// <summary>
+/// Receives an array of encoded samples. fields has the SensorField bits any sample carried.
+/// </summary>
+typedef void (*TelemetryBatchFlushHandler)(const unsigned char* body, size_t length, size_t sampleCount,
+                                           unsigned int fields);
+
+void TelemetryBatch_Init(const TelemetryBatchConfig* config, const TelemetryEncoder* encoder,
+                         TelemetryBatchFlushHandler flushHandler);
+
+/// <summary>
+/// Appends a sample, flushing first if it would push the body over maxBytes and
+/// afterwards if the batch reached maxSamples.
+/// </summary>
+void TelemetryBatch_Add(const SensorSample* sample);
+
+/// <summary>
+/// Flushes the batch if its oldest sample exceeded maxAgeSeconds. Call periodically.
+/// </summary>
+void TelemetryBatch_Poll(void);
+
+/// <summary>
+/// Sends whatever is batched. Does nothing when the batch is empty.
+/// </summary>
+void TelemetryBatch_Flush(void);
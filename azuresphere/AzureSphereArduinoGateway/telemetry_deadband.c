@@ -0,0 +1,107 @@
+#include <math.h>
+#include <time.h>
+
+#include "sensor_frame_parser.h"
+#include "telemetry_deadband.h"
+
+static DeadbandConfig deadbandConfig = {
+    .enabled = false,
+    .maxSilenceSeconds = 300,
+    .temperature = {.absolute = 0.2f, .relative = 0.0f},
+    .humidity = {.absolute = 1.0f, .relative = 0.0f},
+    .pressure = {.absolute = 50.0f, .relative = 0.0f}};
+
+static DeadbandStats deadbandStats;
+
+// Values of the last report, per channel.
+static SensorSample lastReported;
+static bool hasReported = false;
+static struct timespec lastReportedAt;
+
+void TelemetryDeadband_SetConfig(const DeadbandConfig* config)
+{
+    deadbandConfig = *config;
+    hasReported = false;
+}
+
+void TelemetryDeadband_GetConfig(DeadbandConfig* config)
+{
+    *config = deadbandConfig;
+}
+
+static bool HasMoved(const DeadbandThreshold* threshold, float reference, float value)
+{
+    float delta = fabsf(value - reference);
+    if (threshold->absolute <= 0.0f && threshold->relative <= 0.0f) {
+        return delta > 0.0f;
+    }
+    if (threshold->absolute > 0.0f && delta >= threshold->absolute) {
+        return true;
+    }
+    if (threshold->relative > 0.0f && delta >= threshold->relative * fabsf(reference)) {
+        return true;
+    }
+    return false;
+}
+
+static bool ChannelChanged(SensorField field, const DeadbandThreshold* threshold, float reference,
+                           float value, unsigned int fields)
+{
+    if (!(fields & field)) {
+        return false;
+    }
+    if (!(lastReported.fields & field)) {
+        return true;
+    }
+    return HasMoved(threshold, reference, value);
+}
+
+bool TelemetryDeadband_Check(const SensorSample* sample)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    bool report = !deadbandConfig.enabled || !hasReported;
+    if (!report) {
+        report =
+            ChannelChanged(SensorField_Temperature, &deadbandConfig.temperature,
+                           lastReported.temperature, sample->temperature, sample->fields) ||
+            ChannelChanged(SensorField_Humidity, &deadbandConfig.humidity, lastReported.humidity,
+                           sample->humidity, sample->fields) ||
+            ChannelChanged(SensorField_Pressure, &deadbandConfig.pressure, lastReported.pressure,
+                           sample->pressure, sample->fields);
+    }
+    if (!report && now.tv_sec - lastReportedAt.tv_sec >= deadbandConfig.maxSilenceSeconds) {
+        report = true;
+        deadbandStats.heartbeats++;
+    }
+
+    if (!report) {
+        deadbandStats.suppressed++;
+        return false;
+    }
+
+    // Channels missing from this sample keep their previous reference.
+    if (!hasReported) {
+        lastReported.fields = 0;
+    }
+    if (sample->fields & SensorField_Temperature) {
+        lastReported.temperature = sample->temperature;
+    }
+    if (sample->fields & SensorField_Humidity) {
+        lastReported.humidity = sample->humidity;
+    }
+    if (sample->fields & SensorField_Pressure) {
+        lastReported.pressure = sample->pressure;
+    }
+    lastReported.fields |= sample->fields;
+    hasReported = true;
+    lastReportedAt = now;
+    deadbandStats.reported++;
+    return true;
+}
+
+void TelemetryDeadband_GetStats(DeadbandStats* stats)
+{
+    *stats = deadbandStats;
+}
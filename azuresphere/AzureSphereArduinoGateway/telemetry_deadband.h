@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "sample_queue.h"
+
+/// <summary>
+/// A reading is reported when it moved at least absolute units, or at least
+/// relative * |last reported value|, away from the value last reported.
+/// A threshold of 0 is ignored; with both at 0 any change is reported.
+/// </summary>
+typedef struct {
+    float absolute;
+    float relative;
+} DeadbandThreshold;
+
+typedef struct {
+    bool enabled;
+    int maxSilenceSeconds; // report anyway once this long has passed without a report
+    DeadbandThreshold temperature;
+    DeadbandThreshold humidity;
+    DeadbandThreshold pressure;
+} DeadbandConfig;
+
+typedef struct {
+    unsigned long reported;
+    unsigned long suppressed;
+    unsigned long heartbeats; // reports caused only by maxSilenceSeconds
+} DeadbandStats;
+
+/// <summary>
+/// Replaces the configuration. The next checked sample is always reported.
+/// </summary>
+void TelemetryDeadband_SetConfig(const DeadbandConfig* config);
+void TelemetryDeadband_GetConfig(DeadbandConfig* config);
+
+/// <summary>
+/// Decides whether sample is worth sending. When it is, its readings become the new
+/// reference values.
+/// </summary>
+/// <returns>true to send the sample, false to suppress it.</returns>
+bool TelemetryDeadband_Check(const SensorSample* sample);
+
+void TelemetryDeadband_GetStats(DeadbandStats* stats);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "sample_queue.h"
+#include "sensor_aggregate.h"
+
+/// <summary>
+/// Longest output of beginArray, arraySeparator or endArray.
+/// </summary>
+#define TELEMETRY_ENCODER_MAX_DELIMITER 1
+
+/// <summary>
+/// Serialises telemetry records into a message body. Every function writes at most size
+/// bytes to buffer and returns the number of bytes written. encodeSample and encodeWindow
+/// return 0 if the record did not fit; the array delimiters may legitimately be empty.
+/// Batches are built as beginArray, elements joined by arraySeparator, then endArray.
+/// </summary>
+typedef struct {
+    const char* name;
+    const char* contentType;     // IoT Hub content-type system property
+    const char* contentEncoding; // IoT Hub content-encoding system property, NULL for binary bodies
+    size_t (*beginArray)(unsigned char* buffer, size_t size);
+    size_t (*arraySeparator)(unsigned char* buffer, size_t size);
+    size_t (*endArray)(unsigned char* buffer, size_t size);
+    size_t (*encodeSample)(unsigned char* buffer, size_t size, const SensorSample* sample);
+    size_t (*encodeWindow)(unsigned char* buffer, size_t size, const SensorWindow* window);
+} TelemetryEncoder;
+
+/// <summary>
+/// The original JSON format: { "temperature", "humidity", "pressure", "timestamp" } per
+/// sample, with a local time "YYYY/MM/DDThh:mm:ss.mmm" timestamp.
+/// </summary>
+extern const TelemetryEncoder TelemetryEncoder_Json;
+
+/// <summary>
+/// RFC 8949 CBOR with short keys. A sample is a map of "ts" (Unix epoch milliseconds)
+/// and float32 "t", "h", "p". A window is a map of "ws", "we" (epoch ms), "n" (samples)
+/// and per channel "t", "h", "p" maps of "n", "min", "max", "avg", "sd", "first", "last".
+/// Batches are indefinite-length arrays.
+/// </summary>
+extern const TelemetryEncoder TelemetryEncoder_Cbor;
+
+/// <summary>
+/// Encoder chosen for this deployment with the TELEMETRY_ENCODING_CBOR build option.
+/// </summary>
+#if defined(TELEMETRY_ENCODING_CBOR)
+#define TELEMETRY_ENCODER (&TelemetryEncoder_Cbor)
+#else
+#define TELEMETRY_ENCODER (&TelemetryEncoder_Json)
+#endif
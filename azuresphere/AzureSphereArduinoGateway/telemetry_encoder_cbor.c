@@ -0,0 +1,197 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor_frame_parser.h"
+#include "telemetry_encoder.h"
+
+// CBOR major types (RFC 8949, section 3.1).
+#define CBOR_UNSIGNED 0
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_FLOAT32 0xFA
+#define CBOR_ARRAY_INDEFINITE 0x9F
+#define CBOR_BREAK 0xFF
+
+typedef struct {
+    unsigned char* buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+} CborWriter;
+
+static void CborPutByte(CborWriter* writer, unsigned char byte)
+{
+    if (writer->length >= writer->size) {
+        writer->overflow = true;
+        return;
+    }
+    writer->buffer[writer->length++] = byte;
+}
+
+static void CborPutHead(CborWriter* writer, int majorType, uint64_t value)
+{
+    unsigned char major = (unsigned char)(majorType << 5);
+    int bytes;
+    if (value < 24) {
+        CborPutByte(writer, major | (unsigned char)value);
+        return;
+    }
+    else if (value <= UINT8_MAX) {
+        CborPutByte(writer, major | 24);
+        bytes = 1;
+    }
+    else if (value <= UINT16_MAX) {
+        CborPutByte(writer, major | 25);
+        bytes = 2;
+    }
+    else if (value <= UINT32_MAX) {
+        CborPutByte(writer, major | 26);
+        bytes = 4;
+    }
+    else {
+        CborPutByte(writer, major | 27);
+        bytes = 8;
+    }
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+        CborPutByte(writer, (unsigned char)(value >> shift));
+    }
+}
+
+static void CborPutText(CborWriter* writer, const char* text)
+{
+    size_t length = strlen(text);
+    CborPutHead(writer, CBOR_TEXT, length);
+    for (size_t i = 0; i < length; i++) {
+        CborPutByte(writer, (unsigned char)text[i]);
+    }
+}
+
+static void CborPutFloat(CborWriter* writer, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    CborPutByte(writer, CBOR_FLOAT32);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        CborPutByte(writer, (unsigned char)(bits >> shift));
+    }
+}
+
+static uint64_t EpochMilliseconds(const struct timespec* timestamp)
+{
+    return (uint64_t)timestamp->tv_sec * 1000u + (uint64_t)(timestamp->tv_nsec / 1000000);
+}
+
+static size_t CborFinish(const CborWriter* writer)
+{
+    return writer->overflow ? 0 : writer->length;
+}
+
+static size_t CborBeginArray(unsigned char* buffer, size_t size)
+{
+    CborWriter writer = {.buffer = buffer, .size = size};
+    CborPutByte(&writer, CBOR_ARRAY_INDEFINITE);
+    return CborFinish(&writer);
+}
+
+static size_t CborArraySeparator(unsigned char* buffer, size_t size)
+{
+    // Items of a CBOR array are self-delimiting.
+    (void)buffer;
+    (void)size;
+    return 0;
+}
+
+static size_t CborEndArray(unsigned char* buffer, size_t size)
+{
+    CborWriter writer = {.buffer = buffer, .size = size};
+    CborPutByte(&writer, CBOR_BREAK);
+    return CborFinish(&writer);
+}
+
+static unsigned int CountFields(unsigned int fields)
+{
+    unsigned int count = 0;
+    for (; fields != 0; fields &= fields - 1) {
+        count++;
+    }
+    return count;
+}
+
+static size_t CborEncodeSample(unsigned char* buffer, size_t size, const SensorSample* sample)
+{
+    unsigned int fields = sample->fields & (SensorField_Temperature | SensorField_Humidity | SensorField_Pressure);
+    CborWriter writer = {.buffer = buffer, .size = size};
+    CborPutHead(&writer, CBOR_MAP, 1 + CountFields(fields));
+    CborPutText(&writer, "ts");
+    CborPutHead(&writer, CBOR_UNSIGNED, EpochMilliseconds(&sample->timestamp));
+    if (fields & SensorField_Temperature) {
+        CborPutText(&writer, "t");
+        CborPutFloat(&writer, sample->temperature);
+    }
+    if (fields & SensorField_Humidity) {
+        CborPutText(&writer, "h");
+        CborPutFloat(&writer, sample->humidity);
+    }
+    if (fields & SensorField_Pressure) {
+        CborPutText(&writer, "p");
+        CborPutFloat(&writer, sample->pressure);
+    }
+    return CborFinish(&writer);
+}
+
+static void CborPutAggregate(CborWriter* writer, const char* name, const SensorAggregate* aggregate)
+{
+    CborPutText(writer, name);
+    CborPutHead(writer, CBOR_MAP, 7);
+    CborPutText(writer, "n");
+    CborPutHead(writer, CBOR_UNSIGNED, aggregate->count);
+    CborPutText(writer, "min");
+    CborPutFloat(writer, aggregate->min);
+    CborPutText(writer, "max");
+    CborPutFloat(writer, aggregate->max);
+    CborPutText(writer, "avg");
+    CborPutFloat(writer, (float)aggregate->mean);
+    CborPutText(writer, "sd");
+    CborPutFloat(writer, (float)SensorAggregate_StdDev(aggregate));
+    CborPutText(writer, "first");
+    CborPutFloat(writer, aggregate->first);
+    CborPutText(writer, "last");
+    CborPutFloat(writer, aggregate->last);
+}
+
+static size_t CborEncodeWindow(unsigned char* buffer, size_t size, const SensorWindow* window)
+{
+    unsigned int channels = (window->temperature.count > 0) + (window->humidity.count > 0) +
+                            (window->pressure.count > 0);
+    CborWriter writer = {.buffer = buffer, .size = size};
+    CborPutHead(&writer, CBOR_MAP, 3 + channels);
+    CborPutText(&writer, "ws");
+    CborPutHead(&writer, CBOR_UNSIGNED, EpochMilliseconds(&window->start));
+    CborPutText(&writer, "we");
+    CborPutHead(&writer, CBOR_UNSIGNED, EpochMilliseconds(&window->end));
+    CborPutText(&writer, "n");
+    CborPutHead(&writer, CBOR_UNSIGNED, window->samples);
+    if (window->temperature.count > 0) {
+        CborPutAggregate(&writer, "t", &window->temperature);
+    }
+    if (window->humidity.count > 0) {
+        CborPutAggregate(&writer, "h", &window->humidity);
+    }
+    if (window->pressure.count > 0) {
+        CborPutAggregate(&writer, "p", &window->pressure);
+    }
+    return CborFinish(&writer);
+}
+
+const TelemetryEncoder TelemetryEncoder_Cbor = {
+    .name = "cbor",
+    .contentType = "application/cbor",
+    .contentEncoding = NULL,
+    .beginArray = CborBeginArray,
+    .arraySeparator = CborArraySeparator,
+    .endArray = CborEndArray,
+    .encodeSample = CborEncodeSample,
+    .encodeWindow = CborEncodeWindow,
+};
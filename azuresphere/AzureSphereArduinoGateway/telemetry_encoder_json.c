@@ -0,0 +1,123 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sensor_frame_parser.h"
+#include "telemetry_encoder.h"
+
+typedef struct {
+    char* buffer;
+    size_t size;
+    size_t length;
+    bool overflow;
+} JsonWriter;
+
+static void JsonAppend(JsonWriter* writer, const char* format, ...)
+{
+    if (writer->overflow) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(writer->buffer + writer->length, writer->size - writer->length, format, args);
+    va_end(args);
+    if (written < 0 || (size_t)written >= writer->size - writer->length) {
+        writer->overflow = true;
+        return;
+    }
+    writer->length += (size_t)written;
+}
+
+static size_t JsonFinish(const JsonWriter* writer)
+{
+    return writer->overflow ? 0 : writer->length;
+}
+
+static void JsonAppendTimestamp(JsonWriter* writer, const char* name, const struct timespec* timestamp)
+{
+    struct tm tm;
+    localtime_r(&timestamp->tv_sec, &tm);
+    JsonAppend(writer, "\"%s\":\"%04d/%02d/%02dT%02d:%02d:%02d.%03ld\"", name,
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        timestamp->tv_nsec / 1000000);
+}
+
+static void JsonAppendAggregate(JsonWriter* writer, const char* name, const SensorAggregate* aggregate)
+{
+    if (aggregate->count == 0) {
+        return;
+    }
+    JsonAppend(writer,
+        ",\"%s\":{\"count\":%lu,\"min\":%.2f,\"max\":%.2f,\"mean\":%.3f,\"stddev\":%.3f,\"first\":%.2f,\"last\":%.2f}",
+        name, aggregate->count, aggregate->min, aggregate->max, aggregate->mean,
+        SensorAggregate_StdDev(aggregate), aggregate->first, aggregate->last);
+}
+
+static size_t JsonBeginArray(unsigned char* buffer, size_t size)
+{
+    JsonWriter writer = {.buffer = (char*)buffer, .size = size};
+    JsonAppend(&writer, "[");
+    return JsonFinish(&writer);
+}
+
+static size_t JsonArraySeparator(unsigned char* buffer, size_t size)
+{
+    JsonWriter writer = {.buffer = (char*)buffer, .size = size};
+    JsonAppend(&writer, ",");
+    return JsonFinish(&writer);
+}
+
+static size_t JsonEndArray(unsigned char* buffer, size_t size)
+{
+    JsonWriter writer = {.buffer = (char*)buffer, .size = size};
+    JsonAppend(&writer, "]");
+    return JsonFinish(&writer);
+}
+
+/// <summary>
+/// Readings missing from the frame are omitted rather than repeated from an older sample.
+/// </summary>
+static size_t JsonEncodeSample(unsigned char* buffer, size_t size, const SensorSample* sample)
+{
+    JsonWriter writer = {.buffer = (char*)buffer, .size = size};
+    JsonAppend(&writer, "{");
+    if (sample->fields & SensorField_Temperature) {
+        JsonAppend(&writer, "\"temperature\":%.2f,", sample->temperature);
+    }
+    if (sample->fields & SensorField_Humidity) {
+        JsonAppend(&writer, "\"humidity\":%.2f,", sample->humidity);
+    }
+    if (sample->fields & SensorField_Pressure) {
+        JsonAppend(&writer, "\"pressure\":%.2f,", sample->pressure);
+    }
+    JsonAppendTimestamp(&writer, "timestamp", &sample->timestamp);
+    JsonAppend(&writer, "}");
+    return JsonFinish(&writer);
+}
+
+static size_t JsonEncodeWindow(unsigned char* buffer, size_t size, const SensorWindow* window)
+{
+    JsonWriter writer = {.buffer = (char*)buffer, .size = size};
+    JsonAppend(&writer, "{");
+    JsonAppendTimestamp(&writer, "windowStart", &window->start);
+    JsonAppend(&writer, ",");
+    JsonAppendTimestamp(&writer, "windowEnd", &window->end);
+    JsonAppend(&writer, ",\"samples\":%lu", window->samples);
+    JsonAppendAggregate(&writer, "temperature", &window->temperature);
+    JsonAppendAggregate(&writer, "humidity", &window->humidity);
+    JsonAppendAggregate(&writer, "pressure", &window->pressure);
+    JsonAppend(&writer, "}");
+    return JsonFinish(&writer);
+}
+
+const TelemetryEncoder TelemetryEncoder_Json = {
+    .name = "json",
+    .contentType = "application/json",
+    .contentEncoding = "utf-8",
+    .beginArray = JsonBeginArray,
+    .arraySeparator = JsonArraySeparator,
+    .endArray = JsonEndArray,
+    .encodeSample = JsonEncodeSample,
+    .encodeWindow = JsonEncodeWindow,
+};
@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <applibs/log.h>
+
+#include "telemetry_journal.h"
+
+// File layout: a JournalHeader at offset 0, then a circular log of records in
+// [JOURNAL_DATA_START, dataEnd). Each record is a RecordHeader followed by the payload,
+// padded to 4 bytes. A record that does not fit before dataEnd is written at
+// JOURNAL_DATA_START instead, after a wrap marker if there is room for one.
+//
+// Only the oldest record (head) is persisted in the header. On open the newer records
+// are recovered by following consecutive sequence numbers with valid CRCs from there,
+// so appends never rewrite the header. The header is written on flush after records
+// were acknowledged or evicted; records acknowledged after the last flush are replayed
+// again after a restart.
+
+#define JOURNAL_MAGIC 0x4C4E524Au // "JRNL"
+#define JOURNAL_VERSION 1u
+#define JOURNAL_DATA_START 32u
+#define RECORD_MARK 0xA55Au
+#define WRAP_MARK 0x5AA5u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t headOffset;
+    uint32_t headSequence;
+    uint32_t crc; // over the fields above
+} JournalHeader;
+
+typedef struct {
+    uint32_t sequence;
+    uint16_t length;
+    uint16_t mark;
+    uint32_t crc; // over sequence, length and payload
+} RecordHeader;
+
+static int journalFd = -1;
+static uint32_t dataEnd = 0;
+static uint32_t head = JOURNAL_DATA_START;
+static uint32_t tail = JOURNAL_DATA_START;
+static uint32_t headSequence = 0;
+static uint32_t recordCount = 0;
+static bool headerDirty = false;
+
+// Appends are collected here and written in one go on flush.
+static unsigned char writeBuffer[1024];
+static uint32_t writeBufferOffset = 0;
+static size_t writeBufferLength = 0;
+
+// Replay window over the oldest records; index i is record headSequence + i.
+static uint32_t windowOffsets[TELEMETRY_JOURNAL_REPLAY_WINDOW];
+static uint32_t windowEnds[TELEMETRY_JOURNAL_REPLAY_WINDOW];
+static uint32_t windowKnown = 0; // offsets are known for this many records
+static uint32_t inFlightMask = 0;
+static uint32_t ackedMask = 0;
+
+static unsigned char recordBuffer[TELEMETRY_JOURNAL_MAX_RECORD];
+static TelemetryJournalStats journalStats;
+
+static uint32_t Crc32Update(uint32_t crc, const void* data, size_t length)
+{
+    const unsigned char* p = data;
+    crc = ~crc;
+    while (length-- > 0) {
+        crc ^= *p++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t RecordCrc(uint32_t sequence, uint16_t length, const unsigned char* payload)
+{
+    uint32_t crc = Crc32Update(0, &sequence, sizeof(sequence));
+    crc = Crc32Update(crc, &length, sizeof(length));
+    return Crc32Update(crc, payload, length);
+}
+
+static uint32_t RecordSize(size_t length)
+{
+    return (uint32_t)((sizeof(RecordHeader) + length + 3u) & ~(size_t)3u);
+}
+
+static bool ReadAt(uint32_t offset, void* data, size_t length)
+{
+    if (lseek(journalFd, (off_t)offset, SEEK_SET) == -1) {
+        return false;
+    }
+    return read(journalFd, data, length) == (ssize_t)length;
+}
+
+static bool WriteAt(uint32_t offset, const void* data, size_t length)
+{
+    if (lseek(journalFd, (off_t)offset, SEEK_SET) == -1 ||
+        write(journalFd, data, length) != (ssize_t)length) {
+        Log_Debug("ERROR: telemetry journal write failed: %s (%d).\n", strerror(errno), errno);
+        return false;
+    }
+    return true;
+}
+
+static void FlushData(void)
+{
+    if (writeBufferLength > 0) {
+        WriteAt(writeBufferOffset, writeBuffer, writeBufferLength);
+        writeBufferLength = 0;
+    }
+}
+
+static void BufferedWrite(uint32_t offset, const void* data, size_t length)
+{
+    if (writeBufferLength > 0 &&
+        (offset != writeBufferOffset + writeBufferLength || length > sizeof(writeBuffer) - writeBufferLength)) {
+        FlushData();
+    }
+    if (length > sizeof(writeBuffer)) {
+        WriteAt(offset, data, length);
+        return;
+    }
+    if (writeBufferLength == 0) {
+        writeBufferOffset = offset;
+    }
+    memcpy(writeBuffer + writeBufferLength, data, length);
+    writeBufferLength += length;
+}
+
+static void WriteHeader(void)
+{
+    JournalHeader header = {.magic = JOURNAL_MAGIC,
+                            .version = JOURNAL_VERSION,
+                            .capacity = dataEnd,
+                            .headOffset = head,
+                            .headSequence = headSequence};
+    header.crc = Crc32Update(0, &header, offsetof(JournalHeader, crc));
+    if (WriteAt(0, &header, sizeof(header))) {
+        headerDirty = false;
+    }
+}
+
+/// <summary>
+/// Finds record sequence at offset, following a wrap to the start of the data area.
+/// </summary>
+static bool ReadRecordHeader(uint32_t offset, uint32_t sequence, uint32_t* recordOffset, RecordHeader* header)
+{
+    bool wrapped = true;
+    if (dataEnd - offset >= sizeof(RecordHeader)) {
+        if (!ReadAt(offset, header, sizeof(*header))) {
+            return false;
+        }
+        wrapped = (header->mark == WRAP_MARK && header->sequence == sequence);
+    }
+    if (wrapped) {
+        offset = JOURNAL_DATA_START;
+        if (!ReadAt(offset, header, sizeof(*header))) {
+            return false;
+        }
+    }
+    if (header->mark != RECORD_MARK || header->sequence != sequence ||
+        header->length > TELEMETRY_JOURNAL_MAX_RECORD || offset + RecordSize(header->length) > dataEnd) {
+        return false;
+    }
+    *recordOffset = offset;
+    return true;
+}
+
+/// <summary>
+/// Reads the payload of the record at offset into recordBuffer and checks its CRC.
+/// </summary>
+static bool ReadRecordPayload(uint32_t offset, const RecordHeader* header)
+{
+    if (!ReadAt(offset + (uint32_t)sizeof(RecordHeader), recordBuffer, header->length)) {
+        return false;
+    }
+    if (RecordCrc(header->sequence, header->length, recordBuffer) != header->crc) {
+        journalStats.corrupt++;
+        return false;
+    }
+    return true;
+}
+
+static void ResetWhenEmpty(void)
+{
+    if (recordCount == 0) {
+        head = tail = JOURNAL_DATA_START;
+        windowKnown = 0;
+        inFlightMask = 0;
+        ackedMask = 0;
+        headerDirty = true;
+    }
+}
+
+/// <summary>
+/// Forgets record index and everything newer, e.g. because it cannot be read back.
+/// </summary>
+static void TruncateAt(uint32_t index)
+{
+    Log_Debug("WARNING: telemetry journal truncated after %u of %u records.\n", index, recordCount);
+    recordCount = index;
+    tail = (index == 0) ? head : windowEnds[index - 1];
+    if (windowKnown > index) {
+        windowKnown = index;
+    }
+    inFlightMask &= (1u << index) - 1u;
+    ackedMask &= (1u << index) - 1u;
+    ResetWhenEmpty();
+}
+
+static void DropOldest(void)
+{
+    uint32_t next;
+    if (windowKnown > 0) {
+        next = windowEnds[0];
+        memmove(windowOffsets, windowOffsets + 1, (windowKnown - 1) * sizeof(windowOffsets[0]));
+        memmove(windowEnds, windowEnds + 1, (windowKnown - 1) * sizeof(windowEnds[0]));
+        windowKnown--;
+    }
+    else {
+        RecordHeader header;
+        uint32_t recordOffset;
+        FlushData();
+        if (!ReadRecordHeader(head, headSequence, &recordOffset, &header)) {
+            TruncateAt(0);
+            return;
+        }
+        next = recordOffset + RecordSize(header.length);
+    }
+    inFlightMask >>= 1;
+    ackedMask >>= 1;
+    head = next;
+    headSequence++;
+    recordCount--;
+    headerDirty = true;
+    ResetWhenEmpty();
+}
+
+/// <summary>
+/// Locates room for size bytes at the tail of the log.
+/// </summary>
+static bool FindSpace(uint32_t size, uint32_t* offset, bool* wrap)
+{
+    *wrap = false;
+    if (recordCount == 0 || tail > head) {
+        if (tail + size <= dataEnd) {
+            *offset = tail;
+            return true;
+        }
+        if (recordCount > 0 && JOURNAL_DATA_START + size <= head) {
+            *offset = JOURNAL_DATA_START;
+            *wrap = true;
+            return true;
+        }
+        return false;
+    }
+    // The tail has wrapped behind the head; tail == head means full.
+    if (tail < head && tail + size <= head) {
+        *offset = tail;
+        return true;
+    }
+    return false;
+}
+
+int TelemetryJournal_Open(int fd, size_t capacity)
+{
+    if (fd < 0 || capacity < JOURNAL_DATA_START + RecordSize(TELEMETRY_JOURNAL_MAX_RECORD)) {
+        errno = EINVAL;
+        return -1;
+    }
+    journalFd = fd;
+    dataEnd = (uint32_t)capacity & ~3u;
+    head = tail = JOURNAL_DATA_START;
+    headSequence = 0;
+    recordCount = 0;
+    writeBufferLength = 0;
+    windowKnown = 0;
+    inFlightMask = 0;
+    ackedMask = 0;
+    memset(&journalStats, 0, sizeof(journalStats));
+
+    JournalHeader header;
+    if (ReadAt(0, &header, sizeof(header)) && header.magic == JOURNAL_MAGIC &&
+        header.version == JOURNAL_VERSION && header.capacity == dataEnd &&
+        header.crc == Crc32Update(0, &header, offsetof(JournalHeader, crc)) &&
+        header.headOffset >= JOURNAL_DATA_START && header.headOffset <= dataEnd) {
+        head = tail = header.headOffset;
+        headSequence = header.headSequence;
+
+        bool wrapped = false;
+        for (;;) {
+            RecordHeader recordHeader;
+            uint32_t recordOffset;
+            if (!ReadRecordHeader(tail, headSequence + recordCount, &recordOffset, &recordHeader) ||
+                !ReadRecordPayload(recordOffset, &recordHeader)) {
+                break;
+            }
+            if (recordOffset < tail) {
+                if (wrapped) {
+                    break;
+                }
+                wrapped = true;
+            }
+            uint32_t recordEnd = recordOffset + RecordSize(recordHeader.length);
+            if (wrapped && recordEnd > head) {
+                break;
+            }
+            tail = recordEnd;
+            recordCount++;
+        }
+        Log_Debug("INFO: telemetry journal recovered %u records.\n", recordCount);
+    }
+    else {
+        Log_Debug("INFO: telemetry journal formatted, %u bytes.\n", dataEnd);
+        headerDirty = true;
+    }
+    ResetWhenEmpty();
+    TelemetryJournal_Flush();
+    return 0;
+}
+
+bool TelemetryJournal_Append(const unsigned char* body, size_t length)
+{
+    if (journalFd < 0 || length == 0 || length > TELEMETRY_JOURNAL_MAX_RECORD) {
+        return false;
+    }
+    uint32_t size = RecordSize(length);
+    uint32_t offset;
+    bool wrap;
+    while (!FindSpace(size, &offset, &wrap)) {
+        DropOldest();
+        journalStats.evicted++;
+    }
+
+    uint32_t sequence = headSequence + recordCount;
+    if (wrap && dataEnd - tail >= sizeof(RecordHeader)) {
+        RecordHeader marker = {.sequence = sequence, .length = 0, .mark = WRAP_MARK, .crc = 0};
+        BufferedWrite(tail, &marker, sizeof(marker));
+    }
+
+    static const unsigned char padding[3] = {0};
+    RecordHeader header = {.sequence = sequence, .length = (uint16_t)length, .mark = RECORD_MARK};
+    header.crc = RecordCrc(sequence, header.length, body);
+    BufferedWrite(offset, &header, sizeof(header));
+    BufferedWrite(offset + (uint32_t)sizeof(header), body, length);
+    BufferedWrite(offset + (uint32_t)(sizeof(header) + length), padding, size - sizeof(header) - length);
+
+    tail = offset + size;
+    recordCount++;
+    journalStats.appended++;
+    return true;
+}
+
+void TelemetryJournal_Flush(void)
+{
+    if (journalFd < 0) {
+        return;
+    }
+    FlushData();
+    if (headerDirty) {
+        WriteHeader();
+    }
+}
+
+size_t TelemetryJournal_Replay(size_t maxRecords, TelemetryJournalSendHandler send)
+{
+    if (journalFd < 0) {
+        return 0;
+    }
+    FlushData();
+
+    size_t sent = 0;
+    for (uint32_t i = 0; i < recordCount && i < TELEMETRY_JOURNAL_REPLAY_WINDOW && sent < maxRecords; i++) {
+        RecordHeader header;
+        uint32_t recordOffset;
+        if (i >= windowKnown) {
+            uint32_t from = (i == 0) ? head : windowEnds[i - 1];
+            if (!ReadRecordHeader(from, headSequence + i, &recordOffset, &header)) {
+                TruncateAt(i);
+                break;
+            }
+            windowOffsets[i] = recordOffset;
+            windowEnds[i] = recordOffset + RecordSize(header.length);
+            windowKnown = i + 1;
+        }
+
+        uint32_t bit = 1u << i;
+        if ((inFlightMask | ackedMask) & bit) {
+            continue;
+        }
+        if (!ReadRecordHeader(windowOffsets[i], headSequence + i, &recordOffset, &header) ||
+            !ReadRecordPayload(recordOffset, &header)) {
+            TruncateAt(i);
+            break;
+        }
+        if (!send(recordBuffer, header.length, headSequence + i)) {
+            break;
+        }
+        inFlightMask |= bit;
+        journalStats.replayed++;
+        sent++;
+    }
+    return sent;
+}
+
+void TelemetryJournal_Confirm(uint32_t sequence, bool delivered)
+{
+    // Sequences older than the head were evicted meanwhile and wrap to large indexes.
+    uint32_t index = sequence - headSequence;
+    if (index >= TELEMETRY_JOURNAL_REPLAY_WINDOW || index >= recordCount) {
+        return;
+    }
+    uint32_t bit = 1u << index;
+    if (!(inFlightMask & bit)) {
+        return;
+    }
+    inFlightMask &= ~bit;
+    if (!delivered) {
+        return;
+    }
+    ackedMask |= bit;
+    while (recordCount > 0 && (ackedMask & 1u)) {
+        DropOldest();
+        journalStats.acknowledged++;
+    }
+}
+
+bool TelemetryJournal_IsEmpty(void)
+{
+    return recordCount == 0;
+}
+
+void TelemetryJournal_GetStats(TelemetryJournalStats* stats)
+{
+    *stats = journalStats;
+    stats->records = recordCount;
+    stats->capacity = dataEnd;
+}
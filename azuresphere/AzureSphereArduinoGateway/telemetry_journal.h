@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// Largest record the journal stores: a message body and whatever the caller keeps with it.
+/// </summary>
+#define TELEMETRY_JOURNAL_MAX_RECORD 4096
+
+/// <summary>
+/// Number of oldest records that may be replayed and awaiting confirmation at once.
+/// </summary>
+#define TELEMETRY_JOURNAL_REPLAY_WINDOW 8
+
+/// <summary>
+/// Sends one journaled message; sequence must be passed to
+/// <see cref="TelemetryJournal_Confirm" /> once IoT Hub confirms or rejects it.
+/// </summary>
+/// <returns>true if the message was handed to the IoT Hub client.</returns>
+typedef bool (*TelemetryJournalSendHandler)(const unsigned char* body, size_t length, uint32_t sequence);
+
+typedef struct {
+    unsigned long appended;
+    unsigned long evicted;       // dropped unsent to make room, oldest first
+    unsigned long replayed;      // send attempts, including retries
+    unsigned long acknowledged;
+    unsigned long corrupt;       // records that failed their CRC check
+    unsigned long records;       // currently stored
+    size_t capacity;
+} TelemetryJournalStats;
+
+/// <summary>
+/// Attaches the journal to fd, a file of capacity bytes such as the one returned by
+/// Storage_OpenMutableFile. Records that survived a restart are recovered and will be
+/// replayed. An unformatted or damaged file is reset to an empty journal.
+/// </summary>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int TelemetryJournal_Open(int fd, size_t capacity);
+
+/// <summary>
+/// Stores a message body for later delivery, evicting the oldest records if needed.
+/// The record is buffered in memory until the next <see cref="TelemetryJournal_Flush" />.
+/// </summary>
+bool TelemetryJournal_Append(const unsigned char* body, size_t length);
+
+/// <summary>
+/// Writes buffered records and the journal head to storage.
+/// </summary>
+void TelemetryJournal_Flush(void);
+
+/// <summary>
+/// Sends up to maxRecords of the oldest records which are not already awaiting
+/// confirmation, stopping at the first one send refuses.
+/// </summary>
+/// <returns>Number of records handed to send.</returns>
+size_t TelemetryJournal_Replay(size_t maxRecords, TelemetryJournalSendHandler send);
+
+/// <summary>
+/// Records the outcome of a replayed record. Delivered records are removed once every
+/// older record has been delivered too; rejected ones are sent again by a later replay.
+/// </summary>
+void TelemetryJournal_Confirm(uint32_t sequence, bool delivered);
+
+bool TelemetryJournal_IsEmpty(void);
+void TelemetryJournal_GetStats(TelemetryJournalStats* stats);
@@ -0,0 +1,284 @@
+// Checks the leaf frame encoder and decoder against the cases the UART link runs into:
+// every payload length, frames split across reads, damaged and oversized frames.
+#include <stdio.h>
+#include <string.h>
+
+#include "leaf_protocol.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                            \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+static void FillPayload(uint8_t* payload, size_t length, unsigned int seed)
+{
+    // Every third byte is 0 so COBS has something to stuff.
+    for (size_t i = 0; i < length; i++) {
+        payload[i] = (i % 3 == 0) ? 0 : (uint8_t)(seed + i * 37);
+    }
+}
+
+static bool SameFrame(const LeafFrame* frame, uint8_t type, uint16_t sequence, const uint8_t* payload,
+    size_t length)
+{
+    return frame->type == type && frame->sequence == sequence && frame->length == length
+        && memcmp(frame->payload, payload, length) == 0;
+}
+
+/// <summary>
+/// Feeds bytes to the decoder and counts the frames it completes; the last one is copied to frame.
+/// </summary>
+static int PushBytes(LeafFrameDecoder* decoder, const uint8_t* data, size_t length, LeafFrame* frame)
+{
+    int frames = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (LeafFrameDecoder_Push(decoder, data[i], frame)) {
+            frames++;
+        }
+    }
+    return frames;
+}
+
+/// <summary>
+/// Encodes a payload without any 0 byte in the raw frame, so that the only COBS code byte is
+/// encoded[1] and every other byte between the delimiters is frame data.
+/// </summary>
+static size_t EncodeWithoutZeros(uint8_t* encoded, size_t size, uint16_t* sequence)
+{
+    const uint8_t payload[] = {0x11, 0x22, 0x33, 0x44};
+    for (*sequence = 0x0101; *sequence < 0x0200; (*sequence)++) {
+        size_t length = LeafFrame_Encode(LeafFrame_MotorCommand, *sequence, payload, sizeof(payload), encoded, size);
+        if (length == LEAF_FRAME_OVERHEAD + sizeof(payload) + 3) {
+            return length;
+        }
+    }
+    return 0;
+}
+
+static void TestRoundTrip(void)
+{
+    for (size_t length = 0; length <= LEAF_FRAME_MAX_PAYLOAD; length++) {
+        uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+        uint8_t encoded[LEAF_FRAME_MAX_ENCODED];
+        FillPayload(payload, length, (unsigned int)length);
+        uint16_t sequence = (uint16_t)(0xFF00 + length);
+
+        size_t encodedLength =
+            LeafFrame_Encode(LeafFrame_SensorSample, sequence, payload, length, encoded, sizeof(encoded));
+        CHECK(encodedLength > 0 && encodedLength <= LEAF_FRAME_MAX_ENCODED);
+        CHECK(encoded[0] == 0 && encoded[encodedLength - 1] == 0);
+        CHECK(memchr(encoded + 1, 0, encodedLength - 2) == NULL);
+
+        LeafFrame frame;
+        CHECK(LeafFrame_Decode(encoded, encodedLength, &frame));
+        CHECK(SameFrame(&frame, LeafFrame_SensorSample, sequence, payload, length));
+
+        LeafFrameDecoder decoder;
+        LeafFrameDecoder_Init(&decoder);
+        CHECK(PushBytes(&decoder, encoded, encodedLength, &frame) == 1);
+        CHECK(SameFrame(&frame, LeafFrame_SensorSample, sequence, payload, length));
+        CHECK(decoder.stats.frames == 1);
+    }
+
+    // A payload of nothing but 0 bytes, and one without any.
+    uint8_t zeros[LEAF_FRAME_MAX_PAYLOAD] = {0};
+    uint8_t ones[LEAF_FRAME_MAX_PAYLOAD];
+    memset(ones, 0xFF, sizeof(ones));
+    uint8_t encoded[LEAF_FRAME_MAX_ENCODED];
+    LeafFrame frame;
+    size_t encodedLength = LeafFrame_Encode(LeafFrame_Config, 0, zeros, sizeof(zeros), encoded, sizeof(encoded));
+    CHECK(encodedLength > 0 && LeafFrame_Decode(encoded, encodedLength, &frame));
+    CHECK(SameFrame(&frame, LeafFrame_Config, 0, zeros, sizeof(zeros)));
+    encodedLength = LeafFrame_Encode(LeafFrame_Config, 0xFFFF, ones, sizeof(ones), encoded, sizeof(encoded));
+    CHECK(encodedLength > 0 && LeafFrame_Decode(encoded, encodedLength, &frame));
+    CHECK(SameFrame(&frame, LeafFrame_Config, 0xFFFF, ones, sizeof(ones)));
+}
+
+static void TestEncodeLimits(void)
+{
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD + 1] = {0};
+    uint8_t encoded[LEAF_FRAME_MAX_ENCODED + 8];
+    CHECK(LeafFrame_Encode(LeafFrame_SensorSample, 1, payload, LEAF_FRAME_MAX_PAYLOAD + 1, encoded,
+              sizeof(encoded)) == 0);
+    CHECK(LeafFrame_Encode(LeafFrame_SensorSample, 1, payload, 8, encoded, LEAF_FRAME_OVERHEAD + 8 + 2) == 0);
+    CHECK(LeafFrame_Encode(LeafFrame_SensorSample, 1, payload, 8, encoded, LEAF_FRAME_OVERHEAD + 8 + 3) > 0);
+}
+
+static void TestStreamedFrames(void)
+{
+    // Three frames back to back, plus an extra delimiter, cut into reads of every size.
+    uint8_t stream[3 * LEAF_FRAME_MAX_ENCODED + 1];
+    size_t streamLength = 0;
+    uint8_t payloads[3][LEAF_FRAME_MAX_PAYLOAD];
+    const size_t lengths[3] = {0, 13, LEAF_FRAME_MAX_PAYLOAD};
+    for (int i = 0; i < 3; i++) {
+        FillPayload(payloads[i], lengths[i], (unsigned int)(i * 11));
+        streamLength += LeafFrame_Encode(LeafFrame_SensorSample, (uint16_t)(100 + i), payloads[i], lengths[i],
+            stream + streamLength, sizeof(stream) - streamLength);
+    }
+    stream[streamLength++] = 0;
+
+    for (size_t readSize = 1; readSize <= streamLength; readSize++) {
+        LeafFrameDecoder decoder;
+        LeafFrameDecoder_Init(&decoder);
+        int received = 0;
+        for (size_t offset = 0; offset < streamLength; offset += readSize) {
+            size_t length = streamLength - offset < readSize ? streamLength - offset : readSize;
+            for (size_t i = 0; i < length; i++) {
+                LeafFrame frame;
+                if (LeafFrameDecoder_Push(&decoder, stream[offset + i], &frame)) {
+                    CHECK(received < 3);
+                    if (received < 3) {
+                        CHECK(SameFrame(&frame, LeafFrame_SensorSample, (uint16_t)(100 + received),
+                            payloads[received], lengths[received]));
+                    }
+                    received++;
+                }
+            }
+        }
+        CHECK(received == 3);
+        CHECK(decoder.stats.frames == 3);
+        CHECK(decoder.stats.malformed == 0 && decoder.stats.crcErrors == 0 && decoder.stats.oversized == 0);
+    }
+
+    // Reset drops the part of a frame received so far.
+    LeafFrameDecoder decoder;
+    LeafFrameDecoder_Init(&decoder);
+    LeafFrame frame;
+    size_t firstLength = LEAF_FRAME_OVERHEAD + 3;
+    CHECK(PushBytes(&decoder, stream, firstLength / 2, &frame) == 0);
+    LeafFrameDecoder_Reset(&decoder);
+    CHECK(PushBytes(&decoder, stream, streamLength, &frame) == 3);
+}
+
+static void TestCorruption(void)
+{
+    uint8_t encoded[LEAF_FRAME_MAX_ENCODED];
+    uint16_t sequence;
+    size_t length = EncodeWithoutZeros(encoded, sizeof(encoded), &sequence);
+    CHECK(length > 0);
+    if (length == 0) {
+        return;
+    }
+
+    // Each flipped data byte, header, payload or CRC, is a CRC error.
+    for (size_t i = 2; i < length - 1; i++) {
+        uint8_t damaged[LEAF_FRAME_MAX_ENCODED];
+        memcpy(damaged, encoded, length);
+        damaged[i] ^= (damaged[i] == 0x01) ? 0x02 : 0x01;
+        LeafFrameDecoder decoder;
+        LeafFrameDecoder_Init(&decoder);
+        LeafFrame frame;
+        CHECK(PushBytes(&decoder, damaged, length, &frame) == 0);
+        CHECK(decoder.stats.crcErrors == 1 && decoder.stats.frames == 0);
+    }
+
+    // A COBS code pointing past the end of the frame.
+    uint8_t damaged[LEAF_FRAME_MAX_ENCODED];
+    memcpy(damaged, encoded, length);
+    damaged[1] = (uint8_t)(length + 1);
+    LeafFrameDecoder decoder;
+    LeafFrameDecoder_Init(&decoder);
+    LeafFrame frame;
+    CHECK(PushBytes(&decoder, damaged, length, &frame) == 0);
+    CHECK(decoder.stats.malformed == 1);
+    CHECK(!LeafFrame_Decode(damaged, length, &frame));
+
+    // A frame cut short by a stray delimiter: neither half is a frame, the next one is.
+    memcpy(damaged, encoded, length);
+    damaged[length / 2] = 0;
+    LeafFrameDecoder_Init(&decoder);
+    CHECK(PushBytes(&decoder, damaged, length, &frame) == 0);
+    CHECK(decoder.stats.malformed + decoder.stats.crcErrors == 2);
+    CHECK(PushBytes(&decoder, encoded, length, &frame) == 1);
+    CHECK(frame.sequence == sequence);
+
+    // Too short to hold a header and CRC.
+    const uint8_t tiny[] = {0, 0x03, 0x01, 0x02, 0};
+    LeafFrameDecoder_Init(&decoder);
+    CHECK(PushBytes(&decoder, tiny, sizeof(tiny), &frame) == 0);
+    CHECK(decoder.stats.malformed == 1);
+}
+
+static void TestOversized(void)
+{
+    LeafFrameDecoder decoder;
+    LeafFrameDecoder_Init(&decoder);
+    LeafFrame frame;
+    CHECK(!LeafFrameDecoder_Push(&decoder, 0, &frame));
+    for (size_t i = 0; i < LEAF_FRAME_MAX_ENCODED + 10; i++) {
+        CHECK(!LeafFrameDecoder_Push(&decoder, 0x5A, &frame));
+    }
+    CHECK(!LeafFrameDecoder_Push(&decoder, 0, &frame));
+    CHECK(decoder.stats.oversized == 1 && decoder.stats.malformed == 0 && decoder.stats.crcErrors == 0);
+
+    // The decoder picks up again at the next frame.
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    uint8_t encoded[LEAF_FRAME_MAX_ENCODED];
+    FillPayload(payload, sizeof(payload), 7);
+    size_t length = LeafFrame_Encode(LeafFrame_SensorSample, 42, payload, sizeof(payload), encoded, sizeof(encoded));
+    CHECK(PushBytes(&decoder, encoded, length, &frame) == 1);
+    CHECK(SameFrame(&frame, LeafFrame_SensorSample, 42, payload, sizeof(payload)));
+}
+
+static void TestMotorOrders(void)
+{
+    uint8_t payload[LEAF_FRAME_MAX_PAYLOAD];
+    char orders[32];
+
+    size_t length = LeafFrame_WriteMotorOrders("LF150;RS", payload, sizeof(payload));
+    CHECK(length == 6);
+    const uint8_t expected[] = {'L', 'F', 150, 'R', 'S', 0};
+    CHECK(memcmp(payload, expected, sizeof(expected)) == 0);
+    CHECK(LeafFrame_ReadMotorOrders(payload, length, orders, sizeof(orders)));
+    CHECK(strcmp(orders, "LF150;RS000") == 0);
+
+    CHECK(LeafFrame_WriteMotorOrders(" LR255 ; RB000;", payload, sizeof(payload)) == 6);
+    CHECK(LeafFrame_ReadMotorOrders(payload, 6, orders, sizeof(orders)));
+    CHECK(strcmp(orders, "LR255;RB000") == 0);
+    CHECK(LeafFrame_WriteMotorOrders("", payload, sizeof(payload)) == 0);
+
+    // Malformed orders, and orders that do not fit.
+    CHECK(LeafFrame_WriteMotorOrders("XF100", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("LX100", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("L", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("LF15", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("LF1500", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("LF256", payload, sizeof(payload)) == 0);
+    CHECK(LeafFrame_WriteMotorOrders("LF100;RF100", payload, 5) == 0);
+
+    CHECK(!LeafFrame_ReadMotorOrders(payload, 4, orders, sizeof(orders)));
+    CHECK(!LeafFrame_ReadMotorOrders(expected, sizeof(expected), orders, 6));
+    CHECK(!LeafFrame_ReadMotorOrders(expected, sizeof(expected), orders, 0));
+    CHECK(LeafFrame_ReadMotorOrders(expected, 0, orders, 1) && orders[0] == '\0');
+
+    // Through a frame, as the gateway sends it.
+    uint8_t encoded[LEAF_FRAME_MAX_ENCODED];
+    LeafFrame frame;
+    length = LeafFrame_WriteMotorOrders("LB;RF090", payload, sizeof(payload));
+    size_t encodedLength = LeafFrame_Encode(LeafFrame_MotorCommand, 7, payload, length, encoded, sizeof(encoded));
+    CHECK(LeafFrame_Decode(encoded, encodedLength, &frame) && frame.type == LeafFrame_MotorCommand);
+    CHECK(LeafFrame_ReadMotorOrders(frame.payload, frame.length, orders, sizeof(orders)));
+    CHECK(strcmp(orders, "LB000;RF090") == 0);
+}
+
+int main(void)
+{
+    TestRoundTrip();
+    TestEncodeLimits();
+    TestStreamedFrames();
+    TestCorruption();
+    TestOversized();
+    TestMotorOrders();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("leaf_protocol_test passed\n");
+    return 0;
+}
@@ -0,0 +1,285 @@
+// Checks the motor order coalescer together with the UART command queue, driven the way
+// SubmitMotorCommand and ReleaseMotorOrders in main.c drive them, with text protocol commands.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "motor_command_coalescer.h"
+#include "uart_command_queue.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                            \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+static UartCommandQueue queue;
+
+/// <summary>
+/// Takes back the unwritten commands of halted motors, restages their other orders and queues
+/// the halt ahead of everything not yet written, as SubmitMotorCommand does.
+/// </summary>
+static int Submit(const char* command)
+{
+    char halt[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int haltChannels;
+    int count = MotorCoalescer_Submit(command, halt, sizeof(halt), &haltChannels);
+    if (count <= 0 || haltChannels == 0) {
+        return count;
+    }
+    UartCommand superseded;
+    while (UartCommandQueue_TakeUnstarted(&queue, haltChannels, &superseded)) {
+        MotorCoalescer_Restore((const char*)superseded.data, haltChannels);
+    }
+    CHECK(UartCommandQueue_PushTagged(&queue, halt, strlen(halt) + 1, haltChannels, true, NULL));
+    return count;
+}
+
+/// <summary>
+/// Queues the pending drive orders as one command, as ReleaseMotorOrders does once the window
+/// has passed.
+/// </summary>
+static void Release(const struct timespec* now)
+{
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int channels = MotorCoalescer_Take(now, command, sizeof(command));
+    if (channels != 0) {
+        CHECK(UartCommandQueue_PushTagged(&queue, command, strlen(command) + 1, channels, false, NULL));
+    }
+}
+
+/// <summary>
+/// Joins the queued commands, front first, with '|' between them.
+/// </summary>
+static const char* Queued(void)
+{
+    static char text[UART_COMMAND_QUEUE_CAPACITY * MOTOR_COMMAND_MAX_BYTES];
+    UartCommandQueue copy = queue;
+    const UartCommand* command;
+    text[0] = '\0';
+    while ((command = UartCommandQueue_Front(&copy)) != NULL) {
+        if (text[0] != '\0') {
+            strcat(text, "|");
+        }
+        strcat(text, (const char*)command->data);
+        UartCommandQueue_Drop(&copy);
+    }
+    return text;
+}
+
+static void Reset(void)
+{
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    struct timespec now = {0, 0};
+    MotorCoalescer_Take(&now, command, sizeof(command));
+    UartCommandQueue_Init(&queue);
+}
+
+static void TestCoalescing(void)
+{
+    MotorCoalescerStats before;
+    MotorCoalescerStats after;
+    struct timespec now = {10, 0};
+    Reset();
+    MotorCoalescer_GetStats(&before);
+    CHECK(MotorCoalescer_GetDelay(&now) == -1);
+
+    // Nothing was released yet, so the first orders may go at once; the newest per motor wins.
+    CHECK(Submit("LF100") == 1);
+    CHECK(MotorCoalescer_GetDelay(&now) == 0);
+    CHECK(Submit(" LF120 ; ;RF050 ") == 2);
+    CHECK(MotorCoalescer_GetPendingCount() == 2);
+    Release(&now);
+    CHECK(strcmp(Queued(), "LF120;RF050") == 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 0);
+
+    // Orders inside the window wait for it and are merged meanwhile.
+    struct timespec soon = {10, 30000000};
+    CHECK(Submit("RR010") == 1);
+    CHECK(MotorCoalescer_GetDelay(&soon) == 70);
+    CHECK(Submit("RR020") == 1);
+    struct timespec later = {10, 100000000};
+    CHECK(MotorCoalescer_GetDelay(&later) == 0);
+    Release(&later);
+    CHECK(strcmp(Queued(), "LF120;RF050|RR020") == 0);
+
+    MotorCoalescer_GetStats(&after);
+    CHECK(after.orders - before.orders == 5);
+    CHECK(after.coalesced - before.coalesced == 2);
+    CHECK(after.released - before.released == 2);
+    CHECK(after.halts == before.halts);
+
+    // A zero window only merges orders waiting for the UART; negative windows mean zero.
+    MotorCoalescer_SetWindow(0);
+    CHECK(MotorCoalescer_GetWindow() == 0);
+    CHECK(Submit("LF010") == 1);
+    CHECK(MotorCoalescer_GetDelay(&later) == 0);
+    MotorCoalescer_SetWindow(-5);
+    CHECK(MotorCoalescer_GetWindow() == 0);
+    MotorCoalescer_SetWindow(100);
+}
+
+static void TestInvalidCommands(void)
+{
+    static const char* const invalid[] = {
+        "LX100", "LF10", "XF100", "LF100;RF1000", "lf100", "LB;LB;LB;LB;LB;LB;LB;LB;LB"};
+    MotorCoalescerStats before;
+    MotorCoalescerStats after;
+    char halt[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int haltChannels;
+    Reset();
+    CHECK(Submit("LF100") == 1);
+    MotorCoalescer_GetStats(&before);
+
+    // A malformed order rejects the whole command, halts included.
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        CHECK(MotorCoalescer_Submit(invalid[i], halt, sizeof(halt), &haltChannels) == -1);
+        CHECK(haltChannels == 0 && halt[0] == '\0');
+    }
+    CHECK(MotorCoalescer_Submit("", halt, sizeof(halt), &haltChannels) == 0);
+    MotorCoalescer_GetStats(&after);
+    CHECK(after.invalid - before.invalid == sizeof(invalid) / sizeof(invalid[0]));
+    CHECK(after.orders == before.orders && after.halts == before.halts);
+
+    struct timespec now = {20, 0};
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_BIT(MotorChannel_Left));
+    CHECK(strcmp(command, "LF100") == 0);
+}
+
+static void TestHalts(void)
+{
+    MotorCoalescerStats before;
+    MotorCoalescerStats after;
+    char halt[MOTOR_COMMAND_MAX_BYTES];
+    unsigned int haltChannels;
+    Reset();
+    MotorCoalescer_GetStats(&before);
+
+    // The last halt per motor is sent; drive orders of other motors stay pending.
+    CHECK(MotorCoalescer_Submit("LF100;RS;RB", halt, sizeof(halt), &haltChannels) == 3);
+    CHECK(strcmp(halt, "RB") == 0);
+    CHECK(haltChannels == MOTOR_CHANNEL_BIT(MotorChannel_Right));
+    CHECK(MotorCoalescer_GetPendingCount() == 1);
+
+    // A halt cancels the motor's pending order; a drive order after it waits for the window.
+    CHECK(MotorCoalescer_Submit("LS;RB;LF050", halt, sizeof(halt), &haltChannels) == 3);
+    CHECK(strcmp(halt, "LS;RB") == 0);
+    CHECK(haltChannels == MOTOR_CHANNEL_ALL);
+    struct timespec now = {30, 0};
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_BIT(MotorChannel_Left));
+    CHECK(strcmp(command, "LF050") == 0);
+
+    MotorCoalescer_GetStats(&after);
+    CHECK(after.orders - before.orders == 6);
+    CHECK(after.halts - before.halts == 4);
+    CHECK(after.coalesced - before.coalesced == 1);
+}
+
+static void TestHaltJumpsQueue(void)
+{
+    struct timespec now = {40, 0};
+    Reset();
+    CHECK(Submit("LF100") == 1);
+    Release(&now);
+    CHECK(Submit("RS") == 1);
+    // Other motors' commands are not taken back, only overtaken.
+    CHECK(strcmp(Queued(), "RS|LF100") == 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 0);
+
+    // The halted motor's unsent command comes back without it and goes out after the halt.
+    Reset();
+    CHECK(Submit("LF100;RF100") == 2);
+    Release(&now);
+    CHECK(Submit("RB") == 1);
+    CHECK(strcmp(Queued(), "RB") == 0);
+    struct timespec later = {41, 0};
+    Release(&later);
+    CHECK(strcmp(Queued(), "RB|LF100") == 0);
+
+    // A command the UART has started on is left alone and finishes before the halt.
+    Reset();
+    CHECK(Submit("LF100;RF100") == 2);
+    Release(&now);
+    UartCommandQueue_Advance(&queue, 1);
+    CHECK(Submit("LB;RB") == 2);
+    CHECK(strcmp(Queued(), "LF100;RF100|LB;RB") == 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 0);
+}
+
+static void TestRestore(void)
+{
+    struct timespec now = {50, 0};
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    Reset();
+
+    // Halts in the taken back command are not staged again.
+    MotorCoalescer_Restore("LF100;RB;RF050", 0);
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_ALL);
+    CHECK(strcmp(command, "LF100;RF050") == 0);
+
+    MotorCoalescer_Restore("LF100;RF050", MOTOR_CHANNEL_BIT(MotorChannel_Right));
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_BIT(MotorChannel_Left));
+    CHECK(strcmp(command, "LF100") == 0);
+
+    // A newer pending order wins over the restored one.
+    CHECK(Submit("LF200") == 1);
+    MotorCoalescer_Restore("LF100;RF100", 0);
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_ALL);
+    CHECK(strcmp(command, "LF200;RF100") == 0);
+
+    // Malformed commands restore nothing.
+    MotorCoalescer_Restore("LF100;XF100", 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 0);
+
+    // Discard drops pending orders, e.g. for a motor plan.
+    CHECK(Submit("LF100;RF100") == 2);
+    MotorCoalescer_Discard(MOTOR_CHANNEL_BIT(MotorChannel_Left));
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_BIT(MotorChannel_Right));
+    CHECK(strcmp(command, "RF100") == 0);
+}
+
+static void TestQueuedHaltSurvivesLaterHalt(void)
+{
+    // The web app stops both motors, then brakes the left one before the first halt went out.
+    Reset();
+    CHECK(Submit("LB;RB") == 2);
+    CHECK(Submit("LB") == 1);
+    CHECK(strcmp(Queued(), "LB;RB|LB") == 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 0);
+
+    // A drive order queued between the halts is still taken back.
+    struct timespec now = {100, 0};
+    Reset();
+    CHECK(Submit("LB;RB") == 2);
+    CHECK(Submit("LF100;RF100") == 2);
+    Release(&now);
+    CHECK(strcmp(Queued(), "LB;RB|LF100;RF100") == 0);
+    CHECK(Submit("LB") == 1);
+    CHECK(strcmp(Queued(), "LB;RB|LB") == 0);
+    CHECK(MotorCoalescer_GetPendingCount() == 1);
+    char command[MOTOR_COMMAND_MAX_BYTES];
+    CHECK(MotorCoalescer_Take(&now, command, sizeof(command)) == MOTOR_CHANNEL_BIT(MotorChannel_Right));
+    CHECK(strcmp(command, "RF100") == 0);
+}
+
+int main(void)
+{
+    TestCoalescing();
+    TestInvalidCommands();
+    TestHalts();
+    TestHaltJumpsQueue();
+    TestRestore();
+    TestQueuedHaltSurvivesLaterHalt();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("motor_command_coalescer_test passed\n");
+    return 0;
+}
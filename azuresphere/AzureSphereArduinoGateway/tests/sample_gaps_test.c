@@ -0,0 +1,120 @@
+// Walks sample_gaps through one leaf session: gaps in the live stream, backfill of the missing
+// samples, gaps leaving the window and a leaf restart. The module keeps its state between
+// steps, so they run in order and check the running totals.
+#include <stdio.h>
+
+#include "leaf_protocol.h"
+#include "sample_gaps.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                            \
+    do {                                                                            \
+        if (!(condition)) {                                                         \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                             \
+        }                                                                           \
+    } while (0)
+
+static bool StatsAre(unsigned long missed, unsigned long recovered, unsigned long lost, unsigned long duplicates,
+    unsigned long restarts)
+{
+    SampleGapsStats stats;
+    SampleGaps_GetStats(&stats);
+    return stats.missed == missed && stats.recovered == recovered && stats.lost == lost
+        && stats.duplicates == duplicates && stats.restarts == restarts;
+}
+
+static void TestGapDetection(void)
+{
+    uint32_t first;
+    CHECK(!SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first));
+    CHECK(!SampleGaps_Resent(100));
+
+    // Nothing before the first sample counts as missing.
+    CHECK(!SampleGaps_Live(100));
+    CHECK(!SampleGaps_Live(101));
+    CHECK(!SampleGaps_Live(102));
+    CHECK(!SampleGaps_FirstMissing(SAMPLE_GAPS_WINDOW, &first));
+
+    CHECK(SampleGaps_Live(105));
+    CHECK(StatsAre(2, 0, 0, 0, 0));
+    CHECK(SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first) && first == 103);
+    CHECK(!SampleGaps_FirstMissing(1, &first));
+}
+
+static void TestBackfill(void)
+{
+    uint32_t first;
+    CHECK(SampleGaps_Resent(103));
+    CHECK(SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first) && first == 104);
+    CHECK(!SampleGaps_Resent(103));
+    CHECK(!SampleGaps_Resent(102));
+    CHECK(!SampleGaps_Resent(106));
+    CHECK(StatsAre(2, 1, 0, 2, 0));
+
+    CHECK(SampleGaps_Resent(104));
+    CHECK(!SampleGaps_FirstMissing(SAMPLE_GAPS_WINDOW, &first));
+    CHECK(StatsAre(2, 2, 0, 2, 0));
+}
+
+static void TestWindowWrap(void)
+{
+    uint32_t first;
+    CHECK(!SampleGaps_Live(106));
+    CHECK(!SampleGaps_Live(107));
+    CHECK(SampleGaps_Live(109));
+    CHECK(StatsAre(3, 2, 0, 2, 0));
+
+    // 108 is pushed out of the window by 140 and lost; 110 to 139 are missed but still held.
+    CHECK(SampleGaps_Live(109 + SAMPLE_GAPS_WINDOW - 1));
+    CHECK(StatsAre(33, 2, 1, 2, 0));
+    CHECK(SampleGaps_FirstMissing(SAMPLE_GAPS_WINDOW, &first) && first == 110);
+    // Only as far back as the leaf's history reaches.
+    CHECK(SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first) && first == 140 - (LEAF_SAMPLE_HISTORY - 1));
+
+    // A jump past the whole window loses what it held and the skipped samples that do not fit.
+    CHECK(SampleGaps_Live(180));
+    CHECK(StatsAre(72, 2, 1 + 30 + 8, 2, 0));
+    CHECK(!SampleGaps_Resent(140));
+    CHECK(!SampleGaps_Resent(148));
+    CHECK(SampleGaps_Resent(149));
+    CHECK(SampleGaps_FirstMissing(SAMPLE_GAPS_WINDOW, &first) && first == 150);
+    CHECK(StatsAre(72, 3, 39, 2, 0));
+}
+
+static void TestRestart(void)
+{
+    uint32_t first;
+    // The sequence going backwards is a restart: what is still missing is lost, not fetched.
+    CHECK(!SampleGaps_Live(5));
+    CHECK(StatsAre(72, 3, 39 + 30, 2, 1));
+    CHECK(!SampleGaps_FirstMissing(SAMPLE_GAPS_WINDOW, &first));
+    CHECK(!SampleGaps_Resent(179));
+    // Sequences before the restart's first sample count as having arrived.
+    CHECK(!SampleGaps_Resent(4));
+    CHECK(StatsAre(72, 3, 69, 3, 1));
+
+    CHECK(SampleGaps_Live(7));
+    CHECK(SampleGaps_FirstMissing(LEAF_SAMPLE_HISTORY, &first) && first == 6);
+    CHECK(SampleGaps_Resent(6));
+    CHECK(StatsAre(73, 4, 69, 3, 1));
+
+    // A repeated live sequence is a restart too.
+    CHECK(!SampleGaps_Live(7));
+    CHECK(StatsAre(73, 4, 69, 3, 2));
+}
+
+int main(void)
+{
+    TestGapDetection();
+    TestBackfill();
+    TestWindowWrap();
+    TestRestart();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("sample_gaps_test passed\n");
+    return 0;
+}
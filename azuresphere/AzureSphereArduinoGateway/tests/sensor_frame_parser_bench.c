@@ -0,0 +1,75 @@
+// Compares SensorFrame_Parse with the sscanf call it replaced, on the line the sketch sends.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensor_frame_parser.h"
+
+static const char sensorLine[] = "sensors:temp=23.45,humi=47,pres=101325,alti=123.46:";
+
+static volatile float sink;
+
+// The parser scales an integer mantissa, so it may differ from strtof in the last bit.
+static int Close(float a, float b)
+{
+    return fabsf(a - b) <= 1e-6f * fabsf(b);
+}
+
+static double SecondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/// <summary>
+/// The original path: copy the line, cut it at the last ':' and sscanf it.
+/// </summary>
+static void ParseWithSscanf(const char* line, size_t length, SensorFrame* frame)
+{
+    char buffer[128];
+    memcpy(buffer, line, length + 1);
+    char* colon = strrchr(buffer, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+    }
+    sscanf(buffer, "sensors:temp=%f,humi=%f,pres=%f,alti=%f", &frame->temperature, &frame->humidity,
+        &frame->pressure, &frame->altitude);
+}
+
+int main(int argc, char* argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t length = strlen(sensorLine);
+    SensorFrame oldFrame, newFrame;
+
+    ParseWithSscanf(sensorLine, length, &oldFrame);
+    if (SensorFrame_Parse(sensorLine, length, &newFrame) != SensorFrame_Ok || newFrame.fields != SENSOR_FIELDS_ALL
+        || !Close(oldFrame.temperature, newFrame.temperature) || !Close(oldFrame.humidity, newFrame.humidity)
+        || !Close(oldFrame.pressure, newFrame.pressure) || !Close(oldFrame.altitude, newFrame.altitude)) {
+        fprintf(stderr, "parsers disagree on \"%s\"\n", sensorLine);
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        ParseWithSscanf(sensorLine, length, &oldFrame);
+        sink = oldFrame.altitude;
+    }
+    double sscanfSeconds = SecondsSince(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        SensorFrame_Parse(sensorLine, length, &newFrame);
+        sink = newFrame.altitude;
+    }
+    double parserSeconds = SecondsSince(&start);
+
+    printf("sscanf:            %8.1f ns/frame\n", sscanfSeconds * 1e9 / (double)iterations);
+    printf("SensorFrame_Parse: %8.1f ns/frame (%.1fx)\n", parserSeconds * 1e9 / (double)iterations,
+        sscanfSeconds / parserSeconds);
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <string.h>
+
+#include "uart_command_queue.h"
+
+void UartCommandQueue_Init(UartCommandQueue* queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->nextSequence = 1;
+}
+
+static UartCommand* Slot(UartCommandQueue* queue, size_t index)
+{
+    return &queue->slots[(queue->head + index) % UART_COMMAND_QUEUE_CAPACITY];
+}
+
+bool UartCommandQueue_Push(UartCommandQueue* queue, const void* data, size_t length, uint32_t* sequence)
+{
+    return UartCommandQueue_PushTagged(queue, data, length, 0, false, sequence);
+}
+
+bool UartCommandQueue_PushTagged(UartCommandQueue* queue, const void* data, size_t length, unsigned int tag,
+    bool urgent, uint32_t* sequence)
+{
+    if (queue->count == UART_COMMAND_QUEUE_CAPACITY || length == 0 || length > UART_COMMAND_MAX_BYTES) {
+        queue->stats.rejected++;
+        return false;
+    }
+
+    size_t position = queue->count;
+    if (urgent) {
+        // Skip the command being written and urgent ones, then shift the rest back.
+        position = 0;
+        while (position < queue->count && (Slot(queue, position)->written > 0 || Slot(queue, position)->urgent)) {
+            position++;
+        }
+        for (size_t i = queue->count; i > position; i--) {
+            *Slot(queue, i) = *Slot(queue, i - 1);
+        }
+    }
+    UartCommand* command = Slot(queue, position);
+    command->sequence = queue->nextSequence++;
+    clock_gettime(CLOCK_MONOTONIC, &command->enqueuedAt);
+    command->tag = tag;
+    command->urgent = urgent;
+    command->length = length;
+    command->written = 0;
+    memcpy(command->data, data, length);
+    queue->count++;
+
+    queue->stats.enqueued++;
+    if (queue->count > queue->stats.maxDepth) {
+        queue->stats.maxDepth = queue->count;
+    }
+    if (sequence != NULL) {
+        *sequence = command->sequence;
+    }
+    return true;
+}
+
+bool UartCommandQueue_TakeUnstarted(UartCommandQueue* queue, unsigned int tagMask, UartCommand* command)
+{
+    for (size_t i = 0; i < queue->count; i++) {
+        const UartCommand* candidate = Slot(queue, i);
+        if (candidate->written > 0 || candidate->urgent || (candidate->tag & tagMask) == 0) {
+            continue;
+        }
+        if (command != NULL) {
+            *command = *candidate;
+        }
+        for (size_t j = i + 1; j < queue->count; j++) {
+            *Slot(queue, j - 1) = *Slot(queue, j);
+        }
+        queue->count--;
+        return true;
+    }
+    return false;
+}
+
+bool UartCommandQueue_HasUnstarted(const UartCommandQueue* queue, unsigned int tagMask)
+{
+    for (size_t i = 0; i < queue->count; i++) {
+        const UartCommand* command = &queue->slots[(queue->head + i) % UART_COMMAND_QUEUE_CAPACITY];
+        if (command->written == 0 && (command->tag & tagMask) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const UartCommand* UartCommandQueue_Front(const UartCommandQueue* queue)
+{
+    return queue->count > 0 ? &queue->slots[queue->head] : NULL;
+}
+
+void UartCommandQueue_Drop(UartCommandQueue* queue)
+{
+    if (queue->count == 0) {
+        return;
+    }
+    queue->head = (queue->head + 1) % UART_COMMAND_QUEUE_CAPACITY;
+    queue->count--;
+    queue->stats.failed++;
+}
+
+void UartCommandQueue_Advance(UartCommandQueue* queue, size_t bytes)
+{
+    if (queue->count == 0) {
+        return;
+    }
+    UartCommand* command = &queue->slots[queue->head];
+    command->written += bytes;
+    if (command->written < command->length) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latencyMilliseconds = (now.tv_sec - command->enqueuedAt.tv_sec) * 1000L
+        + (now.tv_nsec - command->enqueuedAt.tv_nsec) / 1000000L;
+    if (latencyMilliseconds > queue->stats.maxLatencyMilliseconds) {
+        queue->stats.maxLatencyMilliseconds = latencyMilliseconds;
+    }
+    queue->head = (queue->head + 1) % UART_COMMAND_QUEUE_CAPACITY;
+    queue->count--;
+    queue->stats.completed++;
+}
+
+size_t UartCommandQueue_GetDepth(const UartCommandQueue* queue)
+{
+    return queue->count;
+}
+
+void UartCommandQueue_GetStats(const UartCommandQueue* queue, UartCommandQueueStats* stats)
+{
+    *stats = queue->stats;
+    stats->depth = queue->count;
+}
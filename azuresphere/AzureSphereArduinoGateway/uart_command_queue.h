@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/// <summary>
+/// Number of commands the queue can hold.
+/// </summary>
+#define UART_COMMAND_QUEUE_CAPACITY 16
+
+/// <summary>
+/// Longest command, including any terminator, the queue accepts.
+/// </summary>
+#define UART_COMMAND_MAX_BYTES 128
+
+/// <summary>
+/// One command for the leaf device, stamped when it was queued.
+/// </summary>
+typedef struct {
+    uint32_t sequence;
+    struct timespec enqueuedAt;
+    unsigned int tag; // caller defined bits, e.g. the motors a command drives
+    bool urgent;
+    size_t length;
+    size_t written; // bytes already handed to the UART
+    unsigned char data[UART_COMMAND_MAX_BYTES];
+} UartCommand;
+
+typedef struct {
+    unsigned long enqueued;
+    unsigned long rejected;  // queue full or command too long
+    unsigned long completed;
+    unsigned long failed;    // dropped after a write error
+    size_t depth;
+    size_t maxDepth;
+    long maxLatencyMilliseconds; // from queued to completely written
+} UartCommandQueueStats;
+
+/// <summary>
+/// FIFO of commands waiting to be written to the UART. Used from the event loop thread only:
+/// method handlers push, the UART writable handler writes the front command and advances.
+/// </summary>
+typedef struct {
+    UartCommand slots[UART_COMMAND_QUEUE_CAPACITY];
+    size_t head;  // slot of the front command
+    size_t count;
+    uint32_t nextSequence;
+    UartCommandQueueStats stats;
+} UartCommandQueue;
+
+void UartCommandQueue_Init(UartCommandQueue* queue);
+
+/// <summary>
+/// Copies a command to the back of the queue. Never blocks.
+/// </summary>
+/// <returns>false if the queue is full or the command longer than UART_COMMAND_MAX_BYTES;
+/// otherwise true, with the command's sequence number in sequence if it is not NULL.</returns>
+bool UartCommandQueue_Push(UartCommandQueue* queue, const void* data, size_t length, uint32_t* sequence);
+
+/// <summary>
+/// Like <see cref="UartCommandQueue_Push" />, with a tag for
+/// <see cref="UartCommandQueue_TakeUnstarted" />. An urgent command goes ahead of every
+/// command that has not started writing yet, behind earlier urgent ones.
+/// </summary>
+bool UartCommandQueue_PushTagged(UartCommandQueue* queue, const void* data, size_t length, unsigned int tag,
+    bool urgent, uint32_t* sequence);
+
+/// <summary>
+/// Removes the oldest command whose tag shares a bit with tagMask and whose writing has not
+/// started, copying it to command if it is not NULL. Urgent commands are never taken back.
+/// </summary>
+/// <returns>false if there is no such command.</returns>
+bool UartCommandQueue_TakeUnstarted(UartCommandQueue* queue, unsigned int tagMask, UartCommand* command);
+
+/// <summary>
+/// Whether a command whose tag shares a bit with tagMask is still waiting to be written.
+/// </summary>
+bool UartCommandQueue_HasUnstarted(const UartCommandQueue* queue, unsigned int tagMask);
+
+/// <summary>
+/// The command being written, or NULL when the queue is empty.
+/// </summary>
+const UartCommand* UartCommandQueue_Front(const UartCommandQueue* queue);
+
+/// <summary>
+/// Records bytes of the front command as written, removing it once it is complete.
+/// </summary>
+void UartCommandQueue_Advance(UartCommandQueue* queue, size_t bytes);
+
+/// <summary>
+/// Removes the front command without completing it, e.g. after a write error.
+/// </summary>
+void UartCommandQueue_Drop(UartCommandQueue* queue);
+
+size_t UartCommandQueue_GetDepth(const UartCommandQueue* queue);
+void UartCommandQueue_GetStats(const UartCommandQueue* queue, UartCommandQueueStats* stats);
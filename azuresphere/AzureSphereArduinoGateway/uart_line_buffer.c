@@ -0,0 +1,71 @@
+#include <string.h>
+
+#include "uart_line_buffer.h"
+
+#define UART_LINE_BUFFER_MASK (UART_LINE_BUFFER_CAPACITY - 1)
+
+void UartLineBuffer_Init(UartLineBuffer* buffer)
+{
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+size_t UartLineBuffer_Append(UartLineBuffer* buffer, const char* data, size_t length)
+{
+    size_t space = UART_LINE_BUFFER_CAPACITY - (buffer->head - buffer->tail);
+    if (length > space) {
+        length = space;
+    }
+    for (size_t i = 0; i < length; i++) {
+        buffer->data[(buffer->head + i) & UART_LINE_BUFFER_MASK] = data[i];
+    }
+    buffer->head += length;
+    return length;
+}
+
+static bool IsLineTerminator(char c)
+{
+    return c == '\r' || c == '\n';
+}
+
+int UartLineBuffer_NextLine(UartLineBuffer* buffer, char* line, size_t lineSize)
+{
+    while (buffer->scanned != buffer->head) {
+        char c = buffer->data[buffer->scanned & UART_LINE_BUFFER_MASK];
+        buffer->scanned++;
+        if (!IsLineTerminator(c)) {
+            continue;
+        }
+
+        size_t start = buffer->tail;
+        size_t length = buffer->scanned - 1 - start;
+        buffer->tail = buffer->scanned;
+
+        if (buffer->discarding) {
+            buffer->discarding = false;
+            continue;
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (length >= lineSize) {
+            buffer->overflowCount++;
+            continue;
+        }
+        for (size_t i = 0; i < length; i++) {
+            line[i] = buffer->data[(start + i) & UART_LINE_BUFFER_MASK];
+        }
+        line[length] = '\0';
+        return (int)length;
+    }
+
+    // A full ring without a terminator can never complete its line, so drop it and
+    // skip the rest of that line once it arrives.
+    if (buffer->head - buffer->tail == UART_LINE_BUFFER_CAPACITY) {
+        if (!buffer->discarding) {
+            buffer->overflowCount++;
+        }
+        buffer->tail = buffer->head;
+        buffer->discarding = true;
+    }
+    return -1;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// <summary>
+/// Size of the receive ring. Must be a power of two and larger than the longest frame.
+/// </summary>
+#define UART_LINE_BUFFER_CAPACITY 256
+
+/// <summary>
+/// Ring buffer which accumulates arbitrary sized UART reads and splits them into
+/// lines terminated by CR and/or LF. Empty lines are skipped.
+/// </summary>
+typedef struct {
+    char data[UART_LINE_BUFFER_CAPACITY];
+    size_t head;    // total bytes written
+    size_t tail;    // start of the line being assembled
+    size_t scanned; // bytes up to here have been checked for a terminator
+    bool discarding; // an over-long line is being dropped up to its terminator
+    unsigned long overflowCount;
+} UartLineBuffer;
+
+/// <summary>
+/// Resets the buffer to empty.
+/// </summary>
+void UartLineBuffer_Init(UartLineBuffer* buffer);
+
+/// <summary>
+/// Copies as many bytes as fit into the ring.
+/// </summary>
+/// <returns>The number of bytes accepted. Call <see cref="UartLineBuffer_NextLine" />
+/// to make room when fewer than length bytes were accepted.</returns>
+size_t UartLineBuffer_Append(UartLineBuffer* buffer, const char* data, size_t length);
+
+/// <summary>
+/// Takes the next complete line out of the ring and copies it, NUL terminated and
+/// without its terminator, into line. Lines that do not fit into lineSize, or into the
+/// ring itself, are dropped and counted in overflowCount.
+/// </summary>
+/// <returns>Length of the line, or -1 when no complete line is buffered.</returns>
+int UartLineBuffer_NextLine(UartLineBuffer* buffer, char* line, size_t lineSize);
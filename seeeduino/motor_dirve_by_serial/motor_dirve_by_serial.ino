@@ -1,6 +1,21 @@
 #include "Seeed_BME280.h"
 #include <Wire.h>
 
+// Link to the gateway: 1 exchanges COBS encoded binary frames (see leaf_protocol.h in the
+// gateway), 0 the original text lines. Must match the gateway's LEAF_PROTOCOL_TEXT option.
+#define LEAF_PROTOCOL_BINARY 1
+
+// 1 times the text sensor report against the String formatter it replaced and prints both
+// at start-up, before the link is used. Text protocol only.
+#define SENSOR_REPORT_BENCHMARK 0
+
+// Diagnostics would corrupt the binary link, so they are only printed with the text protocol.
+#if LEAF_PROTOCOL_BINARY
+#define debugPrintln(x)
+#else
+#define debugPrintln(x) Serial.println(x)
+#endif
+
 int motorPin_L_DIR = 12;
 int motorPin_L_BRK = 9;
 int motorPin_L_SPD = 3;
@@ -8,12 +23,88 @@ int motorPin_R_DIR = 13;
 int motorPin_R_BRK = 8;
 int motorPin_R_SPD = 11;
 
-unsigned long lastmillis = 0;
+// Motion profiles: each motor works through queued segments of a target speed, a ramp rate
+// and a duration. A tick every motorTickMillis moves the PWM toward the target, so speed
+// changes do not step the motor current. Speeds are in hundredths of a PWM step, negative
+// in reverse, and a ramp of n PWM steps per second moves n of them per tick.
+struct MotorSegment {
+  int16_t target;
+  uint16_t ramp;      // 0 jumps straight to the target
+  uint16_t duration;  // ms from the segment start, 0 to run until the next one is queued
+  bool brake;
+};
+
+// Must match LEAF_MOTOR_QUEUE in the gateway.
+const uint8_t motorQueueSize = 8;
+
+struct Motor {
+  int dirPin;
+  int brkPin;
+  int spdPin;
+  int16_t speed;
+  MotorSegment segment;
+  unsigned long segmentStarted;
+  MotorSegment queue[motorQueueSize];
+  uint8_t queueHead;
+  uint8_t queueLength;
+};
+
+Motor motors[2] = {
+  { motorPin_L_DIR, motorPin_L_BRK, motorPin_L_SPD },
+  { motorPin_R_DIR, motorPin_R_BRK, motorPin_R_SPD },
+};
+const unsigned long motorTickMillis = 10;
+unsigned long nextMotorTickMillis = 0;
+
 bool isBME280 = false;
 BME280 bme280;
 
+// The BME280 library leaves the sensor in normal mode. The sketch switches it to forced
+// mode and triggers each measurement itself, at a fixed cadence, so every sample has a
+// known trigger time.
+const uint8_t bme280Address = 0x76;
+const uint8_t bme280RegCtrlHum = 0xF2;
+const uint8_t bme280RegCtrlMeas = 0xF4;
+const uint8_t bme280RegConfig = 0xF5;
+// Oversampling codes: 1 = x1, 2 = x2, 3 = x4, 4 = x8, 5 = x16. IIR filter codes: 0 = off,
+// 1..4 = coefficient 2, 4, 8, 16.
+const uint8_t osrsTemperature = 2;
+const uint8_t osrsPressure = 3;
+const uint8_t osrsHumidity = 1;
+const uint8_t iirFilter = 2;
+// Longest measurement for these settings, per the datasheet:
+// 1.25 + 2.3 * 2 + (2.3 * 4 + 0.575) + (2.3 * 1 + 0.575) ms.
+const unsigned long measurementMillis = 19;
+
+uint32_t sampleSequence = 0;
+unsigned long nextSampleMillis = 0;
+unsigned long sampleTriggeredMillis = 0;
+bool isMeasuring = false;
+
 char msgSp = '\t';
 
+// The link always starts at this rate; the binary protocol may then negotiate a faster one.
+const long baseBaudRate = 9600;
+
+void bme280Write(uint8_t reg, uint8_t value)
+{
+  Wire.beginTransmission(bme280Address);
+  Wire.write(reg);
+  Wire.write(value);
+  Wire.endTransmission();
+}
+
+void configureSampler()
+{
+  // The filter setting is only taken in sleep mode, and ctrl_hum only with the next
+  // ctrl_meas write.
+  bme280Write(bme280RegCtrlMeas, 0x00);
+  bme280Write(bme280RegConfig, iirFilter << 2);
+  bme280Write(bme280RegCtrlHum, osrsHumidity);
+  bme280Write(bme280RegCtrlMeas, (osrsTemperature << 5) | (osrsPressure << 2));
+  nextSampleMillis = millis();
+}
+
 void setup() {
   // put your setup code here, to run once:
   pinMode(motorPin_L_DIR, OUTPUT);
@@ -24,18 +115,33 @@ void setup() {
   pinMode(motorPin_R_SPD, OUTPUT);
 
   if (bme280.init()) {
-    lastmillis = millis();
-    isBME280 = true;  
+    configureSampler();
+    isBME280 = true;
   }
 
-  Serial.begin(9600);
+  Serial.begin(baseBaudRate);
+#if !LEAF_PROTOCOL_BINARY && SENSOR_REPORT_BENCHMARK
+  benchmarkSensorReport();
+#endif
 }
 
 bool isDrivingMotors = false;
 unsigned long lastOrderTime = 0;
 unsigned long autoControlDeltaTime = 5000;
 
-int telemtryCycleInMSec = 1000;
+// Sample period; the gateway sends 100 ms to a minute, the same range as is accepted here.
+unsigned long telemtryCycleInMSec = 1000;
+const unsigned long telemtryCycleMinMSec = 100;
+const unsigned long telemtryCycleMaxMSec = 60000;
+
+bool setTelemetryCycle(unsigned long period)
+{
+  if (period < telemtryCycleMinMSec || period > telemtryCycleMaxMSec) {
+    return false;
+  }
+  telemtryCycleInMSec = period;
+  return true;
+}
 
 void orderDrive(int drivePinDir, int drivePinBlk, int speedPin, bool dir, bool brk, int spd)
 {
@@ -45,151 +151,717 @@ void orderDrive(int drivePinDir, int drivePinBlk, int speedPin, bool dir, bool b
   else digitalWrite(drivePinBlk, LOW);
 
   if (brk) analogWrite(speedPin, 0);
-  else {
-    analogWrite(speedPin, spd);
+  else analogWrite(speedPin, spd);
+}
+
+void writeMotor(const Motor& motor)
+{
+  int16_t magnitude = motor.speed < 0 ? -motor.speed : motor.speed;
+  orderDrive(motor.dirPin, motor.brkPin, motor.spdPin, motor.speed > 0, motor.segment.brake, (magnitude + 50) / 100);
+}
+
+Motor* motorFor(char side)
+{
+  if (side == 'L') return &motors[0];
+  if (side == 'R') return &motors[1];
+  return NULL;
+}
+
+// Converts order 'F'orward, 'R'everse, 'B'rake or 'S'top to a segment.
+bool makeSegment(char order, int speed, uint16_t rampPerSecond, uint16_t duration, MotorSegment& segment)
+{
+  if (order != 'F' && order != 'R' && order != 'B' && order != 'S') {
+    return false;
+  }
+  if (!(order == 'F' || order == 'R') || speed > 255) {
+    speed = 0;
+  }
+  segment.target = (int16_t)((order == 'R' ? -speed : speed) * 100);
+  segment.ramp = rampPerSecond;
+  segment.duration = duration;
+  segment.brake = (order == 'B');
+  return true;
+}
+
+void startSegment(Motor& motor, const MotorSegment& segment, unsigned long started)
+{
+  motor.segment = segment;
+  motor.segmentStarted = started;
+  if (segment.brake) {
+    motor.speed = 0;
+  } else {
     isDrivingMotors = true;
     lastOrderTime = millis();
   }
 
+#if !LEAF_PROTOCOL_BINARY
+  int16_t target = segment.target < 0 ? -segment.target : segment.target;
   String msg;
-  msg += "dirp:" + String(drivePinDir);
+  msg += "dirp:" + String(motor.dirPin);
   msg += msgSp;
-  msg += "dirv:" + String(dir);
+  msg += "dirv:" + String(segment.target > 0);
   msg += msgSp;
-  msg += "blkp:" + String(drivePinBlk);
+  msg += "blkp:" + String(motor.brkPin);
   msg += msgSp;
-  msg += "blkv:" + String(brk);
+  msg += "blkv:" + String(segment.brake);
   msg += msgSp;
-  msg += "spdp:" + String(speedPin);
+  msg += "spdp:" + String(motor.spdPin);
   msg += msgSp;
-  msg += "spdv:" + String(spd);
+  msg += "spdv:" + String(target / 100);
   Serial.println(msg);
+#endif
 }
 
-void executeCommand(String command)
-{
-  int leftDrive = -1;
-  int leftSpeed = 0;
-  int rightDrive = -1;
-  int rightSpeed = 0;
-  int order = -1;
-  bool isForwarding = false;
-  bool isBreaking = false;
-  bool isStopping = false;
-  int cmdLen = command.length();
-  Serial.println(cmdLen);
-  if (cmdLen >= 2) {
-    char o = command.charAt(1);
-    Serial.println("c1:"+String(o));
-    if (o == 'F') {
-      order = 1;
-      isForwarding = true;
-    } else if (o == 'R') {
-      order = 2;
-      isForwarding = false;
-    } else if (o == 'B') {
-      order = 3;
-      isBreaking = true;
-    } else if (o == 'S') {
-      order = 0;
-      isStopping = true;
-    }
-    if (order != -1) {
-      char s = command.charAt(0);
-      Serial.println("c0:"+String(s));
-      if (s == 'L') {
-        leftDrive = order;
-      } else if (s == 'R') {
-        rightDrive = order;
-      }
-      if (order == 1 || order == 2) {
-        if (cmdLen >= 5) {
-          String sp = command.substring(2);
-          char spd[4];
-          sp.toCharArray(spd,4);
-          Serial.println("Speed:"+sp);
-          int speed = 0;
-          for (int i=0;i<3;i++) {
-            speed = speed * 10;
-            speed += (spd[i] - '0');
-          }
-          if (speed < 256) {
-            if (s == 'L') {
-              leftSpeed = speed;
-            } else {
-              rightSpeed = speed;
-            }
-          }
+bool queueSegment(Motor& motor, const MotorSegment& segment)
+{
+  if (motor.queueLength == motorQueueSize) {
+    return false;
+  }
+  motor.queue[(motor.queueHead + motor.queueLength) % motorQueueSize] = segment;
+  motor.queueLength++;
+  return true;
+}
+
+// Drops the queued segments; the motor holds its current speed until told otherwise.
+void clearPlan(Motor& motor)
+{
+  motor.queueLength = 0;
+  motor.segment.target = motor.speed;
+  motor.segment.duration = 0;
+}
+
+// Moves on to the next segment when the running one is over, then one tick along the ramp.
+void updateMotor(Motor& motor, unsigned long current)
+{
+  bool changed = false;
+  bool timed = motor.segment.duration != 0;
+  if (timed && current - motor.segmentStarted >= motor.segment.duration) {
+    unsigned long ended = motor.segmentStarted + motor.segment.duration;
+    if (motor.queueLength > 0) {
+      // Timed segments follow each other without gaps, however late the tick.
+      startSegment(motor, motor.queue[motor.queueHead], ended);
+      motor.queueHead = (motor.queueHead + 1) % motorQueueSize;
+      motor.queueLength--;
+      changed = true;
+    } else {
+      // The plan is over; the motor holds its speed until the idle stop.
+      motor.segment.duration = 0;
+      lastOrderTime = millis();
+    }
+  } else if (!timed && motor.queueLength > 0 && motor.speed == motor.segment.target) {
+    startSegment(motor, motor.queue[motor.queueHead], current);
+    motor.queueHead = (motor.queueHead + 1) % motorQueueSize;
+    motor.queueLength--;
+    changed = true;
+  }
+
+  int16_t target = motor.segment.target;
+  long gap = (long)target - motor.speed;
+  if (motor.speed != target) {
+    if (motor.segment.ramp == 0 || (gap < 0 ? -gap : gap) <= motor.segment.ramp) {
+      motor.speed = target;
+    } else {
+      motor.speed = (int16_t)(motor.speed + (gap > 0 ? (long)motor.segment.ramp : -(long)motor.segment.ramp));
+    }
+    changed = true;
+  }
+  if (changed) {
+    writeMotor(motor);
+  }
+}
+
+// Whether a motor still has timed or queued segments to run.
+bool isFollowingPlan()
+{
+  for (uint8_t i = 0; i < 2; i++) {
+    if (motors[i].segment.duration != 0 || motors[i].queueLength > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void runMotors()
+{
+  unsigned long current = millis();
+  if ((long)(current - nextMotorTickMillis) < 0) {
+    return;
+  }
+  nextMotorTickMillis += motorTickMillis;
+  if ((long)(current - nextMotorTickMillis) >= 0) {
+    nextMotorTickMillis = current + motorTickMillis;
+  }
+  updateMotor(motors[0], current);
+  updateMotor(motors[1], current);
+}
+
+// Executes one order right away, replacing the motor's plan: side 'L' or 'R', order
+// 'F'orward, 'R'everse, 'B'rake or 'S'top.
+bool applyOrder(char side, char order, int speed)
+{
+  Motor* motor = motorFor(side);
+  MotorSegment segment;
+  if (motor == NULL || !makeSegment(order, speed, 0, 0, segment)) {
+    return false;
+  }
+  motor->queueLength = 0;
+  startSegment(*motor, segment, millis());
+  motor->speed = segment.target;
+  writeMotor(*motor);
+  return true;
+}
+
+// Brakes both motors and drops their plans.
+void stopMotors()
+{
+  applyOrder('L', 'B', 0);
+  applyOrder('R', 'B', 0);
+}
+
+// Executes one text order such as "LF150" or "RS".
+void executeCommand(const char* command, uint8_t length)
+{
+  debugPrintln(command);
+  if (length < 2) {
+    return;
+  }
+  char o = command[1];
+  char s = command[0];
+  int speed = 0;
+  if ((o == 'F' || o == 'R') && length >= 5) {
+    for (int i = 2; i < 5; i++) {
+      speed = speed * 10;
+      speed += (command[i] - '0');
+    }
+  }
+  applyOrder(s, o, speed);
+}
+
+// Hundredths of value, rounded half away from zero.
+long toCenti(float value)
+{
+  return (long)(value * 100.0f + (value < 0 ? -0.5f : 0.5f));
+}
+
+#if LEAF_PROTOCOL_BINARY
+// Frame: version, type, sequence (uint16), payload, CRC16-CCITT (uint16), little endian,
+// COBS encoded between two 0 bytes.
+const uint8_t leafProtocolVersion = 1;
+const uint8_t frameSensorSample = 0x01;
+const uint8_t frameMotorCommand = 0x02;
+const uint8_t frameAck = 0x03;
+const uint8_t frameConfig = 0x04;
+const uint8_t frameCapabilities = 0x05;
+const uint8_t frameSetBaudRate = 0x06;
+const uint8_t frameFetchSamples = 0x07;
+const uint8_t frameStoredSample = 0x08;
+const uint8_t frameMotorPlan = 0x09;
+const uint8_t ackOk = 0;
+const uint8_t ackUnsupported = 1;
+const uint8_t ackInvalid = 2;
+const uint8_t ackFull = 3;
+const uint8_t configSensorPeriod = 1;
+const uint8_t frameOverhead = 6;
+const uint8_t frameMaxPayload = 32;
+// Largest frame on the wire: COBS adds a byte, plus the two delimiters.
+const uint8_t frameMaxEncoded = frameOverhead + frameMaxPayload + 3;
+
+uint8_t rxFrame[frameOverhead + frameMaxPayload + 1];
+uint8_t rxLength = 0;
+bool rxOverflow = false;
+uint16_t txSequence = 0;
+
+// Bit i of a capability mask stands for baudRates[i]. 230400 is left out: a 16 MHz AVR
+// cannot generate it closely enough.
+const long baudRates[] = { 9600, 19200, 38400, 57600, 115200, 230400 };
+const uint16_t supportedBaudRates = 0x1F;
+// Without a valid frame for this long at a negotiated rate, go back to baseBaudRate, where
+// the gateway looks for the leaf after losing it. The gateway keeps the link busy meanwhile.
+const unsigned long linkSilenceTimeout = 15000;
+long currentBaudRate = baseBaudRate;
+unsigned long lastFrameMillis = 0;
+
+// The latest samples, sequence s in slot s % sampleHistorySize, so the gateway can fetch the
+// ones it missed. Must match LEAF_SAMPLE_HISTORY in the gateway.
+struct StoredSample {
+  int16_t centiDegrees;
+  uint16_t centiPercent;
+  uint32_t pressure;
+  int32_t centimeters;
+  uint32_t tick;
+};
+const uint8_t sampleHistorySize = 16;
+StoredSample sampleHistory[sampleHistorySize];
+// Samples still to resend for a fetch, from fetchNext up to but not including fetchEnd.
+uint32_t fetchNext = 0;
+uint32_t fetchEnd = 0;
+
+void switchBaudRate(long baudRate)
+{
+  Serial.flush();
+  Serial.end();
+  Serial.begin(baudRate);
+  currentBaudRate = baudRate;
+  lastFrameMillis = millis();
+}
+
+void checkLinkSilence()
+{
+  if (currentBaudRate != baseBaudRate && millis() - lastFrameMillis > linkSilenceTimeout) {
+    switchBaudRate(baseBaudRate);
+  }
+}
+
+uint16_t crc16(const uint8_t* data, uint8_t length)
+{
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+void sendFrame(uint8_t type, const uint8_t* payload, uint8_t length)
+{
+  uint8_t raw[frameOverhead + frameMaxPayload];
+  uint8_t rawLength = 0;
+  raw[rawLength++] = leafProtocolVersion;
+  raw[rawLength++] = type;
+  raw[rawLength++] = (uint8_t)txSequence;
+  raw[rawLength++] = (uint8_t)(txSequence >> 8);
+  txSequence++;
+  memcpy(raw + rawLength, payload, length);
+  rawLength += length;
+  uint16_t crc = crc16(raw, rawLength);
+  raw[rawLength++] = (uint8_t)crc;
+  raw[rawLength++] = (uint8_t)(crc >> 8);
+
+  // COBS: each code byte tells how far away the next 0 is.
+  uint8_t encoded[sizeof(raw) + 1];
+  uint8_t written = 1;
+  uint8_t codeIndex = 0;
+  uint8_t code = 1;
+  for (uint8_t i = 0; i < rawLength; i++) {
+    if (raw[i] == 0) {
+      encoded[codeIndex] = code;
+      codeIndex = written++;
+      code = 1;
+    } else {
+      encoded[written++] = raw[i];
+      code++;
+    }
+  }
+  encoded[codeIndex] = code;
+  Serial.write((uint8_t)0);
+  Serial.write(encoded, written);
+  Serial.write((uint8_t)0);
+}
+
+void sendAck(uint8_t type, uint16_t sequence, uint8_t status)
+{
+  uint8_t payload[4] = { type, (uint8_t)sequence, (uint8_t)(sequence >> 8), status };
+  sendFrame(frameAck, payload, sizeof(payload));
+}
+
+void storeSample(float temperature, uint32_t humidity, uint32_t pressure, float altitude, uint32_t sequence, uint32_t tick)
+{
+  StoredSample& sample = sampleHistory[sequence % sampleHistorySize];
+  sample.centiDegrees = (int16_t)toCenti(temperature);
+  sample.centiPercent = (uint16_t)(humidity * 100);
+  sample.pressure = pressure;
+  sample.centimeters = (int32_t)toCenti(altitude);
+  sample.tick = tick;
+}
+
+// Sends the stored sample with this sequence as a frameSensorSample or frameStoredSample.
+void sendSensorSample(uint8_t type, uint32_t sequence)
+{
+  const StoredSample& sample = sampleHistory[sequence % sampleHistorySize];
+  uint8_t payload[21];
+  payload[0] = 0x0F; // temperature, humidity, pressure and altitude
+  payload[1] = (uint8_t)sample.centiDegrees;
+  payload[2] = (uint8_t)((uint16_t)sample.centiDegrees >> 8);
+  payload[3] = (uint8_t)sample.centiPercent;
+  payload[4] = (uint8_t)(sample.centiPercent >> 8);
+  for (uint8_t i = 0; i < 4; i++) {
+    payload[5 + i] = (uint8_t)(sample.pressure >> (8 * i));
+    payload[9 + i] = (uint8_t)((uint32_t)sample.centimeters >> (8 * i));
+    payload[13 + i] = (uint8_t)(sequence >> (8 * i));
+    payload[17 + i] = (uint8_t)(sample.tick >> (8 * i));
+  }
+  sendFrame(type, payload, sizeof(payload));
+}
+
+uint32_t oldestStoredSample()
+{
+  return sampleSequence > sampleHistorySize ? sampleSequence - sampleHistorySize : 0;
+}
+
+// Resends fetched samples while the transmit buffer has room for a whole frame, so a burst
+// never holds up the loop.
+void sendFetchedSamples()
+{
+  while (fetchNext < fetchEnd && Serial.availableForWrite() >= frameMaxEncoded) {
+    // Newer samples may have replaced the oldest ones since the fetch arrived.
+    if (fetchNext >= oldestStoredSample()) {
+      sendSensorSample(frameStoredSample, fetchNext);
+    }
+    fetchNext++;
+  }
+}
+
+// Plan payload: mask of motors whose plans it replaces, bit 0 'L' and bit 1 'R', then
+// segments of motor, order, speed, ramp in PWM steps per second (uint16) and duration in ms
+// (uint16). Nothing is applied unless every segment is valid and fits its motor's queue.
+uint8_t applyPlan(const uint8_t* payload, uint8_t length)
+{
+  const uint8_t segmentLength = 7;
+  if (length < 1 + segmentLength || (length - 1) % segmentLength != 0) {
+    return ackInvalid;
+  }
+  uint8_t replace = payload[0];
+  uint8_t needed[2] = { 0, 0 };
+  MotorSegment segment;
+  for (uint8_t i = 1; i < length; i += segmentLength) {
+    Motor* motor = motorFor((char)payload[i]);
+    if (motor == NULL || !makeSegment((char)payload[i + 1], payload[i + 2], 0, 0, segment)) {
+      return ackInvalid;
+    }
+    needed[motor - motors]++;
+  }
+  for (uint8_t m = 0; m < 2; m++) {
+    uint8_t queued = (replace & (1 << m)) ? 0 : motors[m].queueLength;
+    if (queued + needed[m] > motorQueueSize) {
+      return ackFull;
+    }
+  }
+
+  for (uint8_t m = 0; m < 2; m++) {
+    if (replace & (1 << m)) {
+      clearPlan(motors[m]);
+    }
+  }
+  for (uint8_t i = 1; i < length; i += segmentLength) {
+    uint16_t ramp = payload[i + 3] | ((uint16_t)payload[i + 4] << 8);
+    uint16_t duration = payload[i + 5] | ((uint16_t)payload[i + 6] << 8);
+    makeSegment((char)payload[i + 1], payload[i + 2], ramp, duration, segment);
+    queueSegment(*motorFor((char)payload[i]), segment);
+  }
+  return ackOk;
+}
+
+// Decodes the COBS frame in rxFrame in place and executes it.
+void handleFrame()
+{
+  uint8_t length = 0;
+  uint8_t read = 0;
+  while (read < rxLength) {
+    uint8_t code = rxFrame[read++];
+    if (code == 0 || read + code - 1 > rxLength) {
+      return;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      rxFrame[length++] = rxFrame[read++];
+    }
+    if (code != 0xFF && read < rxLength) {
+      rxFrame[length++] = 0;
+    }
+  }
+  if (length < frameOverhead) {
+    return;
+  }
+  uint16_t crc = rxFrame[length - 2] | ((uint16_t)rxFrame[length - 1] << 8);
+  if (crc16(rxFrame, length - 2) != crc || rxFrame[0] != leafProtocolVersion) {
+    return;
+  }
+
+  lastFrameMillis = millis();
+
+  uint8_t type = rxFrame[1];
+  uint16_t sequence = rxFrame[2] | ((uint16_t)rxFrame[3] << 8);
+  const uint8_t* payload = rxFrame + 4;
+  uint8_t payloadLength = length - frameOverhead;
+  uint8_t status = ackOk;
+  if (type == frameCapabilities) {
+    // Answered with our own capabilities rather than an ack.
+    uint8_t reply[2] = { (uint8_t)supportedBaudRates, (uint8_t)(supportedBaudRates >> 8) };
+    sendFrame(frameCapabilities, reply, sizeof(reply));
+    return;
+  } else if (type == frameSetBaudRate) {
+    status = ackUnsupported;
+    if (payloadLength < 4) {
+      status = ackInvalid;
+    } else {
+      long baudRate = payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+      for (uint8_t i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++) {
+        if (baudRates[i] == baudRate && (supportedBaudRates & (1 << i))) {
+          // The ack still goes out at the old rate.
+          sendAck(type, sequence, ackOk);
+          switchBaudRate(baudRate);
+          return;
         }
       }
     }
+  } else if (type == frameFetchSamples) {
+    // Resend every stored sample from the given sequence on; a new fetch replaces the last.
+    if (payloadLength < 4) {
+      status = ackInvalid;
+    } else {
+      uint32_t from = payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+      fetchNext = from > oldestStoredSample() ? from : oldestStoredSample();
+      fetchEnd = sampleSequence;
+    }
+  } else if (type == frameMotorPlan) {
+    status = applyPlan(payload, payloadLength);
+  } else if (type == frameMotorCommand) {
+    // One order of side, order and speed bytes per motor.
+    if (payloadLength == 0 || payloadLength % 3 != 0) {
+      status = ackInvalid;
+    }
+    for (uint8_t i = 0; status == ackOk && i < payloadLength; i += 3) {
+      if (!applyOrder((char)payload[i], (char)payload[i + 1], payload[i + 2])) {
+        status = ackInvalid;
+      }
+    }
+  } else if (type == frameConfig) {
+    if (payloadLength < 5 || payload[0] != configSensorPeriod) {
+      status = ackUnsupported;
+    } else {
+      uint32_t period = payload[1] | ((uint32_t)payload[2] << 8) | ((uint32_t)payload[3] << 16) | ((uint32_t)payload[4] << 24);
+      if (!setTelemetryCycle(period)) {
+        status = ackInvalid;
+      }
+    }
+  } else {
+    status = ackUnsupported;
+  }
+  sendAck(type, sequence, status);
+}
+
+void receiveFrames()
+{
+  while (Serial.available() > 0) {
+    uint8_t b = Serial.read();
+    if (b != 0) {
+      if (rxLength < sizeof(rxFrame)) {
+        rxFrame[rxLength++] = b;
+      } else {
+        rxOverflow = true;
+      }
+      continue;
+    }
+    if (rxLength > 0 && !rxOverflow) {
+      handleFrame();
+    }
+    rxLength = 0;
+    rxOverflow = false;
+  }
+}
+#else
+// The sensor line is built in a stack buffer with integer arithmetic: String concatenation
+// and float printing fragment the 2 KB heap and take milliseconds per report.
+char* appendText(char* p, const char* text)
+{
+  while (*text != '\0') {
+    *p++ = *text++;
+  }
+  return p;
+}
+
+char* appendUnsigned(char* p, unsigned long value)
+{
+  char digits[10];
+  uint8_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (count > 0) {
+    *p++ = digits[--count];
+  }
+  return p;
+}
+
+// Writes centi / 100 with two decimals, as String(float) would, e.g. -346 as "-3.46".
+char* appendCenti(char* p, long centi)
+{
+  unsigned long magnitude = centi < 0 ? 0UL - (unsigned long)centi : (unsigned long)centi;
+  if (centi < 0) {
+    *p++ = '-';
+  }
+  p = appendUnsigned(p, magnitude / 100);
+  *p++ = '.';
+  *p++ = '0' + (magnitude / 10) % 10;
+  *p++ = '0' + magnitude % 10;
+  return p;
+}
+
+// Writes the report into line, which has room for every field at its widest.
+void formatSensorReport(char* line, float temperature, uint32_t humidity, uint32_t pressure, float altitude, uint32_t sequence, uint32_t tick)
+{
+  char* p = appendText(line, "sensors:temp=");
+  p = appendCenti(p, toCenti(temperature));
+  p = appendText(p, ",humi=");
+  p = appendUnsigned(p, humidity);
+  p = appendText(p, ",pres=");
+  p = appendUnsigned(p, pressure);
+  p = appendText(p, ",alti=");
+  p = appendCenti(p, toCenti(altitude));
+  p = appendText(p, ",seqn=");
+  p = appendUnsigned(p, sequence);
+  p = appendText(p, ",tick=");
+  p = appendUnsigned(p, tick);
+  *p++ = ':';
+  *p = '\0';
+}
+
+void sendSensorReport(float temperature, uint32_t humidity, uint32_t pressure, float altitude, uint32_t sequence, uint32_t tick)
+{
+  char line[128];
+  formatSensorReport(line, temperature, humidity, pressure, altitude, sequence, tick);
+  Serial.println(line);
+}
+
+#if SENSOR_REPORT_BENCHMARK
+// The report as it was built before formatSensorReport.
+String formatSensorReportString(float temperature, uint32_t humidity, uint32_t pressure, float altitude, uint32_t sequence, uint32_t tick)
+{
+  return "sensors:temp=" + String(temperature) + ",humi=" + String(humidity) + ",pres=" + String(pressure) + ",alti=" + String(altitude) + ",seqn=" + String(sequence) + ",tick=" + String(tick) + ":";
+}
+
+void benchmarkSensorReport()
+{
+  const int rounds = 200;
+  volatile unsigned long sink = 0;
+  char line[128];
+
+  unsigned long started = micros();
+  for (int i = 0; i < rounds; i++) {
+    String report = formatSensorReportString(-12.34f + i, 47, 101325, 123.46f, i, started);
+    sink += report.length();
   }
-  if (leftDrive != -1) {
-    orderDrive(motorPin_L_DIR, motorPin_L_BRK, motorPin_L_SPD, isForwarding, isBreaking, leftSpeed);
+  unsigned long stringMicros = micros() - started;
+
+  started = micros();
+  for (int i = 0; i < rounds; i++) {
+    formatSensorReport(line, -12.34f + i, 47, 101325, 123.46f, i, started);
+    sink += strlen(line);
   }
-  if (rightDrive != -1) {
-    orderDrive(motorPin_R_DIR, motorPin_R_BRK, motorPin_R_SPD, isForwarding, isBreaking, rightSpeed);
+  unsigned long bufferMicros = micros() - started;
+
+  Serial.println(formatSensorReportString(-12.34f, 47, 101325, 123.46f, 0, 0));
+  formatSensorReport(line, -12.34f, 47, 101325, 123.46f, 0, 0);
+  Serial.println(line);
+  Serial.print("String: ");
+  Serial.print(stringMicros / rounds);
+  Serial.print(" us, buffer: ");
+  Serial.print(bufferMicros / rounds);
+  Serial.println(" us per report");
+}
+#endif
+
+// Commands such as "LF150;RS" or "sensor:1000" end with a NUL or a line break. They are
+// read a byte at a time as they arrive and each ';' separated command runs once complete.
+char commandBuffer[24];
+uint8_t commandLength = 0;
+bool commandOverflow = false;
+
+void dispatchCommand()
+{
+  commandBuffer[commandLength] = '\0';
+  if (strncmp(commandBuffer, "sensor:", 7) == 0) {
+    char* end;
+    unsigned long period = strtoul(commandBuffer + 7, &end, 10);
+    if (end == commandBuffer + 7 || *end != '\0') {
+      return;
+    }
+    setTelemetryCycle(period);
+  } else {
+    executeCommand(commandBuffer, commandLength);
   }
 }
 
-void serialEvent()
+void receiveCommands()
 {
-  String command = Serial.readString();
-  String sensorCommandKey = "sensor:";
-  if (command.indexOf(sensorCommandKey) >=0) {
-    String sensorSetting = command.substring(sensorCommandKey.length());
-    telemtryCycleInMSec = sensorSetting.toInt();
-//    Serial.println(telemtryCycleInMSec);
-//    delay(2000);
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != ';' && c != '\0' && c != '\n' && c != '\r') {
+      if (commandLength < sizeof(commandBuffer) - 1) {
+        commandBuffer[commandLength++] = c;
+      } else {
+        commandOverflow = true;
+      }
+      continue;
+    }
+    if (commandLength > 0 && !commandOverflow) {
+      dispatchCommand();
+    }
+    commandLength = 0;
+    commandOverflow = false;
+  }
+}
+#endif
+
+// Triggers a measurement when the next sample is due and sends it once the sensor is done,
+// without waiting in between. Samples are due every telemtryCycleInMSec from the first one,
+// however late an earlier one was taken.
+void runSampler()
+{
+  unsigned long current = millis();
+  if (!isMeasuring) {
+    if ((long)(current - nextSampleMillis) < 0) {
+      return;
+    }
+    bme280Write(bme280RegCtrlMeas, (osrsTemperature << 5) | (osrsPressure << 2) | 0x01);
+    sampleTriggeredMillis = current;
+    isMeasuring = true;
+    nextSampleMillis += telemtryCycleInMSec;
+    if ((long)(current - nextSampleMillis) >= 0) {
+      // A whole period behind, e.g. after the period was changed; start the cadence over.
+      nextSampleMillis = current + telemtryCycleInMSec;
+    }
     return;
   }
-  int clnIndex = command.indexOf(";");
-  executeCommand(command);
-  if (clnIndex > 0){
-    String command2 = command.substring(clnIndex+1);
-    executeCommand(command2);
+  if (current - sampleTriggeredMillis < measurementMillis) {
+    return;
   }
+  isMeasuring = false;
+  float temperature = bme280.getTemperature();
+  uint32_t pressure = bme280.getPressure();
+  uint32_t humidity = bme280.getHumidity();
+  float altidute = bme280.calcAltitude(pressure);
+#if LEAF_PROTOCOL_BINARY
+  storeSample(temperature, humidity, pressure, altidute, sampleSequence, sampleTriggeredMillis);
+  sendSensorSample(frameSensorSample, sampleSequence);
+#else
+  sendSensorReport(temperature, humidity, pressure, altidute, sampleSequence, sampleTriggeredMillis);
+#endif
+  sampleSequence++;
 }
 
 void loop() {
   // put your main code here, to run repeatedly:
 
-  // Serial.println("message waiting...");
-//  if (Serial.available()){
-//    String command = Serial.readString();
-//    Serial.println("received message:");
-//    Serial.println(command);
-//    int clnIndex = command.indexOf(";");
-//    executeCommand(command);
-//    if (clnIndex > 0){
-//      String command2 = command.substring(clnIndex+1);
-//      Serial.println("2nd command:"+command2);
-//      executeCommand(command2);
-//    }
-//  }
+  // Whatever arrived since the last pass; neither path waits for more.
+#if LEAF_PROTOCOL_BINARY
+  receiveFrames();
+  checkLinkSilence();
+  sendFetchedSamples();
+#else
+  receiveCommands();
+#endif
   unsigned long currentTick = millis();
-  if ( isDrivingMotors && ((currentTick - lastOrderTime) > autoControlDeltaTime)){
-      orderDrive(motorPin_L_DIR, motorPin_L_BRK, motorPin_L_SPD, true, true, 0);
-      orderDrive(motorPin_R_DIR, motorPin_R_BRK, motorPin_R_SPD, true, true, 0);
+  // A plan keeps the motors going past the idle stop until its last timed segment is over.
+  if ( isDrivingMotors && !isFollowingPlan() && ((currentTick - lastOrderTime) > autoControlDeltaTime)){
+    stopMotors();
     isDrivingMotors = false;
   }
+  runMotors();
   
   if (isBME280) {
-    unsigned long current = millis();
-    if (current - lastmillis >= telemtryCycleInMSec) {
-      float temperature = bme280.getTemperature();
-      uint32_t pressure = bme280.getPressure();
-      uint32_t humidity = bme280.getHumidity();
-      float altidute = bme280.calcAltitude(pressure);
-      String msg = "sensors:temp=" + String(temperature) + ",humi=" + String(humidity) + ",pres=" + String(pressure) + ",alti=" + String(altidute) + ":";
-      int msgLen = msg.length();
-      if (msgLen < 62){
-        for (;msgLen<62;msgLen++) {
-          msg += " ";
-        }
-      }
-      Serial.println(msg);      
-      lastmillis = current;
-    }
+    runSampler();
   }
 }